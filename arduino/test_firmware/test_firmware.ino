@@ -12,6 +12,8 @@ Comments: this file belong to the ArduiPi project
 =========================================================================== */
 
 #include <arduino.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 #include <Wire.h>
 #include <SPI.h>
 #include <DS2482.h>
@@ -22,10 +24,45 @@ Comments: this file belong to the ArduiPi project
 // ======================================================================
 #define  SLAVE_ADDRESS	0x2a  /* slave address,any number from 0x01 to 0x7F */
 #define  CMD_MAX_SIZE   16  	/* max command size */
+#define  CMD_RSP_MAX_SIZE 32 	/* max response size (Wire buffer size) */
+#define  CMD_POOL_SIZE  8   	/* command descriptors (power of 2, 8 max) */
+#define  CMD_POOL_MASK  (CMD_POOL_SIZE - 1)
+#define  SERIAL_BAUD    1000000	/* exact at 16MHz (U2X, UBRR 1) */
+#define  SER_RX_SIZE    (CMD_MAX_SIZE + 4)	/* encoded request, or text line */
+#define  SER_TX_SIZE    (CMD_RSP_MAX_SIZE + 3)	/* seq status response crc */
+#define  SER_OP_GET     0x01	/* serial request op, 0x00 is set */
+#define  ADC_CHANNELS   6   	/* analog inputs A0..A5 */
+#define  ADC_CH_BANDGAP ADC_CHANNELS  	/* 1.1V reference scanned after A5 */
+#define  ADC_SCAN_CHANNELS (ADC_CHANNELS + 1)
+#define  ADC_SAMPLE_HZ  1400 	/* conversions per second, all channels */
+#define  ADC_RING_SIZE  16  	/* samples kept per channel (power of 2) */
+#define  ADC_RING_MASK  (ADC_RING_SIZE - 1)
+#define  ADC_DRAIN_MAX  13  	/* samples per drain response */
+#define  PERF_SIZE      28  	/* performance counters response size */
+#define  WATCH_SIZE     7   	/* input changes response size */
 #define  MAX_SENT_BYTES 3
 #define  IDENTIFICATION 0x0D
+#define  TWBR_100KHZ    72  	/* i2c master 100KHz at 16MHz, no prescaler */
+#define  TWBR_400KHZ    12  	/* i2c master 400KHz at 16MHz, no prescaler */
+#define  TWBR_MIN       10  	/* fastest TWBR accepted */
 #define  LOOP_DELAY 	2000 		/* by default blink led every 2 seconds */
 #define  BLINK_VALUE	LOOP_DELAY / 2 
+#define  TASK_ANALOG_MS 10  	/* analog values check period */
+#define  TASK_LED_MS    100 	/* led blink step period */
+#define  TASK_OLED_MS   20  	/* one OLED line drawn per period */
+#define  TASK_1WIRE_MS  10  	/* 1-Wire state machine step period */
+#define  OW_SEARCH_MS   5000	/* 1-Wire device search retry period */
+#define  OW_CONVERT_MS  750 	/* 12 bits temperature conversion time */
+#define  OW_MAX_SENSORS 24  	/* 1-Wire temperature sensors enumerated */
+#define  OW_PAGE        13  	/* temperatures per get response */
+#define  OW_PAGE_SIZE   (4 + 2 * OW_PAGE)	/* count, seq, search, first then temperatures */
+#define  OW_TEMP_NONE   ((int16_t) 0x8000)	/* temperature not read yet */
+#define  OW_RESCAN      0xFF	/* first sensor of get asking a new search */
+#define  OW_CONVERT_T   0x44	/* DS18x20 start conversion */
+#define  OW_READ_SCRATCH 0xBE	/* DS18x20 read scratchpad */
+#define  OW_FAMILY_DS18S20 0x10
+#define  OW_FAMILY_DS1822  0x22
+#define  OW_FAMILY_DS18B20 0x28
 
 //#define	 DEBUG_SERIAL
 
@@ -47,8 +84,18 @@ Comments: this file belong to the ArduiPi project
 #define	 CMD_DDR7_PIN				0xD7
 #define	 CMD_DDR_ARDUINO		0xDD
 #define	 CMD_PING						0xE0
-#define	 CMD_PORT_VALUE			0xF0
-#define	 CMD_DDR_VALUE			0xFD
+#define	 CMD_SNAPSHOT				0xE1
+#define	 CMD_ADC_DRAIN			0xE2
+#define	 CMD_PERF						0xE3
+#define	 CMD_I2C_SPEED			0xE4
+#define	 CMD_CRC						0xE5
+#define	 CRC_ACK						0x06	/* protected set received */
+#define	 CRC_NAK						0x15	/* protected command dropped, bad CRC */
+#define	 CMD_WATCH					0xE6
+#define	 CMD_1WIRE					0xE7
+#define	 CMD_1WIRE_ROM			0xE8
+#define	 CMD_PORT_VALUE			0xF0	/* PORT set of masked bits */
+#define	 CMD_DDR_VALUE			0xFD	/* DDR set of masked bits */
 #define	 CMD_SEPARATOR			0xFF
 
 
@@ -58,39 +105,133 @@ Comments: this file belong to the ArduiPi project
 #define PS_64  ((1 << ADPS2) | (1 << ADPS1))
 #define PS_128 ((1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0))
 
+// ADMUX channel selection, 1110 is 1.1V (VBG) 
+#define ADC_MUX(ch)	((ch) == ADC_CH_BANDGAP ? 0b00001110 : (ch))
+
 #define pinLed 2
+#define pinIrq 9  	/* input changes pending line to Pi (PB1) */
 
 // State machine for parsing received command
 enum parse_cmd	{ PARSE_CMD, PARSE_DATA, PARSE_NEXT, PARSE_ALL, PARSE_ERR, PARSE_OK };
 
+// 1-Wire state machine, sensors enumerated one per step, then conversions
+// started on all sensors at once and results read one sensor per step
+enum ow_state	{ OW_IDLE, OW_SEARCH, OW_CONVERT, OW_WAIT, OW_READ };
+
+// Interface the command has been received from
+enum cmd_src	{ SRC_I2C, SRC_SPI, SRC_SER };
+
+// command descriptor, filled by an interface then parsed in place
+struct cmd_desc
+{
+	byte buf[CMD_MAX_SIZE];									// command byte and parameters
+	byte len;																// command size
+	byte src;																// interface (SRC_xxx)
+	boolean crc;														// CRC protected, response need CRC
+	unsigned long time;											// micros() when queued to main loop
+};
+
+// command being parsed, given to command handlers
+struct cmd_ctx
+{
+	volatile byte * prx;										// command parameters, after command byte
+	byte len;																// command size, command byte included
+	volatile byte * ptx;										// response buffer
+	volatile byte * ptx_len;								// response size
+	byte src;																// interface (SRC_xxx)
+	boolean is_get;													// response is needed
+};
+
+// command handler, argument come from command table
+typedef void (*cmd_fn)(struct cmd_ctx * ctx, byte arg);
+
+// command table entry
+struct cmd_entry
+{
+	cmd_fn fn;
+	byte arg;
+};
+
+// cooperative task, run from loop() when its period elapsed
+struct task
+{
+	void (*run)(void);
+	unsigned long period;										// ms between runs
+	unsigned long last;											// millis() of last run
+};
+
 // ======================================================================
 // Volatile Global vars, may be used in interrupts
 // standard Global vars 
 // ======================================================================
-volatile byte g_i2c_rx_buf[CMD_MAX_SIZE];	// i2c command sent by the master
-volatile byte g_i2c_rx_len=0;							// i2c command len sent by the master
-volatile byte g_spi_rx_buf[CMD_MAX_SIZE];	// spi command sent by the master
-volatile byte g_spi_rx_len=0;							// spi command len sent by the master
-volatile byte g_ser_rx_buf[CMD_MAX_SIZE];	// serial command sent by the master
-volatile byte g_ser_rx_len=0;							// serial command len sent by the master
-volatile boolean g_i2c_new = false;			// new i2c command received to treat
+struct cmd_desc g_cmd_pool[CMD_POOL_SIZE];	// command descriptors of all interfaces
+volatile uint8_t g_cmd_free = (1 << CMD_POOL_SIZE) - 1;	// free descriptors bitmap
+volatile uint8_t g_cmd_queue[CMD_POOL_SIZE];	// descriptors queued by ISRs to main loop
+volatile uint8_t g_cmd_head = 0;					// next queue slot, written by ISRs only
+volatile uint8_t g_cmd_tail = 0;					// next queued slot, written by main loop only
+struct cmd_desc * volatile g_spi_cmd = NULL;	// spi command being received
+byte g_ser_rx[SER_RX_SIZE];								// serial frame or text line being received
+byte g_ser_rx_len = 0;
+boolean g_ser_skip = false;								// overflow, skip until end of frame or line
 volatile boolean g_spi_new = false;			// new spi command received to treat
-volatile boolean g_ser_new = false;			// new serial command received to treat
 volatile byte g_i2c_tx_len = 0;						// lenght of i2c data to return to master
 volatile byte g_spi_tx_len = 0;						// lenght of spi data to return to master
-volatile byte g_ser_tx_len = 0;						// lenght of serial data to return to master
-//volatile byte g_spi_pos = 0;						// SPI pointer on receive buffer
+volatile byte g_spi_tx_pos = 0;						// next spi response byte to send
 volatile byte g_cmd_err = 0;							// global command error
 
 volatile long g_vcc = 0;									// vcc value (read from ADC)
-
-byte g_i2c_tx_buf[CMD_MAX_SIZE]; 					// i2c buffer of returned data to master
-byte g_spi_tx_buf[CMD_MAX_SIZE]; 					// spi buffer of returned data to master
-byte g_ser_tx_buf[CMD_MAX_SIZE]; 					// serial buffer of returned data to master
+volatile uint16_t g_adc[ADC_SCAN_CHANNELS];		// last raw analog values (read from ADC)
+volatile uint16_t g_adc_ring[ADC_SCAN_CHANNELS][ADC_RING_SIZE]; // samples not yet drained
+volatile uint8_t g_adc_head[ADC_SCAN_CHANNELS];		// next ring position to write
+volatile uint8_t g_adc_count[ADC_SCAN_CHANNELS];	// samples waiting in ring
+volatile uint8_t g_adc_dropped[ADC_SCAN_CHANNELS];	// samples lost since last drain
+volatile uint16_t g_adc_last[ADC_SCAN_CHANNELS];	// sweep number of last sample
+volatile uint8_t g_adc_ch;													// channel being converted
+volatile uint16_t g_adc_sweep;											// current sweep number
+byte g_snapshot_seq = 0;									// snapshot sequence number
+volatile uint8_t g_watch[3];							// watched inputs masks per port (0:B 1:C 2:D)
+volatile uint8_t g_pin_last[3];						// pins at last pin change interrupt
+volatile uint8_t g_changed[3];						// watched inputs changed since last get
+volatile uint8_t g_changes = 0;						// changes since last get (saturate)
+
+// performance counters, counters wrap, times are in us
+struct perf_counters
+{
+	uint16_t cmd[3];												// commands per interface (SRC_xxx)
+	uint16_t overflow[3];										// receive buffer overflows per interface
+	uint16_t parse_max;											// longest parse_cmd()
+	uint32_t loop_max;											// longest main loop iteration
+	uint16_t sweep;													// last ADC sweep (all channels)
+	uint16_t sweep_max;											// longest ADC sweep
+	uint16_t adc_dropped;										// ADC samples lost, ring full
+	uint16_t dispatch_max;									// longest wait of a command for main loop
+	uint16_t crc_err;												// commands dropped, bad CRC
+};
+volatile struct perf_counters g_perf;
+volatile unsigned long g_adc_sweep_start;		// time current ADC sweep started
+byte g_nblink = 2;												// led blink steps to do (2 per blink)
+byte g_oled_line = 0;											// next OLED line to draw, 0 if none
+
+byte g_i2c_tx_buf[CMD_RSP_MAX_SIZE]; 			// i2c buffer of returned data to master
+byte g_spi_tx_buf[CMD_RSP_MAX_SIZE]; 			// spi buffer of returned data to master
+byte g_ser_tx_buf[SER_TX_SIZE]; 					// serial response frame, data after seq and status
+volatile byte g_ser_tx_len = 0;						// lenght of serial data to return to master
 byte g_cmd_size;													// new command size (can identify quickly simple command)
 byte g_cmd_send= false;									// new data to send to master
 byte g_ping = 0x2a;												// default ping value data to respond
-byte g_ds18b20[8] ;
+byte g_ow_rom[OW_MAX_SENSORS][8];					// 1-Wire sensors ROM codes
+volatile int16_t g_ow_temp[OW_MAX_SENSORS];	// last temperatures (1/16 C), read from ISR
+volatile byte g_ow_count = 0;							// 1-Wire sensors enumerated
+volatile byte g_ow_seq = 0;								// 1-Wire conversion rounds read
+volatile byte g_ow_search = 0;							// 1-Wire searches done, ROM codes may have changed
+byte g_ow_state = OW_IDLE;								// 1-Wire state machine (OW_xxx)
+byte g_ow_next;														// next sensor to read
+unsigned long g_ow_time = 0;							// millis() of last search or conversion start
+volatile boolean g_ow_rescan = false;			// search sensors again asked by master
+
+// AVR port and DDR registers indexed by port (0:B 1:C 2:D)
+volatile uint8_t * const g_port[3] = { &PORTB, &PORTC, &PORTD };
+volatile uint8_t * const g_ddr[3] = { &DDRB, &DDRC, &DDRD };
 char buff[17];
 
 
@@ -106,27 +247,556 @@ volatile boolean g_analog_tested  = false;	// indicate that analog input test pa
 
 
 /* ======================================================================
-Function: readADC
-Purpose : Read Analog Avlue
+Function: cmd_alloc
+Purpose : get a free command descriptor
+Input 	: interface the command will be received from (SRC_xxx)
+Output	: command descriptor, NULL if none is free
+Comments: called from ISR or main loop
+====================================================================== */
+struct cmd_desc * cmd_alloc(byte src)
+{
+	struct cmd_desc * d = NULL;
+	uint8_t i;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for (i = 0; i < CMD_POOL_SIZE; i++)
+		{
+			if ( g_cmd_free & _BV(i) )
+			{
+				g_cmd_free &= ~_BV(i);
+				d = &g_cmd_pool[i];
+				d->len = 0;
+				d->src = src;
+				d->crc = false;
+				break;
+			}
+		}
+	}
+
+	return d;
+}
+
+/* ======================================================================
+Function: cmd_free
+Purpose : give back a command descriptor to the pool
+Input 	: command descriptor
+Output	: -
+Comments: called from ISR or main loop
+====================================================================== */
+void cmd_free(struct cmd_desc * d)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		g_cmd_free |= _BV(d - g_cmd_pool);
+	}
+}
+
+/* ======================================================================
+Function: cmd_push
+Purpose : queue a received command to main loop
+Input 	: command descriptor
+Output	: -
+Comments: ISR only, AVR ISRs don't nest so they are the single producer
+					queue can't be full, it has a slot per descriptor
+====================================================================== */
+void cmd_push(struct cmd_desc * d)
+{
+	d->time = micros();
+	g_cmd_queue[g_cmd_head & CMD_POOL_MASK] = d - g_cmd_pool;
+
+	// publish slot, byte write is atomic
+	g_cmd_head++;
+}
+
+/* ======================================================================
+Function: cmd_pop
+Purpose : get oldest command queued by ISRs
 Input 	: -
-Output	: value readed
-Comments: Channel needed to read has been selected before
+Output	: command descriptor, NULL if queue is empty
+Comments: main loop only, the single consumer, descriptor must be 
+					freed once done
 ====================================================================== */
-uint16_t readADC()
+struct cmd_desc * cmd_pop()
 {
-	uint8_t low, high;
+	struct cmd_desc * d;
 
-	// Start Convertion
-	ADCSRA |= _BV(ADSC); 
-	
-	// wait end
-	while (bit_is_set(ADCSRA,ADSC));
-	
-	// read low first
-	low  = ADCL;
-	high = ADCH;
+	if ( g_cmd_tail == g_cmd_head )
+		return NULL;
+
+	d = &g_cmd_pool[g_cmd_queue[g_cmd_tail & CMD_POOL_MASK]];
+	g_cmd_tail++;
+
+	return d;
+}
+
+/* ======================================================================
+Function: crc8_byte
+Purpose : CRC-8 of one byte
+Input 	: byte
+					bits left to do
+Output	: CRC-8 (SMBus PEC, x^8+x^2+x+1)
+Comments: evaluated at compile time to build g_crc8_table
+====================================================================== */
+constexpr byte crc8_byte(byte c, uint8_t bits)
+{
+	return bits ? crc8_byte( (c & 0x80) ? (c << 1) ^ 0x07 : c << 1, bits - 1) : c;
+}
+
+// CRC-8 table, one entry per byte value, in flash
+#define CRC8_ROW(h)	crc8_byte(h|0x0, 8), crc8_byte(h|0x1, 8), crc8_byte(h|0x2, 8), crc8_byte(h|0x3, 8), \
+										crc8_byte(h|0x4, 8), crc8_byte(h|0x5, 8), crc8_byte(h|0x6, 8), crc8_byte(h|0x7, 8), \
+										crc8_byte(h|0x8, 8), crc8_byte(h|0x9, 8), crc8_byte(h|0xA, 8), crc8_byte(h|0xB, 8), \
+										crc8_byte(h|0xC, 8), crc8_byte(h|0xD, 8), crc8_byte(h|0xE, 8), crc8_byte(h|0xF, 8)
+
+const byte g_crc8_table[256] PROGMEM =
+{
+	CRC8_ROW(0x00), CRC8_ROW(0x10), CRC8_ROW(0x20), CRC8_ROW(0x30), 
+	CRC8_ROW(0x40), CRC8_ROW(0x50), CRC8_ROW(0x60), CRC8_ROW(0x70), 
+	CRC8_ROW(0x80), CRC8_ROW(0x90), CRC8_ROW(0xA0), CRC8_ROW(0xB0), 
+	CRC8_ROW(0xC0), CRC8_ROW(0xD0), CRC8_ROW(0xE0), CRC8_ROW(0xF0)
+};
+
+/* ======================================================================
+Function: crc8
+Purpose : CRC-8 of a buffer
+Input 	: CRC of previous bytes (0 to start)
+					buffer
+					size of buffer
+Output	: CRC-8
+Comments: table driven, fast enough for ISR
+====================================================================== */
+byte crc8(byte crc, volatile byte * p, byte len)
+{
+	while (len--)
+		crc = pgm_read_byte(&g_crc8_table[crc ^ *p++]);
+
+	return crc;
+}
+
+/* ======================================================================
+Function: cmd_unwrap
+Purpose : check and remove CRC protection of a received command
+Input 	: command descriptor
+Output	: false if command must be dropped (bad CRC)
+Comments: protected frame is CMD_CRC, command, parameters, CRC-8 of 
+					all previous bytes, response of a protected get will end 
+					with a CRC too, see parse_cmd()
+====================================================================== */
+boolean cmd_unwrap(struct cmd_desc * d)
+{
+	byte i;
+
+	if ( d->buf[0] != CMD_CRC )
+		return true;
+
+	if ( d->len < 3 || crc8(0, d->buf, d->len - 1) != d->buf[d->len - 1] )
+	{
+		g_perf.crc_err++;
+		return false;
+	}
+
+	d->len -= 2;
+	d->crc = true;
+
+	for (i = 0; i < d->len; i++)
+		d->buf[i] = d->buf[i + 1];
+
+	return true;
+}
+
+/* ======================================================================
+Function: cmd_ack
+Purpose : prepare acknowledge of a protected command
+Input 	: interface the command has been received from (SRC_I2C or SRC_SPI)
+					status (CRC_ACK or CRC_NAK)
+Output	: -
+Comments: response is status then CRC-8 of CMD_CRC and status, so master
+					know a protected set has been received, serial frames have 
+					their own status
+====================================================================== */
+void cmd_ack(byte src, byte status)
+{
+	byte cmd = CMD_CRC;
+	byte * ptx = src == SRC_I2C ? g_i2c_tx_buf : g_spi_tx_buf;
+
+	ptx[0] = status;
+	ptx[1] = crc8( crc8(0, &cmd, 1), ptx, 1);
+
+	if ( src == SRC_I2C )
+		g_i2c_tx_len = 2;
+	else
+		g_spi_tx_len = 2;
+}
+
+/* ======================================================================
+Function: cmd_is_get
+Purpose : check if a command need a response
+Input 	: command descriptor
+Output	: true if it's a get command
+Comments: a single byte, ADC drain or 1-Wire is a get command
+====================================================================== */
+boolean cmd_is_get(struct cmd_desc * d)
+{
+	return d->len == 1 || d->buf[0] == CMD_ADC_DRAIN || d->buf[0] == CMD_1WIRE || d->buf[0] == CMD_1WIRE_ROM;
+}
+
+/* ======================================================================
+Function: adc_init
+Purpose : start the interrupt driven ADC channel scanner
+Input 	: -
+Output	: -
+Comments: Timer1 compare match B triggers one conversion every 
+					1/ADC_SAMPLE_HZ s, ADC interrupt store it and select next
+					channel, so each channel is sampled at a fixed rate of
+					ADC_SAMPLE_HZ / ADC_SCAN_CHANNELS without any CPU wait
+====================================================================== */
+void adc_init()
+{
+	uint8_t ch;
+
+	for (ch = 0; ch < ADC_SCAN_CHANNELS; ch++)
+	{
+		g_adc[ch] = 0;
+		g_adc_head[ch] = 0;
+		g_adc_count[ch] = 0;
+		g_adc_dropped[ch] = 0;
+	}
+	g_adc_ch = 0;
+	g_adc_sweep = 0;
+
+	// Timer1 CTC mode, prescaler 8, compare A is TOP and compare B 
+	// at the same value is the ADC trigger source
+	TCCR1A = 0;
+	TCCR1B = _BV(WGM12) | _BV(CS11);
+	OCR1A = (F_CPU / 8 / ADC_SAMPLE_HZ) - 1;
+	OCR1B = OCR1A;
+	TCNT1 = 0;
+
+	// AVcc reference, first channel
+	ADMUX = _BV(REFS0) | ADC_MUX(0);
+
+	// Auto trigger on Timer1 compare match B
+	ADCSRB = _BV(ADTS2) | _BV(ADTS0);
+
+	// enable ADC, auto trigger, interrupt and set prescaler to 64 (250Khz)
+	ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADPS2) | _BV(ADPS1) ;	
+}
+
+/* ======================================================================
+Function: adc_value
+Purpose : get last value sampled on an ADC channel
+Input 	: channel (0..5 for A0..A5, ADC_CH_BANDGAP for 1.1V reference)
+Output	: raw ADC value
+Comments: value is written by ADC interrupt, read it atomically
+====================================================================== */
+uint16_t adc_value(uint8_t ch)
+{
+	uint16_t v;
+
+	noInterrupts();
+	v = g_adc[ch];
+	interrupts();
+
+	return v;
+}
+
+/* ======================================================================
+Function: adc_drain
+Purpose : get all samples waiting in an ADC channel ring buffer
+Input 	: channel 
+					response buffer to fill (CMD_RSP_MAX_SIZE)
+Output	: size of response
+Comments: layout is
+					0    : channel
+					1    : number of samples n (ADC_DRAIN_MAX max)
+					2    : samples lost (ring full) since last drain
+					3..4 : sweep number of first sample, LSB first
+					5..  : n raw ADC values, LSB first, oldest first
+					samples of one channel are taken once per sweep so sample i
+					time is (first + i) * ADC_SCAN_CHANNELS / ADC_SAMPLE_HZ
+					called from ISR (no ADC interrupt can occur meanwhile)
+====================================================================== */
+byte adc_drain(uint8_t ch, byte * p)
+{
+	byte * start = p;
+	uint8_t n, i, tail;
+	uint16_t first;
+
+	n = g_adc_count[ch];
+	if ( n > ADC_DRAIN_MAX )
+		n = ADC_DRAIN_MAX;
+
+	tail = g_adc_head[ch] - g_adc_count[ch];
+	first = g_adc_last[ch] - g_adc_count[ch] + 1;
+
+	*p++ = ch;
+	*p++ = n;
+	*p++ = g_adc_dropped[ch];
+	*p++ = (byte) ( first & 0xFF);
+	*p++ = (byte) ( ( first & 0xFF00) >> 8 );
+
+	for (i = 0; i < n; i++, tail++)
+	{
+		*p++ = (byte) ( g_adc_ring[ch][tail & ADC_RING_MASK] & 0xFF);
+		*p++ = (byte) ( ( g_adc_ring[ch][tail & ADC_RING_MASK] & 0xFF00) >> 8 );
+	}
+
+	g_adc_count[ch] -= n;
+	g_adc_dropped[ch] = 0;
+
+	return (p - start);
+}
+
+/* ======================================================================
+Function: perf_get
+Purpose : build packed performance counters response
+Input 	: response buffer to fill (CMD_RSP_MAX_SIZE)
+Output	: size of response
+Comments: layout is, all values LSB first
+					0..5   : commands received on I2C, SPI, serial
+					6..11  : receive overflows on I2C, SPI, serial, or no free
+									 command descriptor
+					12..13 : longest parse_cmd() in us
+					14..17 : longest main loop iteration in us
+					18..19 : last ADC sweep of all channels in us
+					20..21 : longest ADC sweep in us
+					22..23 : ADC samples lost (ring full)
+					24..25 : longest wait of a command for main loop in us
+					26..27 : commands dropped due to bad CRC
+====================================================================== */
+byte perf_get(byte * p)
+{
+	byte * start = p;
+	uint8_t i;
+
+	for (i = 0; i < 3; i++)
+	{
+		*p++ = (byte) ( g_perf.cmd[i] & 0xFF);
+		*p++ = (byte) ( ( g_perf.cmd[i] & 0xFF00) >> 8 );
+	}
+
+	for (i = 0; i < 3; i++)
+	{
+		*p++ = (byte) ( g_perf.overflow[i] & 0xFF);
+		*p++ = (byte) ( ( g_perf.overflow[i] & 0xFF00) >> 8 );
+	}
+
+	*p++ = (byte) ( g_perf.parse_max & 0xFF);
+	*p++ = (byte) ( ( g_perf.parse_max & 0xFF00) >> 8 );
+
+	for (i = 0; i < 4; i++)
+		*p++ = (byte) ( ( g_perf.loop_max >> (8 * i) ) & 0xFF);
+
+	*p++ = (byte) ( g_perf.sweep & 0xFF);
+	*p++ = (byte) ( ( g_perf.sweep & 0xFF00) >> 8 );
+	*p++ = (byte) ( g_perf.sweep_max & 0xFF);
+	*p++ = (byte) ( ( g_perf.sweep_max & 0xFF00) >> 8 );
+	*p++ = (byte) ( g_perf.adc_dropped & 0xFF);
+	*p++ = (byte) ( ( g_perf.adc_dropped & 0xFF00) >> 8 );
+	*p++ = (byte) ( g_perf.dispatch_max & 0xFF);
+	*p++ = (byte) ( ( g_perf.dispatch_max & 0xFF00) >> 8 );
+	*p++ = (byte) ( g_perf.crc_err & 0xFF);
+	*p++ = (byte) ( ( g_perf.crc_err & 0xFF00) >> 8 );
+
+	return (p - start);
+}
+
+/* ======================================================================
+Function: perf_reset
+Purpose : clear performance counters
+Input 	: -
+Output	: -
+Comments: called from SPI ISR too, so interrupts state is restored
+====================================================================== */
+void perf_reset()
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memset((void *) &g_perf, 0, sizeof(g_perf));
+	}
+}
+
+/* ======================================================================
+Function: watch_latch
+Purpose : latch watched inputs changes of a port
+Input 	: port (0:B 1:C 2:D)
+					pins of port
+Output	: -
+Comments: called from pin change ISR, raise IRQ line so Pi don't need
+					to poll, line goes low when master get the changes
+====================================================================== */
+void watch_latch(byte port, byte pin)
+{
+	byte chg = (pin ^ g_pin_last[port]) & g_watch[port];
+
+	g_pin_last[port] = pin;
+
+	if ( chg )
+	{
+		g_changed[port] |= chg;
+
+		if ( g_changes < 0xFF )
+			g_changes++;
+
+		PORTB |= _BV(PORTB1);
+	}
+}
+
+/* ======================================================================
+Function: watch_set
+Purpose : set watched inputs of all ports
+Input 	: masks of port B, C, D
+Output	: -
+Comments: SS (PB2) pin change interrupt is always kept for spi frames
+					changes pending are cleared
+====================================================================== */
+void watch_set(volatile byte * mask)
+{
+	byte i;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for (i = 0; i < 3; i++)
+		{
+			g_watch[i] = mask[i];
+			g_changed[i] = 0;
+		}
+
+		g_pin_last[0] = PINB;
+		g_pin_last[1] = PINC;
+		g_pin_last[2] = PIND;
+		g_changes = 0;
+		PORTB &= ~_BV(PORTB1);
+
+		PCMSK0 = g_watch[0] | _BV(PCINT2);
+		PCMSK1 = g_watch[1];
+		PCMSK2 = g_watch[2];
+		PCICR = _BV(PCIE0) | (g_watch[1] ? _BV(PCIE1) : 0) | (g_watch[2] ? _BV(PCIE2) : 0);
+	}
+}
+
+/* ======================================================================
+Function: watch_get
+Purpose : get watched inputs changes and clear them
+Input 	: response buffer to fill (CMD_RSP_MAX_SIZE)
+Output	: size of response
+Comments: layout is
+					0     : changes since last get (255 max)
+					1..3  : changed inputs of port B, C, D
+					4..6  : PINB PINC PIND
+					IRQ line goes low, next change will raise it again
+====================================================================== */
+byte watch_get(byte * p)
+{
+	byte i;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		*p++ = g_changes;
+
+		for (i = 0; i < 3; i++)
+		{
+			*p++ = g_changed[i];
+			g_changed[i] = 0;
+		}
+
+		*p++ = PINB;
+		*p++ = PINC;
+		*p++ = PIND;
+		g_changes = 0;
+		PORTB &= ~_BV(PORTB1);
+	}
+
+	return WATCH_SIZE;
+}
+
+/* ======================================================================
+Function: build_snapshot
+Purpose : build a packed snapshot of all board I/O
+Input 	: response buffer to fill (CMD_RSP_MAX_SIZE)
+Output	: size of snapshot
+Comments: layout is
+					0     : sequence number
+					1..3  : PINB PINC PIND
+					4..6  : DDRB DDRC DDRD
+					7..8  : vcc in mV, LSB first
+					9..20 : A0..A5 raw ADC values, LSB first
+					called from ISR, analog values are the last ones sampled by the 
+					ADC interrupt
+====================================================================== */
+byte build_snapshot(byte * p)
+{
+	byte * start = p;
+	uint8_t ch;
+
+	*p++ = g_snapshot_seq++;
+	*p++ = PINB;
+	*p++ = PINC;
+	*p++ = PIND;
+	*p++ = DDRB;
+	*p++ = DDRC;
+	*p++ = DDRD;
+	*p++ = (byte) ( g_vcc & 0xFF);
+	*p++ = (byte) ( ( g_vcc & 0xFF00) >> 8 );
+
+	for (ch = 0; ch < ADC_CHANNELS; ch++)
+	{
+		*p++ = (byte) ( g_adc[ch] & 0xFF);
+		*p++ = (byte) ( ( g_adc[ch] & 0xFF00) >> 8 );
+	}
+
+	return (p - start);
+}
 
-	return ((high << 8) | low);
+/* ======================================================================
+Function: ow_search
+Purpose : start 1-Wire sensors enumeration
+Input 	: -
+Output	: -
+Comments: temperatures are not available until enumeration is done
+====================================================================== */
+void ow_search()
+{
+	g_ow_count = 0;
+	ds.wireResetSearch();
+	g_ow_state = OW_SEARCH;
+}
+
+/* ======================================================================
+Function: ow_get
+Purpose : build a page of 1-Wire temperatures
+Input 	: first sensor of page
+					response buffer to fill (CMD_RSP_MAX_SIZE)
+Output	: size of response
+Comments: layout is
+					0     : sensors enumerated
+					1     : conversion round of temperatures
+					2     : searches done, master read ROM codes again
+									when it change
+					3     : first sensor of page
+					4..29 : OW_PAGE temperatures (1/16 C), LSB first,
+									OW_TEMP_NONE if not read or no sensor
+					called from ISR
+====================================================================== */
+byte ow_get(byte first, byte * p)
+{
+	uint8_t i;
+	int16_t t;
+
+	*p++ = g_ow_count;
+	*p++ = g_ow_seq;
+	*p++ = g_ow_search;
+	*p++ = first;
+
+	for (i = 0; i < OW_PAGE; i++)
+	{
+		t = first + i < g_ow_count ? g_ow_temp[first + i] : OW_TEMP_NONE;
+		*p++ = (byte) ( t & 0xFF);
+		*p++ = (byte) ( ( t & 0xFF00) >> 8 );
+	}
+
+	return OW_PAGE_SIZE;
 }
 
 /* ======================================================================
@@ -146,7 +816,7 @@ void setup()
 		Serial.begin(57600);
 		Serial.println("Starting ArduiPi Test Program");
 	#else
-		Serial.begin(9600);
+		Serial.begin(SERIAL_BAUD);
 	#endif
 
   pinMode(pinLed,OUTPUT);
@@ -159,15 +829,12 @@ void setup()
   pinMode(8,OUTPUT);
   pinMode(9,OUTPUT);
 
-  // clear the ADC prescaler defined by arduino env
-	// enable ADC and set prescaler to 64 (250Khz)
-  //ADCSRA &= ~PS_128;  
-  //ADCSRA |= PS_64;    
-	ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) ;	
-	
+	// no input change pending
+	digitalWrite(pinIrq, LOW);
+
 	// REFS1 REFS0          --> 0 1, AVcc internal ref. -Selects AVcc external reference
-	// MUX3 MUX2 MUX1 MUX0  --> 1110 1.1V (VBG)         -Selects channel 14, bandgap voltage, to measure
-  ADMUX = (0<<REFS1) | (1<<REFS0) | (0<<ADLAR) | (1<<MUX3) | (1<<MUX2) | (1<<MUX1) | (0<<MUX0);
+	// then scan all analog inputs and 1.1V (VBG) in background
+	adc_init();
 	
   // Setup Analog Pin as input
 	pinMode(A0, INPUT);
@@ -178,48 +845,17 @@ void setup()
 	// we are ready, start i2c slave mode
   Wire.begin(SLAVE_ADDRESS); 
 	
-	// Init DS2482 1-Wire i2c controller
+	// Init DS2482 1-Wire i2c controller, sensors are searched
+	// by 1-Wire task so a long string don't delay setup
 	ds.reset();
+	ow_search();
 	
-	// Clear 1-Wire device Address
-	for (i=0;i<8;i++)
-		g_ds18b20[i] = 0 ;
-	
-	#ifdef DEBUG_SERIAL
-		Serial.println("Searching 1-Wire devices."); 
-	#endif 
-	
-	if ( !ds.wireSearch(g_ds18b20)) 
-	{ 
-		#ifdef DEBUG_SERIAL
-			Serial.println("No more addresses."); 
-		#endif 
-		
-		ds.wireResetSearch(); 
-	}
-	else
-	{
-		#ifdef DEBUG_SERIAL
-			Serial.print("Found Device : 0x"); 
-
-			for (i=0;i<8;i++)
-				sprintf(&buff[i*2], "%02X", g_ds18b20[i]);
-
-			Serial.println(buff); 
-		#endif
-
-		// Got 1 wire device okay
-		g_1w_tested = true;
-	}
-
 	//initialize SEEED Gray OLED display
   SeeedGrayOled.init();  								
 	
-	// Set i2c to 400Khz to improve display speed
-	// TWBR = 10 ;
-
-	// Set i2c to 100Khz to improve compatibility
-	TWBR = 72 ;
+	// Set i2c to 100Khz to improve compatibility, master can 
+	// switch to 400Khz with CMD_I2C_SPEED once it checked the bus
+	TWBR = TWBR_100KHZ ;
 
 	//clear the screen and set start position to top left corner
   SeeedGrayOled.clearDisplay();           
@@ -243,737 +879,1184 @@ void setup()
   Wire.onRequest(requesti2cEvent);
   Wire.onReceive(receivei2cEvent);
 
-  // Set SPI to 1MHz
-  SPI.setClockDivider(SPI_CLOCK_DIV16);
-  
 	// have to send on master in, slave out
 	pinMode(MISO, OUTPUT);    
 
-	// turn on SPI in slave mode 
-	//pinMode(SS, INPUT);    
+	// turn on SPI in slave mode, clock is given by master 
+	pinMode(SS, INPUT);    
 	SPCR |= _BV(SPE);    
 
   // turn on interrupts
   SPCR |= _BV(SPIE);
 	
+	// SS pin change interrupt (PB2/PCINT2) delimit spi frames
+	PCMSK0 |= _BV(PCINT2);
+	PCICR |= _BV(PCIE0);
+
 	// SPI First response should be ping response
 	SPDR = g_ping;
 }
 
 /* ======================================================================
-Function: loop
-Purpose : main loop, blink led and wait for received command, then do it
-Input 	: -
-Output	: -
-Comments: 
+Function: cobs_encode
+Purpose : COBS encode a frame, so it has no 0x00
+Input 	: frame
+					size of frame (254 max)
+					encoded buffer (size + 1)
+Output	: size of encoded frame
+Comments: each 0x00 is replaced by the offset of the next one, first 
+					byte is offset of the first one
 ====================================================================== */
-void loop()
+byte cobs_encode(byte * src, byte len, byte * dst)
 {
+	byte code = 0, i, n = 1;
 
-	static byte nblink = 2 ;			// number of blink (/2) to do (default 1 so we set 2)
-	static byte blinkdelay =100;	// duration of the blink (default 100 ms)
-	static int  ldelay = LOOP_DELAY; // every second loop
-	static byte c;
-	static uint8_t pin = pinLed;
-	static uint16_t _a0,_a1,_a2,_a3;
-	static long _millis;
-	
-  //light=analogRead(0);  // reading photoresistor
-
-  //Serial.print("light: " );
-  //Serial.println(light );
-
-  // Loop until delay expired or command received
-  while ( (ldelay != 0) && (g_i2c_new == false) && (g_spi_new == false) && (g_ser_new == false))
-  {
-		// take care, if we need to answer to device or
-		// other devices this delay should not be too long 
-		// to keep timing safe and to anwser quickly
-		
-		// Read 1.1V reference against AVcc
-		ADMUX &= 0b11110000;
-		ADMUX |= 0b00001110;
-		delay(2);
-		g_vcc = readADC();
-		
-		// Back-calculate Vcc in mV
-		g_vcc = 1126400L / g_vcc ; 
-		
-		// Read A0
-		ADMUX &= 0b11110000 ;
-		delay(2);
-		_a0 = (g_vcc * readADC()) / 1023 ;
-		
-		// Read A1
-		ADMUX &= 0b11110000 ;
-		ADMUX |= 0b00000001;
-		delay(2);
-		_a1 = (g_vcc * readADC()) / 1023 ;
-
-		// Read A2
-		ADMUX &= 0b11110000 ;
-		ADMUX |= 0b00000010;
-		delay(2);
-		_a2 = (g_vcc * readADC()) / 1023 ;
-
-		// Read A3
-		ADMUX &= 0b11110000 ;
-		ADMUX |= 0b00000011;
-		delay(2);
-		_a3 = (g_vcc * readADC()) * 11 / 1023 ;
-		
-		
-		// Now check the values are correct
-		// A0 must be between 3.1V and 3.5V
-		// A1 must be between 1.4V and 1.8V
-		// 3V3 (a2) must be between 3.2V and 3.4V
-		// VIN (a3) should be > 6V
-		if ((_a0 > 3100 && _a0 < 3500 ) &&
-			 (_a1 > 1400 && _a1 < 1800 ) &&
-			 (_a2 > 3200 && _a2 < 3400 ) &&
-			 (_a3 > 6000 ) )
-		{
-			g_analog_tested = true ;
-		}
-		else
+	for (i = 0; i < len; i++)
+	{
+		if ( src[i] )
 		{
-			g_analog_tested = false ;
+			dst[n++] = src[i];
+			continue;
 		}
-		
-		// Check if we received Serial Data
-		if (Serial.available() > 0)
-		{
-			c = Serial.read();
 
-			// check not overflowing, our buffer is enought ?
-			if ( g_ser_rx_len < CMD_MAX_SIZE - 1 ) /* keep \0 of the serial string */
-			{
-				// discard \r
-				if (c != '\r' )
-				{
-					// End of command
-					if ( c == '\n' )
-					{
-						// We received a string, end it without \r or \n
-						g_ser_rx_buf[g_ser_rx_len] = 0x00;
-						
-						// Time to treat this command
-						g_ser_new = true;
-					}
-					else
-					{
-						// Put char in buffer 
-						g_ser_rx_buf[g_ser_rx_len++] = c;
-					}
-				}
-			}
-			else
-			{
-				// overflow 
-				// force treating buffer
-				g_ser_rx_buf[CMD_MAX_SIZE] = 0x00;
-						
-				// Time to treat this command
-				g_ser_new = true;
-			}
-		}
+		dst[code] = n - code;
+		code = n++;
+	}
 
-    // wait 10 ms done waiting ADC to settle
-    // delay(2);  
-    ldelay -= 10 ;
-		
-		// each 100 ms if we need to blink
-		if ( (ldelay % 100) == 0 )
+	dst[code] = n - code;
+
+	return n;
+}
+
+/* ======================================================================
+Function: cobs_decode
+Purpose : decode a COBS frame
+Input 	: encoded frame, without trailing 0x00
+					size of encoded frame
+					frame buffer (size - 1)
+Output	: size of frame, 0 if not a valid encoding
+Comments: -
+====================================================================== */
+byte cobs_decode(byte * src, byte len, byte * dst)
+{
+	byte i = 0, n = 0, code, j;
+
+	while ( i < len )
+	{
+		code = src[i++];
+
+		if ( !code || i + code - 1 > len )
+			return 0;
+
+		for (j = 1; j < code; j++)
+			dst[n++] = src[i++];
+
+		// offset of a 0x00, not the end of frame
+		if ( i < len )
+			dst[n++] = 0x00;
+	}
+
+	return n;
+}
+
+/* ======================================================================
+Function: ser_frame
+Purpose : do a received serial request frame and send its response
+Input 	: -
+Output	: -
+Comments: request is seq op command parameters crc, response is seq 
+					status response crc, both COBS encoded and ended by 0x00
+					bad frames are dropped, master will find it by sequence
+====================================================================== */
+void ser_frame()
+{
+	byte frame[SER_RX_SIZE];
+	byte enc[SER_TX_SIZE + 1];
+	struct cmd_desc * d;
+	byte n;
+
+	n = cobs_decode(g_ser_rx, g_ser_rx_len, frame);
+
+	if ( n < 4 || crc8(0, frame, n - 1) != frame[n - 1] )
+	{
+		g_perf.crc_err++;
+		return;
+	}
+
+	if ( (d = cmd_alloc(SRC_SER)) == NULL )
+	{
+		g_perf.overflow[SRC_SER]++;
+		return;
+	}
+
+	d->len = n - 3;
+	memcpy(d->buf, frame + 2, d->len);
+
+	g_ser_tx_buf[0] = frame[0];
+	g_ser_tx_buf[1] = 0;
+	g_ser_tx_len = 0;
+
+	// parse command and setup the blink, get handlers are written
+	// for ISR context (ADC ring, snapshot), run them as if we were
+	if ( !cmd_unwrap(d) )
+		g_ser_tx_buf[1] = 1;
+	else if ( frame[1] == SER_OP_GET )
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
 		{
-			if ( nblink > 0 )
-			{
-				if ( (nblink % 2) == 0  )
-				{
-					// light on the led
-					digitalWrite(pin,1);  
-					
-				}
-				else
-				{
-					// light off the led
-					digitalWrite(pin,0);  
-					
-					// next led
-					if (++pin > 9 )
-						pin = pinLed;
-				}
+			g_nblink = parse_cmd( d, true ) * 2;
+		}
+	}
+	else
+		g_nblink = parse_cmd( d, false ) * 2;
 
-				// we finished this blink
-				if ( --nblink <= 0 )
-				{
-					// restart loop delay without blink
-					ldelay = LOOP_DELAY ;
-				}
-			}
+	cmd_free(d);
+
+	n = g_ser_tx_len + 2;
+	g_ser_tx_buf[n] = crc8(0, g_ser_tx_buf, n);
+
+	n = cobs_encode(g_ser_tx_buf, n + 1, enc);
+	Serial.write(enc, n);
+	Serial.write((byte) 0x00);
+}
+
+/* ======================================================================
+Function: ser_rx_byte
+Purpose : treat one received serial byte
+Input 	: byte received
+Output	: -
+Comments: binary frames end with 0x00 and start with a COBS code byte,
+					always lower than a space for our frame sizes, text lines 
+					(test board) start with a printable char and end with \n
+====================================================================== */
+void ser_rx_byte(byte c)
+{
+	boolean text = g_ser_rx_len && g_ser_rx[0] >= ' ';
+
+	if ( c == 0x00 || (text && c == '\n') || (g_ser_skip && c == '\n') )
+	{
+		if ( !g_ser_skip && c == 0x00 && g_ser_rx_len && !text )
+			ser_frame();
+		else if ( !g_ser_skip && text && c == '\n' )
+		{
+			// We received a string, end it without \r or \n
+			g_ser_rx[g_ser_rx_len] = 0x00;
+			g_perf.cmd[SRC_SER]++;
+			serial_test(g_ser_rx, g_ser_rx_len);
 		}
-  }
 
-	// ok we exited waiting delay for us
+		g_ser_rx_len = 0;
+		g_ser_skip = false;
+	}
+	else if ( g_ser_skip || (c == '\r' && (text || !g_ser_rx_len)) || (c == '\n' && !g_ser_rx_len) )
+	{
+		// discard
+	}
+	// check not overflowing, keep \0 of the serial string
+	else if ( g_ser_rx_len < SER_RX_SIZE - 1 )
+	{
+		g_ser_rx[g_ser_rx_len++] = c;
+	}
+	else
+	{
+		g_perf.overflow[SRC_SER]++;
+		g_ser_rx_len = 0;
+		g_ser_skip = true;
+	}
+}
+
+/* ======================================================================
+Function: task_cmd
+Purpose : command dispatch task, treat commands received by interfaces
+Input 	: -
+Output	: -
+Comments: run at each loop, do all serial frames received, then all 
+					commands queued by ISRs, in order, time they waited is a perf counter
+====================================================================== */
+void task_cmd()
+{
+	struct cmd_desc * d;
+	unsigned long wait;
+	byte buf[SER_RX_SIZE];
+	int n, i, avail;
+
+	// drain what serial received since last run, in chunks, but not 
+	// what comes meanwhile so other tasks still run
+	avail = Serial.available();
+
+	while ( avail > 0 )
+	{
+		n = Serial.readBytes( (char *) buf, avail < SER_RX_SIZE ? avail : SER_RX_SIZE);
+
+		for (i = 0; i < n; i++)
+			ser_rx_byte(buf[i]);
+
+		avail -= n;
+
+		// should not, but don't wait readBytes timeout again
+		if ( !n )
+			break;
+	}
+
   // so, is there something to do for I2C ?
-  if (g_i2c_new )
+  while ( (d = cmd_pop()) != NULL )
   {
+		// time since receive ISR queued it
+		wait = micros() - d->time;
+		if ( wait > g_perf.dispatch_max )
+			g_perf.dispatch_max = wait > 0xFFFF ? 0xFFFF : wait;
+
 		// parse command and setup the blink
-		nblink = parse_cmd( false ) * 2;
+		g_nblink = parse_cmd( d, false ) * 2;
 
-		// Reset buffer len;
-		g_i2c_rx_len = 0;
-		
 		// we done what ne needed to on our received command
-		g_i2c_new = false;
+		cmd_free(d);
 	}
 	
   // so, is there something to do for SPI ?
-	// for now do nothing except ACK for test firmware
+	// command has already been done at end of frame
   if ( g_spi_new )
 	{
-		// parse command and setup the blink
-		//nblink = parse_cmd( false ) * 2;
-		
 		// Spi is working
 		g_spi_tested = true;
 		
-		// time to go, we are ready to send
-		// g_spi_cmd_send = true ;
-	
-		// Reset buffer len;
-		g_spi_rx_len = 0;
+		// one blink per command
+		g_nblink = 2;
 
 		// ack our received command
 		g_spi_new = false;
 	}
+}
+
+/* ======================================================================
+Function: task_analog
+Purpose : analog task, compute vcc and check analog inputs values
+Input 	: -
+Output	: -
+Comments: ADC is sampled by interrupt, we just use last values
+====================================================================== */
+void task_analog()
+{
+	uint16_t a0, a1, a2, a3;
+	uint16_t adc;
+	long vcc;
 
-  // so, is there something to do for Serial ?
-  if ( g_ser_new )
+	// Back-calculate Vcc in mV from 1.1V reference
+	if ( (adc = adc_value(ADC_CH_BANDGAP)) != 0 )
 	{
-		// parse command and setup the blink
-		nblink = parse_cmd( false ) * 2;
-	
-		// Reset buffer len;
-		g_ser_rx_len = 0;
-		
-		// ack our received command
-		g_ser_new = false;
+		vcc = 1126400L / adc ; 
+		noInterrupts();
+		g_vcc = vcc;
+		interrupts();
 	}
 	
-  // main loop delay expired, time to refresh screen
-  if (ldelay == 0) 
-	{
+	a0 = (g_vcc * adc_value(0)) / 1023 ;
+	a1 = (g_vcc * adc_value(1)) / 1023 ;
+	a2 = (g_vcc * adc_value(2)) / 1023 ;
+	a3 = (g_vcc * adc_value(3)) * 11 / 1023 ;
 	
-		// Display only when received 1st i2c command from PI
-		// this avoid I2C bus corruption
-		if ( g_i2c_tested )
-		{
-			// Set i2c to 400Khz
-			// TWBR = 10 ;
-			
-			_millis = millis();
+	// Now check the values are correct
+	// A0 must be between 3.1V and 3.5V
+	// A1 must be between 1.4V and 1.8V
+	// 3V3 (a2) must be between 3.2V and 3.4V
+	// VIN (a3) should be > 6V
+	if ((a0 > 3100 && a0 < 3500 ) &&
+		 (a1 > 1400 && a1 < 1800 ) &&
+		 (a2 > 3200 && a2 < 3400 ) &&
+		 (a3 > 6000 ) )
+	{
+		g_analog_tested = true ;
+	}
+	else
+	{
+		g_analog_tested = false ;
+	}
+}
 
-			// Set i2c to 400Khz
-		//TWBR = 10 ;
+/* ======================================================================
+Function: task_led
+Purpose : led status task, do one step of the blink asked
+Input 	: -
+Output	: -
+Comments: each blink light on then off the next led of pinLed..8
+====================================================================== */
+void task_led()
+{
+	static uint8_t pin = pinLed;
+
+	if ( g_nblink == 0 )
+		return;
+
+	if ( (g_nblink % 2) == 0  )
+	{
+		// light on the led
+		digitalWrite(pin,1);  
+	}
+	else
+	{
+		// light off the led
+		digitalWrite(pin,0);  
 		
-		_millis = millis();
+		// next led, pinIrq is not a led
+		if (++pin >= pinIrq )
+			pin = pinLed;
+	}
+
+	g_nblink--;
+}
+
+/* ======================================================================
+Function: task_status
+Purpose : status task, blink and start a screen refresh
+Input 	: -
+Output	: -
+Comments: screen is drawn line by line by task_oled()
+====================================================================== */
+void task_status()
+{
+	// Display only when received 1st i2c command from PI
+	// this avoid I2C bus corruption
+	if ( g_i2c_tested && g_oled_line == 0 )
+		g_oled_line = 1;
+
+	// setup a new blink
+	if ( g_nblink == 0 )
+		g_nblink = 2;
+}
+
+/* ======================================================================
+Function: task_1wire
+Purpose : 1-Wire task, one step of 1-Wire state machine
+Input 	: -
+Output	: -
+Comments: one sensor found or read per step, conversion of all sensors
+					done at once so a round take OW_CONVERT_MS whatever the number
+					of sensors, an empty bus is searched again every OW_SEARCH_MS
+====================================================================== */
+void task_1wire()
+{
+	byte data[9];
+	byte * rom;
+	uint8_t i;
+	int16_t t;
+
+	// asked from ISR, search is done here
+	if ( g_ow_rescan )
+	{
+		g_ow_rescan = false;
+		ow_search();
+	}
+
+	switch ( g_ow_state )
+	{
+		case OW_IDLE:
+			if ( millis() - g_ow_time >= OW_SEARCH_MS )
+				ow_search();
+		break;
+
+		case OW_SEARCH:
+			rom = g_ow_rom[g_ow_count];
+
+			if ( g_ow_count < OW_MAX_SENSORS && ds.wireSearch(rom) )
+			{
+				// temperature sensors only
+				if ( ds.crc8(rom, 7) == rom[7] && 
+						( rom[0] == OW_FAMILY_DS18S20 || rom[0] == OW_FAMILY_DS1822 || rom[0] == OW_FAMILY_DS18B20 ) )
+				{
+					g_ow_temp[g_ow_count] = OW_TEMP_NONE;
+					g_ow_count++;
 
+					#ifdef DEBUG_SERIAL
+						Serial.print("Found Device : 0x"); 
+
+						for (i=0;i<8;i++)
+							sprintf(&buff[i*2], "%02X", rom[i]);
+
+						Serial.println(buff); 
+					#endif
+				}
+				break;
+			}
+
+			ds.wireResetSearch(); 
+
+			// Got 1 wire device okay
+			g_1w_tested = g_ow_count > 0;
+			g_ow_search++;
+			g_ow_state = g_ow_count ? OW_CONVERT : OW_IDLE;
+			g_ow_time = millis();
+		break;
+
+		// all sensors at once
+		case OW_CONVERT:
+			if ( ds.wireReset() )
+			{
+				ds.wireSkip();
+				ds.wireWriteByte(OW_CONVERT_T);
+				g_ow_state = OW_WAIT;
+			}
+			// no more sensor answering, search them later
+			else
+			{
+				g_1w_tested = false;
+				g_ow_count = 0;
+				g_ow_state = OW_IDLE;
+			}
+			g_ow_time = millis();
+		break;
+
+		case OW_WAIT:
+			if ( millis() - g_ow_time >= OW_CONVERT_MS )
+			{
+				g_ow_next = 0;
+				g_ow_state = OW_READ;
+			}
+		break;
+
+		// one sensor per step, a bad read keep previous temperature
+		case OW_READ:
+			rom = g_ow_rom[g_ow_next];
+
+			if ( ds.wireReset() )
+			{
+				ds.wireSelect(rom);
+				ds.wireWriteByte(OW_READ_SCRATCH);
+
+				for (i = 0; i < 9; i++)
+					data[i] = ds.wireReadByte();
+
+				if ( ds.crc8(data, 8) == data[8] )
+				{
+					t = data[0] | (data[1] << 8);
+
+					// DS18S20 is 1/2 C
+					if ( rom[0] == OW_FAMILY_DS18S20 )
+						t <<= 3;
+
+					ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+					{
+						g_ow_temp[g_ow_next] = t;
+					}
+				}
+			}
+
+			if ( ++g_ow_next >= g_ow_count )
+			{
+				g_ow_seq++;
+				g_ow_state = OW_CONVERT;
+			}
+		break;
+	}
+}
+
+/* ======================================================================
+Function: task_oled
+Purpose : OLED task, draw one line of the screen being refreshed
+Input 	: -
+Output	: -
+Comments: a full screen take tens of ms on the i2c bus, drawing one line
+					per run keep commands waiting at most one line
+====================================================================== */
+void task_oled()
+{
+	static unsigned long start;
+
+	switch ( g_oled_line )
+	{
+		case 0:
+			return;
+
+		case 1:
+			start = millis();
 			SeeedGrayOled.setTextXY(1,0);           
 			SeeedGrayOled.putString("1Wire  : ");
 			SeeedGrayOled.putString(g_1w_tested ? "OK":"--");
-		
+		break;
+
+		case 2:
 			SeeedGrayOled.setTextXY(2,0);           
 			SeeedGrayOled.putString("Analog : ");
 			SeeedGrayOled.putString(g_analog_tested ? "OK":"--");
-		
+		break;
+
+		case 3:
 			SeeedGrayOled.setTextXY(3,0);           
 			SeeedGrayOled.putString("I2C    : ");
 			SeeedGrayOled.putString(g_i2c_tested ? "OK":"--");
+		break;
 
+		case 4:
 			SeeedGrayOled.setTextXY(4,0);           
 			SeeedGrayOled.putString("SPI    : ");
 			SeeedGrayOled.putString(g_spi_tested ? "OK":"--");
+		break;
 
+		case 5:
 			SeeedGrayOled.setTextXY(5,0);           
 			SeeedGrayOled.putString("Serial : ");
 			SeeedGrayOled.putString(g_ser_tested ? "OK":"--");
+		break;
+
+		case 6:
+			SeeedGrayOled.setTextXY(6,0);
+			SeeedGrayOled.putString("  Got I2C  ");
+		break;
 
-                        SeeedGrayOled.setTextXY(6,0);
-                        SeeedGrayOled.putString("  Got I2C  ");
+		// last line, whole screen refresh time
+		default:
+			SeeedGrayOled.setTextXY(8,0);
+			SeeedGrayOled.putString("took ");
+			SeeedGrayOled.putNumber(millis() - start);
+			SeeedGrayOled.putString(" ms");
+
+			// screen done
+			g_oled_line = 0;
+			return;
+	}
+
+	g_oled_line++;
+}
+
+// background tasks, run by loop() when their period elapsed
+struct task g_tasks[] =
+{
+	{ task_analog, TASK_ANALOG_MS, 0 },
+	{ task_led,    TASK_LED_MS,    0 },
+	{ task_status, LOOP_DELAY,     0 },
+	{ task_1wire,  TASK_1WIRE_MS,  0 },
+	{ task_oled,   TASK_OLED_MS,   0 },
+};
+
+#define TASKS (sizeof(g_tasks) / sizeof(g_tasks[0]))
+
+/* ======================================================================
+Function: loop
+Purpose : main loop, cooperative scheduler
+Input 	: -
+Output	: -
+Comments: command dispatch run at each loop, then only one background 
+					task which period elapsed, round robin, so a command never
+					wait more than the longest task, no task use delay()
+====================================================================== */
+void loop()
+{
+	static uint8_t t = 0;
+	static unsigned long last_iter;
+	unsigned long now;
+	uint8_t n;
+
+	// time since previous iteration, include work done between loop()
+	now = micros();
+	if ( now - last_iter > g_perf.loop_max && last_iter )
+		g_perf.loop_max = now - last_iter;
+	last_iter = now;
+
+	task_cmd();
+
+	for (n = 0; n < TASKS; n++)
+	{
+		if ( ++t >= TASKS )
+			t = 0;
+
+		if ( millis() - g_tasks[t].last >= g_tasks[t].period )
+		{
+			g_tasks[t].last = millis();
+			g_tasks[t].run();
+			break;
+		}
+	}
+}
+
+
+
+
+/* ======================================================================
+Function: cmd_none
+Purpose : command handler of unknown commands
+Input 	: command being parsed
+					table argument (unused)
+Output	: -
+Comments: nothing to do, no response
+====================================================================== */
+void cmd_none(struct cmd_ctx * ctx, byte arg)
+{
+}
+
+/* ======================================================================
+Function: cmd_ping
+Purpose : command handler of ping
+Input 	: command being parsed
+					table argument (unused)
+Output	: -
+Comments: get return ping value, set change it
+====================================================================== */
+void cmd_ping(struct cmd_ctx * ctx, byte arg)
+{
+	// Ping Get command
+	if ( ctx->is_get )
+	{
+		*ctx->ptx = g_ping ;
+		*ctx->ptx_len = 1;
+
+		if ( ctx->src == SRC_I2C )
+			g_i2c_tested = true;
+		
+		#ifdef DEBUG_SERIAL
+			Serial.print("Ping = 0x");
+			Serial.println(*ctx->ptx, HEX);
+		#endif
+	}
+	// Ping Set command
+	else if ( ctx->len == 2 )
+	{
+		// next ping will return the new data received
+		g_ping = *ctx->prx;
+		
+		#ifdef DEBUG_SERIAL
+			Serial.print("Set Ping return value to 0x");
+			Serial.println(g_ping, HEX);
+		#endif
+	}
+}
+
+/* ======================================================================
+Function: cmd_analog
+Purpose : command handler of analog inputs, arduino or AVR numbering
+Input 	: command being parsed
+					table argument, analog input (0..5), 6 for vcc
+Output	: -
+Comments: A6 is not existing, this command return vcc value in mV
+					value is the last one sampled by the ADC interrupt
+====================================================================== */
+void cmd_analog(struct cmd_ctx * ctx, byte arg)
+{
+	uint16_t v;
+
+	if ( !ctx->is_get )
+		return;
+
+	v = arg == ADC_CHANNELS ? g_vcc : g_adc[arg];
+
+	// LSB first 
+	*ctx->ptx = (byte) ( v & 0xFF);
+	*(ctx->ptx+1) = (byte) ( ( v & 0xFF00)  >> 8 );
+	*ctx->ptx_len = 2;
+
+	#ifdef DEBUG_SERIAL
+		Serial.print("AnalogRead(");
+		Serial.print( arg );
+		Serial.print(") = ");
+		Serial.println(v, HEX);
+	#endif
+}
+
+/* ======================================================================
+Function: cmd_snapshot
+Purpose : command handler of snapshot of all I/O in one response
+Input 	: command being parsed
+					table argument (unused)
+Output	: -
+Comments: -
+====================================================================== */
+void cmd_snapshot(struct cmd_ctx * ctx, byte arg)
+{
+	if ( ctx->is_get )
+	{
+		*ctx->ptx_len = build_snapshot( (byte *) ctx->ptx );
+
+		#ifdef DEBUG_SERIAL
+			Serial.print("Snapshot #");
+			Serial.println( *ctx->ptx );
+		#endif
+	}
+}
+
+/* ======================================================================
+Function: cmd_perf
+Purpose : command handler of performance counters
+Input 	: command being parsed
+					table argument (unused)
+Output	: -
+Comments: set command clear them
+====================================================================== */
+void cmd_perf(struct cmd_ctx * ctx, byte arg)
+{
+	if ( ctx->is_get )
+		*ctx->ptx_len = perf_get( (byte *) ctx->ptx );
+	else
+		perf_reset();
+}
+
+/* ======================================================================
+Function: cmd_i2c_speed
+Purpose : command handler of i2c bus speed
+Input 	: command being parsed
+					table argument (unused)
+Output	: -
+Comments: get return TWBR then its complement so master can check it
+					set with a byte change TWBR, speed of our own master 
+					transactions (OLED, DS2482), slave speed is given by master
+					speed is F_CPU / (16 + 2 * TWBR), TWBR_400KHZ or TWBR_100KHZ
+====================================================================== */
+void cmd_i2c_speed(struct cmd_ctx * ctx, byte arg)
+{
+	if ( ctx->is_get )
+	{
+		*ctx->ptx = TWBR;
+		*(ctx->ptx+1) = ~TWBR;
+		*ctx->ptx_len = 2;
+	}
+	else if ( ctx->len == 2 && *ctx->prx >= TWBR_MIN )
+	{
+		// no prescaler
+		TWSR &= ~(_BV(TWPS0) | _BV(TWPS1));
+		TWBR = *ctx->prx;
+	}
+}
+
+/* ======================================================================
+Function: cmd_watch
+Purpose : command handler of input changes notification
+Input 	: command being parsed
+					table argument (unused)
+Output	: -
+Comments: set with 3 bytes watch inputs masks of port B, C, D, all 0 
+					stop notification, get return changes and clear them
+====================================================================== */
+void cmd_watch(struct cmd_ctx * ctx, byte arg)
+{
+	if ( ctx->is_get )
+		*ctx->ptx_len = watch_get( (byte *) ctx->ptx );
+	else if ( ctx->len == 4 )
+		watch_set( ctx->prx );
+}
+
+/* ======================================================================
+Function: cmd_1wire
+Purpose : command handler of 1-Wire temperatures
+Input 	: command being parsed
+					table argument (unused)
+Output	: -
+Comments: always a get, return a page of temperatures, first sensor of
+					page is the command parameter (0 if none), OW_RESCAN search
+					sensors again at next 1-Wire task step
+====================================================================== */
+void cmd_1wire(struct cmd_ctx * ctx, byte arg)
+{
+	byte first = ctx->len == 2 ? *ctx->prx : 0;
+
+	if ( first == OW_RESCAN )
+	{
+		g_ow_rescan = true;
+		first = 0;
+	}
+
+	*ctx->ptx_len = ow_get( first, (byte *) ctx->ptx );
+}
+
+/* ======================================================================
+Function: cmd_1wire_rom
+Purpose : command handler of 1-Wire sensor ROM code
+Input 	: command being parsed
+					table argument (unused)
+Output	: -
+Comments: always a get, sensor is the command parameter, no response
+					if not found
+====================================================================== */
+void cmd_1wire_rom(struct cmd_ctx * ctx, byte arg)
+{
+	uint8_t i;
+
+	if ( ctx->len == 2 && *ctx->prx < g_ow_count )
+	{
+		for (i = 0; i < 8; i++)
+			*(ctx->ptx + i) = g_ow_rom[*ctx->prx][i];
+
+		*ctx->ptx_len = 8;
+	}
+}
+
+/* ======================================================================
+Function: cmd_adc_drain
+Purpose : command handler of ADC samples drain of one channel
+Input 	: command being parsed
+					table argument (unused)
+Output	: -
+Comments: channel is the command parameter
+====================================================================== */
+void cmd_adc_drain(struct cmd_ctx * ctx, byte arg)
+{
+	if ( ctx->is_get && ctx->len == 2 && *ctx->prx < ADC_SCAN_CHANNELS )
+		*ctx->ptx_len = adc_drain( *ctx->prx, (byte *) ctx->ptx );
+}
+
+/* ======================================================================
+Function: cmd_pin
+Purpose : command handler of arduino pins
+Input 	: command being parsed
+					table argument, arduino pin (0..18)
+Output	: -
+Comments: get read pin, set with a byte write pin, set with a word
+					(CMD_DDR_ARDUINO + mode) set pin mode
+====================================================================== */
+void cmd_pin(struct cmd_ctx * ctx, byte arg)
+{
+	volatile byte * prx = ctx->prx;
+
+	// Arduino Get pin command
+	if ( ctx->is_get )
+	{
+		*ctx->ptx = digitalRead ( arg );
+		*ctx->ptx_len = 1;
+
+		#ifdef DEBUG_SERIAL
+			Serial.print("DigitalRead(");
+			Serial.print( arg );
+			Serial.print(")=");
+			Serial.println( *ctx->ptx );
+		#endif
+	}
+	// Arduino Set pin command (byte value)
+	else if ( ctx->len == 2 )
+	{
+		// 1st byte is pin value 
+		if (*prx == LOW || *prx == HIGH )
+		{
+			digitalWrite ( arg, *prx);
+			#ifdef DEBUG_SERIAL
+				Serial.print("DigitalWrite(");
+				Serial.print( arg );
+				Serial.print(", 0x");
+				Serial.print( *prx, HEX );
+				Serial.println(")");
+			#endif
+		}
+	}
+	// Arduino Set pin direction command (word value)
+	else if ( ctx->len == 3 )
+	{
+		// 1st byte is DDR command, 2nd byte is pin mode value
+		if (*prx == CMD_DDR_ARDUINO && *(prx+1) <= INPUT_PULLUP)
+		{
+			pinMode ( arg, *(prx+1) );
+			#ifdef DEBUG_SERIAL
+				Serial.print("pinMode(");
+				Serial.print( arg );
+				Serial.print(", ");
+				Serial.print( *(prx+1) );
+				Serial.println(")");
+			#endif
+		}
+	}
+}
+
+/* ======================================================================
+Function: cmd_port
+Purpose : command handler of AVR port value
+Input 	: command being parsed
+					table argument, port (0:B 1:C 2:D)
+Output	: -
+Comments: set with a byte set the port but PB1, our IRQ line, set with 
+					CMD_PORT_VALUE mask value set only mask bits, others may be 
+					driven by us (IRQ line)
+====================================================================== */
+void cmd_port(struct cmd_ctx * ctx, byte arg)
+{
+	volatile uint8_t * pport = g_port[arg];
+	volatile byte * prx = ctx->prx;
+
+	// port Get command
+	if ( ctx->is_get )
+	{
+		*ctx->ptx = *pport ;
+		*ctx->ptx_len = 1;
+	}
+	// port Set of masked bits, IRQ line may change meanwhile
+	else if ( ctx->len == 4 && *prx == CMD_PORT_VALUE )
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			*pport = (*pport & ~*(prx+1)) | (*(prx+2) & *(prx+1));
+		}
+	}
+	// PORTB Set command, IRQ line is ours
+	else if ( arg == 0 )
+	{
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			*pport = (*pport & _BV(PORTB1)) | (*prx & ~_BV(PORTB1));
+		}
+	}
+	// port Set command
+	else
+	{
+		*pport = *prx;
+	}
+	
+	#ifdef DEBUG_SERIAL
+		Serial.print("Port ");
+		Serial.write( 'B' + arg );
+		if (ctx->is_get)
+		{
+			Serial.print(" value is 0x");
+			Serial.println(*ctx->ptx, HEX);
+		}
+		else
+		{
+			Serial.print(" Set to 0x");
+			Serial.println(*ctx->prx, HEX);
+		}
+	#endif
+}
+
+/* ======================================================================
+Function: cmd_ddr
+Purpose : command handler of AVR port direction
+Input 	: command being parsed
+					table argument, port (0:B 1:C 2:D)
+Output	: -
+Comments: set with a byte set the port DDR, set with a word (bit + 
+					direction) set one pin direction, set with CMD_DDR_VALUE mask
+					value set only mask bits
+====================================================================== */
+void cmd_ddr(struct cmd_ctx * ctx, byte arg)
+{
+	volatile uint8_t * pddr = g_ddr[arg];
+	volatile byte * prx = ctx->prx;
+	byte mask;
+
+	// port Get command
+	if ( ctx->is_get )
+	{
+		*ctx->ptx = *pddr ;
+		*ctx->ptx_len = 1;
+
+		#ifdef DEBUG_SERIAL
+			Serial.print("DDR ");
+			Serial.write( 'B' + arg );
+			Serial.print(" value is 0x");
+			Serial.println(*ctx->ptx, HEX);
+		#endif
+	}
+	// AVR Set port direction (byte value)
+	else if ( ctx->len == 2 )
+	{
+		*pddr = *prx;
+		
+		#ifdef DEBUG_SERIAL
+			Serial.print("DDR ");
+			Serial.write( 'B' + arg );
+			Serial.print(" Set to 0x");
+			Serial.println(*prx, HEX);
+		#endif
+	}
+	// AVR Set port pin direction command (word value)
+	else if ( ctx->len == 3 && *prx <= CMD_PORT_PIN7 )
+	{
+		// 1st byte is port pin, 2nd byte DDR value
+		mask = 1 << *prx;
+
+		if ( *(prx+1) == 0x01 )
+			*pddr |= mask;
+		else if ( *(prx+1) == 0x00 )
+			*pddr &= ~mask;
+
+		#ifdef DEBUG_SERIAL
+			Serial.print("Pin DDR ");
+			Serial.write( 'B' + arg );
+			Serial.print(" mask 0x");
+			Serial.print( mask, HEX );
+			Serial.println( *(prx+1) ? " set" : " cleared");
+		#endif
+	}
+	// AVR Set port masked direction bits
+	else if ( ctx->len == 4 && *prx == CMD_DDR_VALUE )
+	{
+		*pddr = (*pddr & ~*(prx+1)) | (*(prx+2) & *(prx+1));
+	}
+}
+
+/* ======================================================================
+Function: cmd_handler
+Purpose : handler of a command byte
+Input 	: command byte
+Output	: command handler
+Comments: evaluated at compile time to build g_cmd_table
+====================================================================== */
+constexpr cmd_fn cmd_handler(byte c)
+{
+	return 
+		( c <= CMD_ARDUINO_PIN18 ) ? cmd_pin :
+		( c >= CMD_AVR_CMD_PORTB && c <= CMD_AVR_CMD_PORTD ) ? cmd_port :
+		( c >= CMD_AVR_CMD_DDRB && c <= CMD_AVR_CMD_DDRD ) ? cmd_ddr :
+		( c >= CMD_A0_ARDUINO && c <= CMD_A6_ARDUINO ) ? cmd_analog :
+		( c >= CMD_A0_AVR && c <= CMD_A6_AVR ) ? cmd_analog :
+		( c == CMD_PING ) ? cmd_ping :
+		( c == CMD_SNAPSHOT ) ? cmd_snapshot :
+		( c == CMD_ADC_DRAIN ) ? cmd_adc_drain :
+		( c == CMD_PERF ) ? cmd_perf :
+		( c == CMD_I2C_SPEED ) ? cmd_i2c_speed :
+		( c == CMD_WATCH ) ? cmd_watch :
+		( c == CMD_1WIRE ) ? cmd_1wire :
+		( c == CMD_1WIRE_ROM ) ? cmd_1wire_rom :
+		cmd_none;
+}
 
+/* ======================================================================
+Function: cmd_arg
+Purpose : handler argument of a command byte
+Input 	: command byte
+Output	: argument given to command handler
+Comments: evaluated at compile time to build g_cmd_table
+====================================================================== */
+constexpr byte cmd_arg(byte c)
+{
+	return 
+		( c <= CMD_ARDUINO_PIN18 ) ? c :
+		( c >= CMD_AVR_CMD_PORTB && c <= CMD_AVR_CMD_PORTD ) ? c - CMD_AVR_CMD_PORTB :
+		( c >= CMD_AVR_CMD_DDRB && c <= CMD_AVR_CMD_DDRD ) ? c - CMD_AVR_CMD_DDRB :
+		( c >= CMD_A0_ARDUINO && c <= CMD_A6_ARDUINO ) ? c - CMD_A0_ARDUINO :
+		( c >= CMD_A0_AVR && c <= CMD_A6_AVR ) ? c - CMD_A0_AVR :
+		0;
+}
 
-	/*		
-			SeeedGrayOled.setTextXY(2,0);           
-			SeeedGrayOled.putString("Vcc ");
-			dtostrf(g_vcc/1000.0,4,2,buff);
-			SeeedGrayOled.putString(buff);
-			SeeedGrayOled.putString(" V");
-			
-			SeeedGrayOled.setTextXY(3,0);
-			SeeedGrayOled.putString("A0  ");
-			dtostrf(_a0/1000.0,4,2,buff);
-			SeeedGrayOled.putString(buff);
-			SeeedGrayOled.putString(" V");
-
-			SeeedGrayOled.setTextXY(4,0);
-			SeeedGrayOled.putString("A1  ");
-			dtostrf(_a1/1000.0,4,2,buff);
-			SeeedGrayOled.putString(buff);
-			SeeedGrayOled.putString(" V");
-
-			SeeedGrayOled.setTextXY(5,0);
-			SeeedGrayOled.putString("3V3 ");
-			dtostrf(_a2/1000.0,4,2,buff);
-			SeeedGrayOled.putString(buff);
-			SeeedGrayOled.putString(" V");
+// command table, one entry per command byte, in flash
+#define CMD_ENTRY(c)	{ cmd_handler(c), cmd_arg(c) }
+#define CMD_ROW(h)	CMD_ENTRY(h|0x0), CMD_ENTRY(h|0x1), CMD_ENTRY(h|0x2), CMD_ENTRY(h|0x3), \
+										CMD_ENTRY(h|0x4), CMD_ENTRY(h|0x5), CMD_ENTRY(h|0x6), CMD_ENTRY(h|0x7), \
+										CMD_ENTRY(h|0x8), CMD_ENTRY(h|0x9), CMD_ENTRY(h|0xA), CMD_ENTRY(h|0xB), \
+										CMD_ENTRY(h|0xC), CMD_ENTRY(h|0xD), CMD_ENTRY(h|0xE), CMD_ENTRY(h|0xF)
 
-			SeeedGrayOled.setTextXY(6,0);
-			SeeedGrayOled.putString("Vin ");
-			dtostrf(_a3/1000.0,4,2,buff);
-			SeeedGrayOled.putString(buff);
-			SeeedGrayOled.putString(" V");
-	*/		
-			_millis = millis() - _millis;
+const struct cmd_entry g_cmd_table[256] PROGMEM =
+{
+	CMD_ROW(0x00), CMD_ROW(0x10), CMD_ROW(0x20), CMD_ROW(0x30), 
+	CMD_ROW(0x40), CMD_ROW(0x50), CMD_ROW(0x60), CMD_ROW(0x70), 
+	CMD_ROW(0x80), CMD_ROW(0x90), CMD_ROW(0xA0), CMD_ROW(0xB0), 
+	CMD_ROW(0xC0), CMD_ROW(0xD0), CMD_ROW(0xE0), CMD_ROW(0xF0)
+};
 
-			SeeedGrayOled.setTextXY(8,0);
-			SeeedGrayOled.putString("took ");
-			SeeedGrayOled.putNumber(_millis);
-			SeeedGrayOled.putString(" ms");
+/* ======================================================================
+Function: serial_test
+Purpose : serial test, send back what we get followed by :OK
+Input 	: command received (0 terminated)
+					command size
+Output	: -
+Comments: Specific to test firmware, then Pi should send back ACK
+====================================================================== */
+void serial_test(volatile byte * prx, byte len)
+{
+	byte i;
 
-			// Set i2c to 100Khz
-			// TWBR = 72 ;
-		}
-/*		
-		SeeedGrayOled.setTextXY(2,0);           
-		SeeedGrayOled.putString("Vcc ");
-		dtostrf(g_vcc/1000.0,4,2,buff);
-		SeeedGrayOled.putString(buff);
-		SeeedGrayOled.putString(" V");
-		
-		SeeedGrayOled.setTextXY(3,0);
-		SeeedGrayOled.putString("A0  ");
-		dtostrf(_a0/1000.0,4,2,buff);
-		SeeedGrayOled.putString(buff);
-		SeeedGrayOled.putString(" V");
-
-		SeeedGrayOled.setTextXY(4,0);
-		SeeedGrayOled.putString("A1  ");
-		dtostrf(_a1/1000.0,4,2,buff);
-		SeeedGrayOled.putString(buff);
-		SeeedGrayOled.putString(" V");
-
-		SeeedGrayOled.setTextXY(5,0);
-		SeeedGrayOled.putString("3V3 ");
-		dtostrf(_a2/1000.0,4,2,buff);
-		SeeedGrayOled.putString(buff);
-		SeeedGrayOled.putString(" V");
-
-		SeeedGrayOled.setTextXY(6,0);
-		SeeedGrayOled.putString("Vin ");
-		dtostrf(_a3/1000.0,4,2,buff);
-		SeeedGrayOled.putString(buff);
-		SeeedGrayOled.putString(" V");
-*/		
-
-		// Set i2c to 100Khz
-		//TWBR = 72 ;
-
-		// restart new loop 
-		ldelay = LOOP_DELAY ;
-		
-		// setup a new blink
-		nblink = 2;
+	#ifdef DEBUG_SERIAL
+		Serial.print("Serial received(");
+		Serial.print(len);
+		Serial.print(") : ");
+	#endif
+	
+	// If we received ACK from PI, all is fine
+	if ( prx[0] == 'A' && prx[1] == 'C' && prx[2] == 'K' )
+	{
+		g_ser_tested = true;
+	}
+	else
+	{
+		// print all buffer received bytes followed by OK
+		for (i = 0; i < len ; i++)
+			Serial.write(prx[i]);
+
+		// Add the :OK at the end to tell Pi it's OKAY
+		// After that, PI should send US ACK response
+		Serial.println(":OK");
+		Serial.flush();
 	}
 }
 
-
-
-
 /* ======================================================================
 Function: parse_cmd
 Purpose : parse command received
-Input 	: flag indicating if we need to send return value (ie i2cget command)
+Input 	: command descriptor
+					flag indicating if we need to send return value (ie i2cget command)
 					this flag is set when called from i2c interrupt 
 Output	: number of blink the alive led should blink
-Comments: 
+Comments: response is only prepared in interface tx buffer, it's up
+					to the interface to send it back
+					command byte is dispatched by g_cmd_table in constant time
 ====================================================================== */
-int parse_cmd( boolean is_get_command )
+int parse_cmd( struct cmd_desc * d, boolean is_get_command )
 {
-	volatile byte * prx ;		// pointer on received buffer
-	volatile byte * ptx;	// pointer ou transmit buffer 
-	volatile byte * ptx_len;	// pointer ou transmit buffer len
-	volatile byte * prx_len;	// pointer ou received buffer len
+	struct cmd_ctx ctx;
+	volatile byte * prx = d->buf;
+	byte src = d->src;
+	cmd_fn fn;
+	byte cmd, arg;
+	unsigned long start = micros();
 
-	static volatile uint8_t *pport	;	// pointer to the port we will work on
-	static volatile uint8_t *pddr	;	// pointer to the port DDR we will work on
-	static int i;
-	static byte cmd;
+	g_perf.cmd[src]++;
 
-	// pointer to the correct buffer
-	if ( g_i2c_new )
+	// pointer to the correct response buffer
+	if ( src == SRC_I2C )
 	{
-		// i2c command
-		prx = &g_i2c_rx_buf[0] ;
-		ptx = &g_i2c_tx_buf[0] ;
-		ptx_len = &g_i2c_tx_len ;
-		prx_len = &g_i2c_rx_len ;
+		ctx.ptx = g_i2c_tx_buf ;
+		ctx.ptx_len = &g_i2c_tx_len ;
 	}
-	else if (g_spi_new)
+	else if ( src == SRC_SPI )
 	{
-		// spi command
-		prx = &g_spi_rx_buf[0] ;
-		ptx = &g_spi_tx_buf[0] ;
-		ptx_len = &g_spi_tx_len ;
-		prx_len = &g_i2c_rx_len ;
+		ctx.ptx = g_spi_tx_buf ;
+		ctx.ptx_len = &g_spi_tx_len ;
 	}
 	else
 	{
-		// serial command
-		prx = &g_ser_rx_buf[0] ;
-		ptx = &g_ser_tx_buf[0] ;
-		ptx_len = &g_ser_tx_len ;
-		prx_len = &g_ser_rx_len ;
+		// after sequence and status
+		ctx.ptx = g_ser_tx_buf + 2 ;
+		ctx.ptx_len = &g_ser_tx_len ;
 	}
-	
 
-	if ( ! is_get_command)
-	{
-		#ifdef DEBUG_SERIAL
-			Serial.print(g_i2c_new ? "I2C":g_spi_new ? "SPI":"Serial");
+	ctx.len = d->len;
+
+	ctx.src = src;
+	ctx.is_get = is_get_command;
+
+	#ifdef DEBUG_SERIAL
+		if ( ! is_get_command)
+		{
+			Serial.print(src == SRC_I2C ? "I2C": src == SRC_SPI ? "SPI":"Serial");
 			Serial.print(" Command (");
-			Serial.print(*prx_len);
+			Serial.print(ctx.len);
 			Serial.print(") : ");
 		
 			// print all buffer received bytes
-			for (i = 0; i <*prx_len ; i++)
+			for (arg = 0; arg < ctx.len ; arg++)
 			{
-				Serial.print(*(prx+i), HEX);
+				Serial.print(prx[arg], HEX);
 				Serial.print(" ");
 			}
 			Serial.println("");
-		#endif
-	}
+		}
+	#endif
 		
 	// get command received and point on next value
-	cmd = *prx++;
+	cmd = *prx;
+	ctx.prx = prx + 1;
 	
-	// Ping set return value command 
-	if ( cmd == CMD_PING )
-	{
-		// Ping Get command
-		if ( is_get_command )
-		{
-			*ptx = g_ping ;
-			*ptx_len = 1;
+	fn = (cmd_fn) pgm_read_word(&g_cmd_table[cmd].fn);
+	arg = pgm_read_byte(&g_cmd_table[cmd].arg);
+	fn(&ctx, arg);
 
-			// send response buffer quickly before debug
-			if ( g_i2c_new)
-			{
-				Wire.write( (uint8_t *) ptx, *ptx_len); 
-				g_i2c_tested = true;
-			}
-			
-			#ifdef DEBUG_SERIAL
-				Serial.print("Ping = 0x");
-				Serial.println(*ptx, HEX);
-			#endif
-		}
-		// Ping Set command
-		else if ( *prx_len == 2 )
-		{
-			// next ping will return the new data received
-			g_ping = *prx;
-			
-			#ifdef DEBUG_SERIAL
-				Serial.print("Set Ping return value to 0x");
-				Serial.println(g_ping, HEX);
-			#endif
-		}
-	} // if ping command
-	
-	
-	// Specific to test firmware, just send back what we get on serial
-	// followed by :OK, then Pi should send back ACK
-	if ( g_ser_new)
+	// protected get, CRC of command byte and response, so master can
+	// also see a response to another command
+	if ( is_get_command && d->crc )
 	{
-			#ifdef DEBUG_SERIAL
-				Serial.print("Serial received(");
-				Serial.print(*prx_len);
-				Serial.print(") : ");
-			#endif
-			
-			// If we received ACK from PI, all is fine
-			if (*(prx-1) == 'A' && *(prx+0) == 'C' && *(prx+1) == 'K' )
-			{
-				g_ser_tested = true;
-			}
-			else
-			{
-				// print all buffer received bytes followed by OK
-				for (i = 0; i <*prx_len ; i++)
-					Serial.write(*(prx+i-1));
-
-				// Add the :OK at the end to tell Pi it's OKAY
-				// After that, PI should send US ACK response
-				Serial.println(":OK");
-				Serial.flush();
-			}
-
-			// Nothing more to do
-			return 0;
+		ctx.ptx[*ctx.ptx_len] = crc8( crc8(0, &cmd, 1), ctx.ptx, *ctx.ptx_len);
+		(*ctx.ptx_len)++;
 	}
-	
-	// Analog command
-	else if ( (cmd >= CMD_A0_ARDUINO && cmd <= CMD_A6_ARDUINO) || (cmd >= CMD_A0_AVR && cmd <= CMD_A6_AVR) )
-	{
-		if (cmd >= CMD_A0_AVR )
-			// convert avr command to arduino
-			cmd -= CMD_A0_AVR;
-		else
-			// convert arduino command to analog port (0..5)
-			cmd -= CMD_A0_ARDUINO;
-
-		// Analog Get command
-		if ( is_get_command )
-		{
-			// A6 is not existing but we will use this command to return vcc value in mV
-			if (cmd == CMD_A0_ARDUINO - CMD_A6_ARDUINO) 
-			{
-				i = g_vcc;
-			}
-			else
-			{
-					// read data (could be optimized with direct avr register control)
-				i = analogRead ( cmd );
-			}
-			
-			// LSB first 
-			*ptx = (byte) ( i & 0xFF);
-			*(ptx+1) = (byte) ( ( i & 0xFF00)  >> 8 );
-			*ptx_len = 2;
-
-			// send I2C response buffer quickly before debug
-			Wire.write( (uint8_t *) ptx, *ptx_len); 
-				
-			// SPI response
-			if ( g_spi_new) 	
-			{
-				// To DO SPI response
-			}
-			
-			#ifdef DEBUG_SERIAL
-				Serial.print("AnalogRead(");
-				Serial.print( cmd );
-				Serial.print(") = ");
-				Serial.println(i, HEX);
-			#endif
-
-		}
-	} // if Analog Read command
-	
-	// Arduino pin command 
-	else if ( (cmd >= CMD_ARDUINO_PIN0 && cmd <= CMD_ARDUINO_PIN18) )
-	{
-		// Arduino Get pin command
-		if ( is_get_command )
-		{
-			*ptx = digitalRead ( cmd);
-			*ptx_len = 1;
-
-			// send response buffer quickly before debug
-			Wire.write( (uint8_t *) ptx, *ptx_len); 
-				
-			#ifdef DEBUG_SERIAL
-				Serial.print("DigitalRead(");
-				Serial.print( cmd );
-				Serial.print(")=");
-				Serial.println( *ptx );
-			#endif
-		}
-		// Arduino Set pin command (byte value)
-		else if ( *prx_len == 2 )
-		{
-			// 1st byte is DDR command 
-			if (*prx == INPUT || *prx==OUTPUT )
-			{
-				digitalWrite ( cmd, *prx);
-				#ifdef DEBUG_SERIAL
-					Serial.print("DigitalWrite(");
-					Serial.print( cmd );
-					Serial.print(", 0x");
-					Serial.print( *prx, HEX );
-					Serial.println(")");
-				#endif
-			}
-		}
-		// Arduino Set pin direction command (word value)
-		else if ( *prx_len == 3 )
-		{
-			// 1st byte is DDR command 
-			if (*prx == CMD_DDR_ARDUINO)
-			{
-				// 2nd byte is pin mode value
-				if (*(prx+1) >= INPUT || *(prx+1) <= INPUT_PULLUP)
-				{
-					pinMode ( cmd, *(prx+1) );
-					#ifdef DEBUG_SERIAL
-						Serial.print("pinMode(");
-						Serial.print( cmd );
-						Serial.print(", 0x");
-						Serial.print( *prx, HEX );
-						Serial.print( "," );
-						Serial.print( *(prx+1) );
-						Serial.println(")");
-					#endif
-				}
-			}
-		}
-	} // if Arduino pin command 
-	
-	// AVR port value
-	else if ( cmd >= CMD_AVR_CMD_PORTB && cmd <= CMD_AVR_CMD_PORTD )
-	{
-		// on which port and DDR we will work
-		if ( cmd == CMD_AVR_CMD_PORTB ) 
-		{
-			pport = &PORTB;
-		}
-		else if ( cmd == CMD_AVR_CMD_PORTC ) 
-		{
-			pport = &PORTC;
-		}
-		else
-		{
-			pport = &PORTD;
-		}
-		
-		// port Get command
-		if ( is_get_command)
-		{
-			// now we know the port, get port value
-			*ptx = *pport ;
-			*ptx_len = 1;
-
-			// send response buffer quickly before debug
-			Wire.write( (uint8_t *) ptx, *ptx_len); 
-
-		}
-		// port Set command
-		else
-		{
-			*pport = *prx;
-		}
-		
-		#ifdef DEBUG_SERIAL
-			Serial.print("Port ");
-			Serial.write( 'B' + (cmd - CMD_AVR_CMD_PORTB));
-			if (is_get_command)
-			{
-				Serial.print(" value is 0x");
-				Serial.println(*ptx, HEX);
-			}
-			else
-			{
-				Serial.print(" Set to 0x");
-				Serial.println(*prx, HEX);
-			}
-		#endif
-		
-	}	// if AVR port value
-
-	// AVR DDR port value
-	else if ( cmd >= CMD_AVR_CMD_DDRB && cmd <= CMD_AVR_CMD_DDRD )
-	{
-		// on which port and DDR we will work
-		if ( cmd == CMD_AVR_CMD_DDRB ) 
-		{
-			pddr = &DDRB;
-		}
-		else if ( cmd == CMD_AVR_CMD_DDRC ) 
-		{
-			pddr = &DDRC;
-		}
-		else
-		{
-			pddr = &DDRD;
-		}
-		// port Get command
-		if ( is_get_command)
-		{
-			// now we know the port, get port value
-			*ptx = *pddr ;
-			*ptx_len = 1;
-
-			// send response buffer quickly before debug
-			Wire.write( (uint8_t *) ptx, *ptx_len); 
-			
-			#ifdef DEBUG_SERIAL
-				Serial.print("DDR ");
-				Serial.write( 'B' + (cmd - CMD_AVR_CMD_DDRB) );
-				Serial.print(" value is 0x");
-				Serial.println(*ptx, HEX);
-			#endif
-
-		}
-		// AVR Set port direction (byte value)
-		else if ( *prx_len == 2 )
-		{
-			*pddr = *prx;
-			
-			#ifdef DEBUG_SERIAL
-				Serial.print("DDR ");
-				Serial.write( 'B' + (cmd - CMD_AVR_CMD_DDRB) );
-				Serial.print(" Set to 0x");
-				Serial.println(*prx, HEX);
-			#endif
-	
-		}
-		// AVR Set port pin direction command (word value)
-		else if ( *prx_len == 3 )
-		{
-			// 1st byte is port pin 
-			if (*prx >= CMD_PORT_PIN0 && *prx <= CMD_PORT_PIN7)
-			{
-				// get bit asked
-				i = ( 1 << (*prx) );
-
-				// if 2nd byte is DDR value 1
-				if (*(prx+1) == 0x01)
-				{
-					*pddr |= i;
-					#ifdef DEBUG_SERIAL
-						Serial.print("Set Pin DDR");
-						Serial.print(cmd);
-						Serial.print(" (|=0x");
-						Serial.print( i, HEX );
-						Serial.println(")");
-					#endif
-				}
-				// reset pin direction
-				// if 2nd byte is DDR value 1
-				else if (*(prx+1) == 0x00)
-				{
-					*pport &= ~i;
-					#ifdef DEBUG_SERIAL
-						Serial.print("Clear Pin DDR ");
-						Serial.print(cmd);
-						Serial.print(" (&=0x");
-						Serial.print( ~i, HEX );
-						Serial.println(")");
-					#endif
-				}
-			}
-		}
-	} // if AVR DDR port value
 
-	// PWM command
-	else if ( (cmd >= CMD_A0_ARDUINO && cmd <= CMD_A6_ARDUINO) || (cmd >= CMD_A0_AVR && cmd <= CMD_A6_AVR) )
-	{
-		/* TO DO
-		*/
-	}
+	// longest command
+	start = micros() - start;
+	if ( start > g_perf.parse_max )
+		g_perf.parse_max = start > 0xFFFF ? 0xFFFF : start;
 
-	
+	// one blink per command
+	return 1;
 }
 
 
@@ -985,33 +2068,19 @@ Output	: -
 Comments: ISR code, should be as small as possible, avoid print, println
 					or consuming code. If you need heavy treatment, put a flag and 
 					do it async in the main loop
-					you can also send response as fast as possible and do print after
-					this oode is called when we issue a i2cget command from Raspberry
-					so we need to answer in this routine, we can't do it async
+					response has already been prepared when we received the 
+					command (see receivei2cEvent) so we just stream the whole 
+					response buffer, master can read it in one transaction 
+					(i2c combined write/read with repeated start)
 					!!! here we treat only response to send back to master !!!
 ====================================================================== */
 void requesti2cEvent()
 {
-	static int i;
-	volatile static byte cmd ;
-	volatile uint8_t *pport	;	// pointer to the port we will work on
-	volatile uint8_t *pddr	;	// pointer to the port DDR we will work on
-
-
-	// we received new data and it is a read command (1 byte data)
-	if ( g_i2c_new && g_i2c_rx_len == 1)
-	{
-		parse_cmd( true) ;
-		
-		// we done what ne needed to on our received command
-		g_i2c_new = false;
-	}
-
 	// we validated the response
   if( g_i2c_tx_len >0)
   {
-    // send response buffer 
-    //Wire.write(g_i2c_tx_buf, g_i2c_tx_len); 
+    // send response buffer, wire can be called only once per request
+    Wire.write(g_i2c_tx_buf, g_i2c_tx_len); 
   }
   else
   {
@@ -1030,10 +2099,15 @@ Output	: -
 Comments: ISR code, should be as small as possible, avoid print, println
 					or consuming code. If you need heavy treatment, put a flag and 
 					do it in the main loop
+					command is lost only if all descriptors are in use
+					a single byte (or ADC drain) is a get command, the master will 
+					read the response just after (repeated start) so prepare it now
+					this avoid main loop eating the command before the request
 ====================================================================== */
 void receivei2cEvent(int nbyte)
 {
   static byte p;
+  struct cmd_desc * d = NULL;
   
   // if 0 then result of i2c detect from Pi so it works
   if (nbyte == 0)
@@ -1041,25 +2115,44 @@ void receivei2cEvent(int nbyte)
   
   
   // check not overflowing, our buffer is enought ?
-  if ( nbyte < CMD_MAX_SIZE && nbyte > 0)
+  if ( nbyte < CMD_MAX_SIZE && nbyte > 0 && (d = cmd_alloc(SRC_I2C)) != NULL )
   {
-    // Grab all the command bytes into the receive buffer
+    // Grab all the command bytes into the descriptor
     for (p = 0; p < nbyte; p++)
     {
-      g_i2c_rx_buf[p] = Wire.read();
+      d->buf[p] = Wire.read();
     }
 		
 		// len of data received
-		g_i2c_rx_len = nbyte;
+		d->len = nbyte;
 		
 		// init response len
 		g_i2c_tx_len = 0;
 
-    // get out quickly from isr
-    // we will do some long time instruction 
-		// such as display in the mail loop
-    g_i2c_new = true;
-
+		// bad CRC, drop command, master will see it and retry
+		if ( !cmd_unwrap(d) )
+		{
+			cmd_ack(SRC_I2C, CRC_NAK);
+			cmd_free(d);
+		}
+		// read command, prepare response for the request
+		else if ( cmd_is_get(d) )
+		{
+			parse_cmd( d, true) ;
+			cmd_free(d);
+		}
+		else
+		{
+			// protected set, master read acknowledge
+			if ( d->crc )
+				cmd_ack(SRC_I2C, CRC_ACK);
+
+			// get out quickly from isr
+			// we will do some long time instruction 
+			// such as display in the mail loop
+			// commands following this one are queued behind it
+			cmd_push(d);
+		}
   }
   else
   {
@@ -1069,9 +2162,52 @@ void receivei2cEvent(int nbyte)
 
 		// indicate a error
     g_cmd_err++;
+
+		if ( nbyte )
+			g_perf.overflow[SRC_I2C]++;
   }
 }
 
+/* ======================================================================
+Function: spi_rx_byte
+Purpose : treat a byte exchanged with spi master
+Input 	: byte received
+Output	: -
+Comments: called from ISR with next response byte already loaded
+					separator bytes before a command are padding sent by master
+					while it's reading the response, they are not stored
+====================================================================== */
+void spi_rx_byte(byte c)
+{
+	struct cmd_desc * d = g_spi_cmd;
+
+	if ( !d )
+	{
+		// padding before command
+		if ( c == CMD_SEPARATOR )
+			return;
+
+		// first command byte, get a descriptor for it
+		if ( (d = g_spi_cmd = cmd_alloc(SRC_SPI)) == NULL )
+		{
+			g_cmd_err++;
+			g_perf.overflow[SRC_SPI]++;
+			return;
+		}
+	}
+
+	// check not overflowing, our buffer is enought ?
+	if ( d->len < CMD_MAX_SIZE )
+	{
+		d->buf[d->len++] = c;
+	}
+	else
+	{
+		g_cmd_err++;
+		g_perf.overflow[SRC_SPI]++;
+	}
+}
+
 /* ======================================================================
 Function: spi interrupt vector
 Purpose : called when received spi data byte
@@ -1086,72 +2222,120 @@ Comments: ISR code, should be as small as possible, avoid print, println
 					The response has to be in the next exchange. 
 					This is because the bits which are being sent, and the bits 
 					which are being received, are being sent simultaneously. 
-					Thus master has to talk to the slave two times, what we decided here
-					  - Master send the string command according API
-						- Slave ACK the command with 0xAA return value
-						- Master wait slave to be ok to send back response
-						- Master send the 0x55 to tell the slave now he needs answer
-						- Slave send back the string response
-					
+					So the protocol is pipelined, a frame is all bytes sent 
+					while SS is low :
+					  - Master send a frame with the command, preceded by 
+						  separator (0xFF) padding if needed
+						- At end of frame (SS high) slave execute command and
+						  prepare the response
+						- During next frame, slave send back the response while
+						  master send the next command (or padding only)
+						- Bytes after the response are ping value
+					Next byte to send must be in SPDR before master clock it, at 
+					high spi speed master need to leave a delay between bytes
  ====================================================================== */
 ISR (SPI_STC_vect)
 {
-	static byte p;
+	byte c;
 
 	// get value from SPI Data Register    
-	p = SPDR;  
+	c = SPDR;  
 	
-	// SPI next response should always be ping response
-	SPDR = g_ping;
+	// load next response byte as soon as possible, then ping value
+	if ( g_spi_tx_pos < g_spi_tx_len )
+		SPDR = g_spi_tx_buf[g_spi_tx_pos++];
+	else
+		SPDR = g_ping;
+
+	spi_rx_byte(c);
+} 
+
+/* ======================================================================
+Function: SS pin change interrupt vector
+Purpose : called on SS pin change, end of frame when it goes high 
+Input 	: -
+Output	: -
+Comments: ISR code, do the received command and prepare the response
+					for the next frame, so master need to wait a little after
+					SS goes high before starting next frame
+					also called on watched inputs change of port B
+====================================================================== */
+ISR (PCINT0_vect)
+{
+	byte pin = PINB;
+	byte chg = pin ^ g_pin_last[0];
+
+	watch_latch(0, pin);
+
+	// watched input change only
+	if ( g_watch[0] && !(chg & _BV(PINB2)) )
+		return;
 
-	// indicate main loop we received a byte 
-	g_spi_new = true;          
+	// start of frame, nothing to do
+	if ( !(pin & _BV(PINB2)) )
+		return;
 
-/*
-	// To be sure we have finished processing our prevoius command
-	if ( g_spi_new == false);
+	// last byte of frame not yet treated by spi interrupt
+	// (pin change has higher priority) 
+	if ( SPSR & _BV(SPIF) )
+		spi_rx_byte(SPDR);
+
+	// previous response has been sent
+	g_spi_tx_len = 0;
+
+	if ( g_spi_cmd )
 	{
-		//Serial.print(p, HEX);
+		// get command prepare response now, set command done also now 
+		// so next frame can follow immediately
+		if ( !cmd_unwrap(g_spi_cmd) )
+			cmd_ack(SRC_SPI, CRC_NAK);
+		else if ( cmd_is_get(g_spi_cmd) )
+			parse_cmd( g_spi_cmd, true ) ;
+		else
+		{
+			parse_cmd( g_spi_cmd, false ) ;
 
-		// do we want a response from our previous command ?
-		if (g_spi_rx_len==0 )    
-		{    
-			SPDR = 0x00 ;
+			// protected set, master read acknowledge
+			if ( g_spi_cmd->crc )
+				cmd_ack(SRC_SPI, CRC_ACK);
 		}
-		
-		// if buffer is not full
-		if (g_spi_rx_len < CMD_MAX_SIZE)    
-		{    
-			// New command to process
-			if (p != CMD_SEPARATOR) 
-			{
-				// put received data into buffer
-				g_spi_rx_buf[g_spi_rx_len++] = p;        
-				
-				if ( g_spi_rx_len == 1 && p==CMD_PING )
-				{
-						SPDR = g_ping ;
-				}
 
-				
-			}
-			else
-			{
-				// Send magic code to master indicating we will work
-				//SPDR = 0xAA;
-				
-				// Ping set return value command 
-	//			if ( g_spi_rx_buf[0]==CMD_PING )
-	//			{
-	//					SPDR = g_ping ;
-	//			}
-
-				g_spi_new = true;          
-			}  
-		}
+		cmd_free(g_spi_cmd);
+		g_spi_cmd = NULL;
+
+		// tell main loop
+		g_spi_new = true;
 	}
-	*/
-} 
+
+	// first response byte must be ready before master clock it
+	if ( g_spi_tx_len )
+	{
+		SPDR = g_spi_tx_buf[0];
+		g_spi_tx_pos = 1;
+	}
+	else
+	{
+		SPDR = g_ping;
+		g_spi_tx_pos = 0;
+	}
+}
+
+/* ======================================================================
+Function: port C and D pin change interrupt vectors
+Purpose : called on watched inputs change of port C or D
+Input 	: -
+Output	: -
+Comments: ISR code, only latch changes
+====================================================================== */
+ISR (PCINT1_vect)
+{
+	watch_latch(1, PINC);
+}
+
+ISR (PCINT2_vect)
+{
+	watch_latch(2, PIND);
+}
 
 /* ======================================================================
 Function: ISR issued from ADC
@@ -1161,18 +2345,51 @@ Output	: -
 Comments: ISR code, should be as small as possible, avoid print, println
 					or consuming code. If you need heavy treatment, put a flag and 
 					do it in the main loop
+					store the sample in channel ring, oldest sample is lost if 
+					ring is full, then select next channel, its conversion will
+					be started by next Timer1 compare match B
 ====================================================================== */
-/*
 ISR(ADC_vect)
 {
-  // Done reading
-  readFlag = 1;
-  
-  // Must read low first
-  analogVal = ADCL | (ADCH << 8);
-  
-  // Not needed because free-running mode is enabled.
-  // Set ADSC in ADCSRA (0x7A) to start another ADC conversion
-  // ADCSRA |= B01000000;
+	uint16_t v;
+	uint8_t ch = g_adc_ch;
+
+	// Must read low first
+	v = ADCL;
+	v |= ADCH << 8;
+
+	// clear trigger flag so next compare match start a new conversion
+	TIFR1 = _BV(OCF1B);
+
+	g_adc[ch] = v;
+	g_adc_ring[ch][g_adc_head[ch]++ & ADC_RING_MASK] = v;
+	g_adc_last[ch] = g_adc_sweep;
+
+	if ( g_adc_count[ch] < ADC_RING_SIZE )
+	{
+		g_adc_count[ch]++;
+	}
+	else
+	{
+		g_perf.adc_dropped++;
+		if ( g_adc_dropped[ch] < 0xFF )
+			g_adc_dropped[ch]++;
+	}
+
+	// next channel, new sweep after the last one
+	if ( ++ch >= ADC_SCAN_CHANNELS )
+	{
+		unsigned long now = micros();
+
+		ch = 0;
+		g_adc_sweep++;
+
+		g_perf.sweep = now - g_adc_sweep_start;
+		if ( g_perf.sweep > g_perf.sweep_max )
+			g_perf.sweep_max = g_perf.sweep;
+		g_adc_sweep_start = now;
+	}
+
+	g_adc_ch = ch;
+	ADMUX = (ADMUX & 0b11110000) | ADC_MUX(ch);
 }
-*/
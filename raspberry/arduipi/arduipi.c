@@ -17,6 +17,10 @@ Comments: This program is written for the open source project ArduiPi
 #include <unistd.h>
 #include <stdio.h>
 #include <linux/i2c-dev.h>
+// old i2c-tools header already define struct i2c_msg
+#ifndef I2C_M_RD
+#include <linux/i2c.h>
+#endif
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -30,6 +34,16 @@ Comments: This program is written for the open source project ArduiPi
 #include <linux/types.h>
 #include <linux/spi/spidev.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <linux/gpio.h>
+#include <termios.h>
+#include <sys/file.h>
+#include "arduipi_shm.h"
 
 
 // ----------------
@@ -47,6 +61,11 @@ Comments: This program is written for the open source project ArduiPi
 #define I2C_DEVICE_1 	"/dev/i2c-1"
 #define I2C_ADDRESS	0x2A
 
+// i2c bus speed, driver parameter then device tree (big endian u32)
+#define I2C_BAUDRATE_PARAM	"/sys/module/i2c_bcm2708/parameters/baudrate"
+#define I2C_DT_CLOCK				"/sys/class/i2c-adapter/%s/of_node/clock-frequency"
+#define I2C_PROBE_COUNT			16		// ping and speed checks before keeping 400 KHz
+
 // Define spi default device 
 #define SPI_DEVICE_1	"/dev/spidev0.1"
 #define SPI_DEVICE_0	"/dev/spidev0.0"
@@ -54,18 +73,172 @@ Comments: This program is written for the open source project ArduiPi
 #define SPI_BITS_WORD	8	
 #define SPI_SPEED			1000000
 #define SPI_DELAY			0
+#define SPI_CMD_DELAY	40		// usec left to slave to do command at end of frame
+#define SPI_BYTEDELAY_MAX	1000	// usec, longest delay between bytes of a frame
+#define SPI_MAX_SEGMENTS	256	// max segments in one spi message
+
+// Define serial default device, firmware run at 1 Mbaud, Pi UART clock
+// must be raised above 3 MHz for it (init_uart_clock in config.txt)
+#define SERIAL_DEVICE			"/dev/ttyAMA0"
+#define SERIAL_BAUD				1000000
+#define SERIAL_WINDOW			60		// encoded request bytes sent before a response, firmware UART RX ring is 64 bytes
+#define SERIAL_TIMEOUT_MS	100		// response wait
+#define SERIAL_CHUNK			32		// bulk commands per transfer
+#define SERIAL_RX_SIZE		256		// encoded bytes waiting end of frame
+
+// serial frames, COBS encoded then 0x00, last byte is crc8 of all previous
+// request  : seq op command parameters crc
+// response : seq status response crc
+// request encoded size is at most one COBS code byte and the 0x00 more
+#define SERIAL_OP_SET			0x00
+#define SERIAL_OP_GET			0x01
+#define SERIAL_REQ_MAX		(ARDUIPI_CMD_MAX_SIZE + 3)
+#define SERIAL_RSP_MAX		(ARDUIPI_RSP_MAX_SIZE + 3)
+#define SERIAL_REQ_ENC(req)	((req)->cmdlen + 3 + 2)
 
 // Arduipi defined command
 #define ARDUIPI_CMD_PING 0xe0
+#define ARDUIPI_PING_DEFAULT 0x2a		// ping value after reset
+#define ARDUIPI_CMD_SNAPSHOT 0xe1
+
+// Arduipi firmware arduino pins (D0..D13, A0..A4) and AVR registers
+#define ARDUIPI_CMD_PIN_MAX			0x12
+#define ARDUIPI_PIN_MODE				0xdd	// set pin with mode (CMD_DDR_ARDUINO)
+#define ARDUIPI_CMD_PORTB				0x1b	// PORTB, PORTC, PORTD
+#define ARDUIPI_CMD_DDRB				0x2b	// DDRB, DDRC, DDRD
+#define ARDUIPI_PORT_MASKED			0xf0	// PORT set of mask bits : PORTx 0xf0 mask value
+#define ARDUIPI_DDR_MASKED			0xfd	// DDR set of mask bits : DDRx 0xfd mask value
+#define ARDUIPI_FIRMWARE_PORTB	0x02	// PB1 (D9) IRQ line, driven by firmware
+
+// Arduipi firmware max command size (CMD_MAX_SIZE)
+// and max response size (CMD_RSP_MAX_SIZE)
+#define ARDUIPI_CMD_MAX_SIZE	16
+#define ARDUIPI_RSP_MAX_SIZE	32
+
+// Arduipi firmware snapshot response
+#define ARDUIPI_ADC_CHANNELS		6
+#define ARDUIPI_SNAPSHOT_SIZE		(9 + 2 * ARDUIPI_ADC_CHANNELS)
+
+// Arduipi firmware ADC sampler (A0..A5 then 1.1V reference)
+#define ARDUIPI_CMD_ADC_DRAIN		0xe2
+#define ARDUIPI_ADC_SCAN_CHANNELS	(ARDUIPI_ADC_CHANNELS + 1)
+#define ARDUIPI_ADC_SAMPLE_HZ		1400
+#define ARDUIPI_ADC_DRAIN_MAX		13
+#define ARDUIPI_DRAIN_SIZE			(5 + 2 * ARDUIPI_ADC_DRAIN_MAX)
+
+// Arduipi firmware performance counters
+#define ARDUIPI_CMD_PERF				0xe3
+#define ARDUIPI_PERF_SIZE				28
+
+// Arduipi firmware i2c speed (TWBR of its own master transactions)
+#define ARDUIPI_CMD_I2C_SPEED		0xe4
+#define ARDUIPI_TWBR_100KHZ			72
+#define ARDUIPI_TWBR_400KHZ			12
+
+// Arduipi firmware CRC protected frame, CMD_CRC command params crc8
+// protected set answer status then crc8 of CMD_CRC and status
+#define ARDUIPI_CMD_CRC					0xe5
+#define ARDUIPI_CRC_ACK					0x06
+#define ARDUIPI_CRC_NAK					0x15
+
+// Arduipi firmware input change notification, watched inputs masks
+// set then get changes, IRQ line (Arduino D9) high while changes pending
+#define ARDUIPI_CMD_WATCH				0xe6
+#define ARDUIPI_WATCH_SIZE			7
+#define ARDUIPI_WATCH_DEFAULT		0x00, 0x0f, 0x00	// A0..A3, test board inputs
+
+// Arduipi firmware 1-Wire temperatures, converted on all sensors at once
+// get with first sensor return a page : count, round, first, temperatures
+// ROM get with sensor return its ROM code, both are always get commands
+#define ARDUIPI_CMD_1WIRE				0xe7
+#define ARDUIPI_CMD_1WIRE_ROM		0xe8
+#define ARDUIPI_1WIRE_MAX				24
+#define ARDUIPI_1WIRE_PAGE			13		// temperatures per page
+#define ARDUIPI_1WIRE_PAGE_SIZE	(4 + 2 * ARDUIPI_1WIRE_PAGE)
+#define ARDUIPI_1WIRE_PAGES			((ARDUIPI_1WIRE_MAX + ARDUIPI_1WIRE_PAGE - 1) / ARDUIPI_1WIRE_PAGE)
+#define ARDUIPI_1WIRE_NONE			((int16_t) 0x8000)	// not read yet
+#define ARDUIPI_1WIRE_RESCAN		0xff	// first sensor asking a new search
+
+// Raspberry Pi GPIO, character device then sysfs on older kernels
+#define GPIO_CHIP				"/dev/gpiochip0"
+#define GPIO_SYSFS			"/sys/class/gpio"
+#define GPIO_IRQ				4			// wired to Arduino D9 (P1 pin 7)
+#define GPIO_RESET			18		// wired to Arduino RESET, active low (P1 pin 12)
+#define WATCH_TIMEOUT_MS	1000	// line level check if no edge
+
+// Arduino reset, bootloader wait for upload then firmware setup
+#define RESET_PULSE_US		1000	// reset low time, ATmega need 2.5 us
+#define RESET_READY_MS		5000	// max time for firmware to answer ping
+#define RESET_PING_MS			10		// ping period while waiting firmware
+
+// Bus retries, exponential backoff with jitter
+#define BUS_RETRIES				2			// retries of a failed transaction by default
+#define BUS_RETRY_US			500		// first retry delay
+#define BUS_RETRY_MAX_US	20000	// max retry delay before jitter
+#define BUS_CRC_CHUNK			32		// get commands protected in one shot
+
+// Port cache, write-behind shadow of PORT and DDR in daemon and batch modes
+#define CACHE_AGE_MS			1000	// registers read from bus trusted this long
+
+// Long only options
+#define OPT_COALESCE			0x100
+#define OPT_CACHE_AGE			0x101
+#define OPT_TEMPS					0x102
+
+// Streaming mode
+#define STREAM_BUF_RECORDS	4096	// records per buffer (2 buffers)
+#define STREAM_PERIOD_MS		20		// drain period, firmware ring hold 80 ms
+#define STREAM_FLUSH_MS			250		// max time before a buffer is written
+
+// Async logger
+#define LOG_RING_SIZE		256		// messages waiting for syslog (power of 2)
+#define LOG_MSG_SIZE		256
+#define LOG_FLUSH_MS		50		// flusher period
+#define LOG_DEFAULT			LOG_INFO
+
+// Hot path statistics
+#define STATS_BUCKETS		24		// latency histogram, bucket n count time < 2^n us
+#define STATS_ERRNO_MAX	256		// errno values counted
+#define STATS_PERIOD		1			// stats file rewrite period (s)
+
+// Benchmark mode
+#define BENCH_COUNT		1000	// transactions per test when no --count
+
+// Simulator 1-Wire sensors
+#define SIM_1WIRE				3
+
+// Fan-out mode, one worker thread per bus
+#define FANOUT_MAX_SLAVES	32
+#define FANOUT_MAX_BUSES	8
+#define FANOUT_PERIOD_MS	100		// poll plan period by default
+
+// max messages in one i2c combined transaction (I2C_RDWR_IOCTL_MAX_MSGS)
+#define I2C_MAX_MSGS	42
 
 // receive buffer size
 #define BUFFER_SIZE	32
 
+// Daemon mode local socket
+#define DAEMON_SOCKET				"/var/run/arduipi.sock"
+#define DAEMON_MAX_CLIENTS	16
+#define DAEMON_FRAME_SIZE		(BUFFER_SIZE + 2)	// len + opcode/status + payload
+
+// Daemon mode request opcodes
+#define DAEMON_OP_PING		0x01	// no payload, return ping value (byte)
+#define DAEMON_OP_GET			0x02	// payload is command, return byte
+#define DAEMON_OP_GET_WORD	0x03	// payload is command, return word (LSB first)
+#define DAEMON_OP_SET			0x04	// payload is command + data, return nothing
+#define DAEMON_OP_SNAPSHOT	0x05	// no payload, return raw snapshot
+
 // Program mode function
-enum mode_e 	{ MODE_QUICK_ACK, MODE_READ_ACK, MODE_SET, MODE_GET, MODE_GET_WORD };
+enum mode_e 	{ MODE_QUICK_ACK, MODE_READ_ACK, MODE_SET, MODE_GET, MODE_GET_WORD, MODE_DAEMON, MODE_BATCH, MODE_BULK, MODE_SNAPSHOT, MODE_STREAM, MODE_BENCH, MODE_PERF, MODE_WATCH, MODE_RESET, MODE_FANOUT, MODE_SHM, MODE_TEMPS };
+
+// Operations measured by statistics
+enum stat_op_e	{ STAT_INIT, STAT_SMBUS, STAT_I2C_RDWR, STAT_SPI_MSG, STAT_SERIAL, 
+									STAT_ACK, STAT_GET, STAT_GET_WORD, STAT_SET, STAT_BULK, STAT_GETS, STAT_OPS };
 
 // Program protocol 
-enum proto_e 	{ PROTO_I2C, PROTO_SPI, PROTO_SERIAL };
+enum proto_e 	{ PROTO_I2C, PROTO_SPI, PROTO_SERIAL, PROTO_SIM };
 
 // Config Option structure parameters
 struct 
@@ -74,6 +247,7 @@ struct
 	char data[BUFFER_SIZE];	// Data buffer
 	int datasize;
 	int address;					// i2c slave address
+	int i2c_speed;				// i2c speed to negotiate (KHz), 0 to leave bus as is
 	int mode;							// program mode functionnality
 	char *mode_str;				// program mode functionnality human readable
 	int proto;						// protocol used
@@ -82,8 +256,27 @@ struct
 	uint8_t spi_bits;			// spi bits per word
 	uint32_t spi_speed ;	// spi frequency max
 	uint16_t spi_delay;		// spi delay
+	uint16_t spi_bytedelay;	// spi delay between bytes of a frame, 0 for none
+	int baud;							// serial speed
 	int verbose;					// verbose mode, speak more to user
 	int hexout;
+	int crc;							// CRC protect commands and responses
+	int retries;					// retries of a failed transaction
+	char socket[108];			// daemon mode unix socket path
+	char batch[128];			// batch mode command file, "-" for stdin
+	char output[128];			// stream mode output file, "-" for stdout
+	int csv;							// stream mode csv output instead of binary
+	int loglevel;					// syslog messages above this level are dropped
+	int stats;						// dump statistics at exit
+	char statsfile[128];	// statistics file rewritten in long running modes
+	long count;						// stream mode samples (0 for no limit) or bench mode transactions
+	int gpio;							// GPIO of firmware IRQ or reset line, -1 for mode default
+	int dtr;							// reset mode, pulse when avrdude set DTR (strace on stdin)
+	char slaves[256];			// fan-out mode slaves list, proto:device[:address],...
+	int period;						// fan-out mode poll plan, shm mode update period (ms)
+	char shm[64];					// shm mode segment name
+	int coalesce;					// port cache write window (ms), 0 no cache
+	int cache_age;				// port cache max age of values read (ms)
 
 } opts = {
 	.port = "",
@@ -98,17 +291,400 @@ struct
 	.spi_bits = SPI_BITS_WORD,
 	.spi_speed = SPI_SPEED,
 	.spi_delay = SPI_DELAY,
+	.spi_bytedelay = 0,
+	.baud = SERIAL_BAUD,
 	.verbose = false,
-	.hexout = false
+	.hexout = false,
+	.crc = false,
+	.retries = BUS_RETRIES,
+	.socket = DAEMON_SOCKET,
+	.output = "-",
+	.csv = false,
+	.loglevel = LOG_DEFAULT,
+	.count = 0,
+	.gpio = -1,
+	.dtr = false,
+	.slaves = "",
+	.period = FANOUT_PERIOD_MS,
+	.shm = ARDUIPI_SHM_NAME,
+	.coalesce = 0,
+	.cache_age = CACHE_AGE_MS
+};
+
+
+// spi multi segments message
+struct spi_msg
+{
+	struct spi_ioc_transfer tr[SPI_MAX_SEGMENTS];
+	int n;												// number of segments queued
+};
+
+// i2c combined transaction
+struct i2c_xfer
+{
+	struct i2c_msg msgs[I2C_MAX_MSGS];
+	int n;												// number of messages queued
+};
+
+// decoded snapshot of all board I/O
+struct arduipi_snapshot
+{
+	uint8_t seq;											// sequence number
+	uint8_t pin[3];										// PINB, PINC, PIND
+	uint8_t ddr[3];										// DDRB, DDRC, DDRD
+	uint16_t vcc;											// vcc (mV)
+	uint16_t adc[ARDUIPI_ADC_CHANNELS];	// A0..A5 raw values
+};
+
+// decoded firmware performance counters, times in us
+struct arduipi_perf
+{
+	uint16_t cmd[3];									// commands received on i2c, spi, serial
+	uint16_t overflow[3];							// receive overflows on i2c, spi, serial
+	uint16_t parse_max;								// longest command parsing
+	uint32_t loop_max;								// longest main loop iteration
+	uint16_t sweep;										// last ADC sweep of all channels
+	uint16_t sweep_max;								// longest ADC sweep
+	uint16_t adc_dropped;							// ADC samples lost, ring full
+	uint16_t dispatch_max;						// longest wait of a command for main loop
+	uint16_t crc_err;									// commands dropped, bad CRC
+};
+
+// statistics of one operation type
+struct stat_op
+{
+	unsigned long count;
+	unsigned long errors;
+	unsigned long retries;						// retries done after errors
+	double sum;												// total time (s)
+	double max;												// longest (s)
+	unsigned long bucket[STATS_BUCKETS];	// latency histogram
+};
+
+// hot path statistics, only updated by main thread
+struct stats
+{
+	struct stat_op op[STAT_OPS];
+	unsigned long err[STATS_ERRNO_MAX];		// errors count by errno, 0 if above max
+	double start;											// program start
+	double written;										// last stats file write
+};
+
+// async logger message slot
+struct log_slot
+{
+	int ready;												// message written, waiting for flusher
+	int level;												// syslog level
+	char msg[LOG_MSG_SIZE];
+};
+
+// async logger, lock free ring with many writers and one flusher
+struct log_ring
+{
+	struct log_slot slot[LOG_RING_SIZE];
+	unsigned int head;								// next slot to reserve
+	unsigned int tail;								// next slot to flush
+	unsigned int dropped;							// messages lost, ring full
+	int running;											// flusher thread started
+	int stop;													// flusher must drain and exit
+	pthread_t thread;
+};
+
+// fan-out mode slave
+struct fanout_slave
+{
+	int address;											// i2c address
+	double latency;										// last poll time (s)
+};
+
+// fan-out mode bus, driven by its own worker thread
+struct fanout_bus
+{
+	int proto;												// PROTO_xxx
+	char port[128];										// device
+	struct fanout_slave slave[FANOUT_MAX_SLAVES];
+	int n;														// number of slaves
+	pthread_t thread;
+	struct stats stats;								// worker statistics, merged at end
+};
+
+// GPIO line, input with edge events or output
+struct gpio_line
+{
+	int fd;														// line event or handle fd (chardev), value fd (sysfs)
+	int chardev;											// fd is a chardev line
+};
+
+// get command and its response, for transports doing several in one shot
+struct bus_get
+{
+	unsigned char * cmd;							// command byte and parameters
+	int cmdlen;
+	unsigned char * rsp;							// response buffer
+	int len;													// response size
 };
 
+// transport layer, one per protocol, all use g_fd_device
+struct bus_ops
+{
+	const char * name;
+	int (*init)(void);																					// open device, return handle
+	int (*transaction)(int mode, unsigned char * data, int datasize);	// one MODE_xxx transaction
+	int (*bulk)(unsigned char * cmds, unsigned char * values, int n);	// list of get byte
+	int (*gets)(struct bus_get * gets, int n);									// list of get of any size
+};
+
+// firmware 1-Wire temperatures
+struct arduipi_1wire
+{
+	uint8_t count;										// sensors enumerated
+	uint8_t seq;											// conversion round of temperatures
+	uint8_t search;										// searches done, ROM codes change with it
+	int16_t temp[ARDUIPI_1WIRE_MAX];	// 1/16 C, ARDUIPI_1WIRE_NONE if not read
+	uint8_t rom[ARDUIPI_1WIRE_MAX][8];	// ROM codes, read by bus_1wire_rom()
+};
+
+// simulated board state
+struct sim_board
+{
+	uint8_t port[3];									// PORTB, PORTC, PORTD (pins read the same)
+	uint8_t ddr[3];										// DDRB, DDRC, DDRD
+	uint8_t ping;											// ping value
+	uint8_t seq;											// snapshot sequence number
+	double start;											// time ADC sampler started
+	uint32_t drained[ARDUIPI_ADC_SCAN_CHANNELS];	// next sweep to drain per channel
+	uint16_t cmds;										// commands received (perf counter)
+	uint8_t twbr;											// i2c speed register
+	uint8_t watch[3];									// watched inputs masks
+	uint8_t changed[3];								// watched inputs changed
+	uint8_t changes;									// changes since last get
+	uint8_t ow_search;								// 1-Wire searches asked
+};
+
+// write-behind shadow of firmware PORT and DDR registers
+struct port_cache
+{
+	uint8_t reg[2][3];								// PORTB..D then DDRB..D
+	double loaded[2][3];							// time register value was known on bus, 0 if never
+	uint8_t dirty[2][3];							// bits changed but not written yet
+	double pending;										// time of oldest change not written, 0 if none
+	long writes;											// set commands merged
+	long flushed;											// register writes on bus
+	long hits;												// get commands answered from cache
+	long misses;
+};
+
+// stream mode binary record, all little endian
+struct stream_record
+{
+	uint64_t time_ns;									// host monotonic time of sample
+	uint32_t sweep;										// firmware sweep number of sample
+	uint8_t channel;									// 0..5 for A0..A5, 6 for 1.1V reference
+	uint8_t reserved;
+	uint16_t value;										// raw ADC value
+} __attribute__((packed));
+
+// stream mode double buffer, one is filled while the other is written
+struct stream_buf
+{
+	struct stream_record rec[STREAM_BUF_RECORDS];
+	int n;
+};
 
 // ======================================================================
 // Global vars 
 // ======================================================================
-int 	g_fd_device; 	// handle
 int		g_exit_pgm;		// indicate end of the program
 int		g_pi_rev;			// Rasberry Pi Board Revision
+int		g_fd_listen;	// daemon mode listening socket
+struct log_ring g_log;				// async logger
+double g_fanout_start;				// fan-out mode common start (time_now())
+FILE * g_fanout_fp;						// fan-out mode output
+struct port_cache g_cache;		// daemon and batch modes port cache
+
+// transport state, per thread so fan-out mode workers drive one bus each
+__thread int 	g_fd_device; 	// handle
+__thread int	g_slave;			// i2c address of transactions
+__thread uint8_t	g_ser_seq;		// serial next request sequence number
+__thread unsigned char g_ser_rx[SERIAL_RX_SIZE];	// serial bytes received, not yet a frame
+__thread int	g_ser_rx_len;
+__thread const struct bus_ops * g_bus;	// transport of selected protocol
+__thread struct sim_board g_sim;				// simulator backend board
+__thread struct stats g_stats;					// hot path statistics
+__thread char g_bus_error[256];					// why transport init failed
+pthread_mutex_t g_init_lock = PTHREAD_MUTEX_INITIALIZER;	// fan-out workers init with opts
+
+// statistics operation names (STAT_xxx)
+const char * g_stat_names[STAT_OPS] = 
+{ "init", "smbus", "i2c_rdwr", "spi_msg", "serial", "ack", "get", "getword", "set", "bulk", "gets" };
+
+// daemon mode connected clients
+struct 
+{
+	int fd;														// client socket, 0 if free
+	int len;													// bytes received so far
+	unsigned char buf[DAEMON_FRAME_SIZE];	// partial request frame
+} g_clients[DAEMON_MAX_CLIENTS];
+
+/* ======================================================================
+Function: log_flush
+Purpose : send all messages waiting in logger ring to syslog
+Input 	: -
+Output	: -
+Comments: only called by flusher thread, or at exit once it stopped
+====================================================================== */
+void log_flush(void)
+{
+	struct log_slot * slot;
+	unsigned int dropped;
+
+	while (true)
+	{
+		slot = &g_log.slot[g_log.tail & (LOG_RING_SIZE - 1)];
+
+		if ( !__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE) )
+			break;
+
+		syslog(slot->level, "%s", slot->msg);
+
+		// give slot back to writers
+		__atomic_store_n(&slot->ready, false, __ATOMIC_RELAXED);
+		__atomic_store_n(&g_log.tail, g_log.tail + 1, __ATOMIC_RELEASE);
+	}
+
+	if ( (dropped = __atomic_exchange_n(&g_log.dropped, 0, __ATOMIC_RELAXED)) )
+		syslog(LOG_WARNING, "%u log messages dropped", dropped);
+}
+
+/* ======================================================================
+Function: log_flusher
+Purpose : logger background thread
+Input 	: -
+Output	: -
+Comments: wake up every LOG_FLUSH_MS, drain ring until asked to stop
+====================================================================== */
+void * log_flusher(void * arg)
+{
+	struct timespec ts = { 0, LOG_FLUSH_MS * 1000000L };
+
+	while ( !__atomic_load_n(&g_log.stop, __ATOMIC_ACQUIRE) )
+	{
+		log_flush();
+		nanosleep(&ts, NULL);
+	}
+
+	log_flush();
+
+	return NULL;
+}
+
+/* ======================================================================
+Function: log_init
+Purpose : open syslog and start logger background thread
+Input 	: -
+Output	: -
+Comments: messages logged before are kept in ring
+====================================================================== */
+void log_init(void)
+{
+	openlog( PRG_NAME, LOG_PID | LOG_CONS | LOG_NDELAY, LOG_USER);
+
+	if ( pthread_create(&g_log.thread, NULL, log_flusher, NULL) == 0 )
+		g_log.running = true;
+}
+
+/* ======================================================================
+Function: log_close
+Purpose : stop logger background thread, write all waiting messages
+Input 	: -
+Output	: -
+Comments: -
+====================================================================== */
+void log_close(void)
+{
+	if ( g_log.running )
+	{
+		__atomic_store_n(&g_log.stop, true, __ATOMIC_RELEASE);
+		pthread_join(g_log.thread, NULL);
+		g_log.running = false;
+	}
+
+	log_flush();
+	closelog();
+}
+
+/* ======================================================================
+Function: log_vmsg
+Purpose : write event to syslog and to a stream
+Input 	: syslog level (LOG_xxx)
+					stream to write if needed
+					string to write in printf format
+					printf other arguments list
+Output	: -
+Comments: syslog message is only queued in logger ring, stream is 
+					written now, messages above --loglevel are not sent to syslog
+====================================================================== */
+void log_vmsg( int level, FILE * stream, const char *format, va_list args)
+{
+	char tmpbuff[LOG_MSG_SIZE];
+	struct log_slot * slot = NULL;
+	unsigned int head;
+	int to_stream = (stream && opts.verbose) || stream == stdout;
+
+	if ( level > opts.loglevel && !to_stream )
+		return;
+
+	vsnprintf (tmpbuff, sizeof(tmpbuff), format, args);
+
+	if ( level <= opts.loglevel )
+	{
+		// reserve a slot, drop message if ring is full
+		head = __atomic_load_n(&g_log.head, __ATOMIC_RELAXED);
+		do
+		{
+			if ( head - __atomic_load_n(&g_log.tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE )
+				break;
+
+			if ( __atomic_compare_exchange_n(&g_log.head, &head, head + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED) )
+				slot = &g_log.slot[head & (LOG_RING_SIZE - 1)];
+		}
+		while ( !slot );
+
+		if ( slot )
+		{
+			slot->level = level;
+			strcpy(slot->msg, tmpbuff);
+			__atomic_store_n(&slot->ready, true, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			__atomic_fetch_add(&g_log.dropped, 1, __ATOMIC_RELAXED);
+		}
+	}
+ 	
+ 	// stream passed ? write also to it
+ 	if ( to_stream ) 
+ 		fputs(tmpbuff, stream);
+}
+
+/* ======================================================================
+Function: log_msg
+Purpose : write event of a level to syslog
+Input 	: syslog level (LOG_xxx)
+					stream to write if needed
+					string to write in printf format
+					printf other arguments
+Output	: -
+Comments: see log_vmsg()
+====================================================================== */
+void log_msg( int level, FILE * stream, const char *format, ...)
+{
+	va_list args;
+
+	va_start (args, format);
+	log_vmsg(level, stream, format, args);
+	va_end (args);
+}
 
 /* ======================================================================
 Function: log_syslog
@@ -117,32 +693,194 @@ Input 	: stream to write if needed
 					string to write in printf format
 					printf other arguments
 Output	: -
-Comments: 
+Comments: information level, see log_vmsg()
 ====================================================================== */
 void log_syslog( FILE * stream, const char *format, ...)
 {
-	static char tmpbuff[512]="";
 	va_list args;
 
-	// do a style printf style in ou buffer
 	va_start (args, format);
-	vsnprintf (tmpbuff, sizeof(tmpbuff), format, args);
-	tmpbuff[sizeof(tmpbuff) - 1] = '\0';
+	log_vmsg(LOG_INFO, stream, format, args);
 	va_end (args);
+}
 
-	// Write to logfile
-	openlog( PRG_NAME, LOG_PID|LOG_CONS, LOG_USER);
- 	syslog(LOG_INFO, tmpbuff);
- 	closelog();
- 	
- 	// stream passed ? write also to it
- 	if ((stream && opts.verbose) || stream == stdout ) 
- 	{
- 		fprintf(stream, tmpbuff);
- 		fflush(stream);
- 	}
+
+/* ======================================================================
+Function: time_now
+Purpose : get monotonic time
+Input 	: -
+Output	: time in seconds
+Comments: -
+====================================================================== */
+double time_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ======================================================================
+Function: stats_add
+Purpose : account one operation in statistics
+Input 	: operation (STAT_xxx)
+					time operation started (time_now())
+					operation result, <0 if error (errno set)
+Output	: -
+Comments: -
+====================================================================== */
+void stats_add(int op, double start, int r)
+{
+	struct stat_op * st = &g_stats.op[op];
+	int err = errno;
+	double t = time_now() - start;
+	unsigned long us = t * 1e6;
+	int b = 0;
+
+	// first bucket above, last one has all longer times
+	while ( b < STATS_BUCKETS - 1 && us >= (1UL << b) )
+		b++;
+
+	st->count++;
+	st->sum += t;
+	st->bucket[b]++;
+
+	if ( t > st->max )
+		st->max = t;
+
+	if ( r < 0 )
+	{
+		st->errors++;
+		g_stats.err[err < STATS_ERRNO_MAX ? err : 0]++;
+	}
+
+	errno = err;
+}
+
+/* ======================================================================
+Function: stats_merge
+Purpose : add statistics of another thread to ours
+Input 	: statistics to add
+Output	: -
+Comments: -
+====================================================================== */
+void stats_merge(struct stats * src)
+{
+	struct stat_op * st, * from;
+	int op, b, e;
+
+	for (op = 0; op < STAT_OPS; op++)
+	{
+		st = &g_stats.op[op];
+		from = &src->op[op];
+
+		st->count += from->count;
+		st->errors += from->errors;
+		st->retries += from->retries;
+		st->sum += from->sum;
+
+		if ( from->max > st->max )
+			st->max = from->max;
+
+		for (b = 0; b < STATS_BUCKETS; b++)
+			st->bucket[b] += from->bucket[b];
+	}
+
+	for (e = 0; e < STATS_ERRNO_MAX; e++)
+		g_stats.err[e] += src->err[e];
+}
+
+/* ======================================================================
+Function: stats_write
+Purpose : write statistics in prometheus text format
+Input 	: stream to write
+Output	: -
+Comments: histogram buckets are cumulative, le is upper bound in us
+====================================================================== */
+void stats_write(FILE * fp)
+{
+	struct stat_op * st;
+	unsigned long n;
+	int op, b, e;
+
+	fprintf(fp, "arduipi_uptime_seconds %.3f\n", time_now() - g_stats.start);
+
+	for (op = 0; op < STAT_OPS; op++)
+	{
+		st = &g_stats.op[op];
+
+		if ( !st->count )
+			continue;
+
+		fprintf(fp, "arduipi_op_count{op=\"%s\"} %lu\n", g_stat_names[op], st->count);
+		fprintf(fp, "arduipi_op_errors{op=\"%s\"} %lu\n", g_stat_names[op], st->errors);
+		fprintf(fp, "arduipi_op_retries{op=\"%s\"} %lu\n", g_stat_names[op], st->retries);
+		fprintf(fp, "arduipi_op_max_us{op=\"%s\"} %.1f\n", g_stat_names[op], st->max * 1e6);
+
+		for (b = 0, n = 0; b < STATS_BUCKETS - 1; b++)
+		{
+			n += st->bucket[b];
+			fprintf(fp, "arduipi_op_latency_us_bucket{op=\"%s\",le=\"%lu\"} %lu\n", g_stat_names[op], 1UL << b, n);
+		}
+
+		fprintf(fp, "arduipi_op_latency_us_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", g_stat_names[op], st->count);
+		fprintf(fp, "arduipi_op_latency_us_sum{op=\"%s\"} %.1f\n", g_stat_names[op], st->sum * 1e6);
+		fprintf(fp, "arduipi_op_latency_us_count{op=\"%s\"} %lu\n", g_stat_names[op], st->count);
+	}
+
+	for (e = 0; e < STATS_ERRNO_MAX; e++)
+	{
+		if ( g_stats.err[e] )
+			fprintf(fp, "arduipi_errno_count{errno=\"%d\",error=\"%s\"} %lu\n", e, e ? strerror(e) : "other", g_stats.err[e]);
+	}
+}
+
+/* ======================================================================
+Function: stats_save
+Purpose : rewrite statistics file
+Input 	: -
+Output	: -
+Comments: written to a temporary file then renamed so a reader never
+					see a partial file
+====================================================================== */
+void stats_save(void)
+{
+	char tmp[sizeof(opts.statsfile) + 8];
+	FILE * fp;
+
+	if ( !*opts.statsfile )
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", opts.statsfile);
+
+	if ( (fp = fopen(tmp, "w")) == NULL )
+	{
+		log_msg(LOG_WARNING, stderr, "stats file %s : %s\n", tmp, strerror(errno));
+		return;
+	}
+
+	stats_write(fp);
+	fclose(fp);
+
+	if ( rename(tmp, opts.statsfile) < 0 )
+		log_msg(LOG_WARNING, stderr, "stats file %s : %s\n", opts.statsfile, strerror(errno));
+
+	g_stats.written = time_now();
 }
 
+/* ======================================================================
+Function: stats_tick
+Purpose : rewrite statistics file if period elapsed
+Input 	: -
+Output	: -
+Comments: called from long running modes loops
+====================================================================== */
+void stats_tick(void)
+{
+	if ( *opts.statsfile && time_now() - g_stats.written >= STATS_PERIOD )
+		stats_save();
+}
 
 /* ======================================================================
 Function: clean_exit
@@ -160,8 +898,24 @@ void clean_exit (int exit_code)
   	close(g_fd_device);
   }
 
+	// daemon mode socket opened ?
+	if (g_fd_listen)
+	{
+		close(g_fd_listen);
+		unlink(opts.socket);
+	}
+
 	if ( exit_code != EXIT_SUCCESS)
-		log_syslog(stdout, "Closing %s due to error\n", PRG_NAME);
+		log_msg(LOG_ERR, stdout, "Closing %s due to error\n", PRG_NAME);
+
+	// final statistics
+	stats_save();
+
+	if ( opts.stats )
+		stats_write(stderr);
+
+	// no message lost
+	log_close();
 	
 	exit(exit_code);
 }
@@ -185,9 +939,7 @@ void fatal (const char *format, ...)
 	va_end(args);
 
 	// Write to logfile
-	openlog( PRG_NAME, LOG_PID | LOG_CONS, LOG_USER);
- 	syslog(LOG_INFO, tmpbuff);
- 	closelog();
+	log_msg(LOG_ERR, NULL, "%s", tmpbuff);
 
 	fprintf(stderr,"\r\nFATAL: %s \r\n", tmpbuff );
 	fflush(stderr);
@@ -195,6 +947,33 @@ void fatal (const char *format, ...)
 	clean_exit(EXIT_FAILURE);
 }
 
+/* ======================================================================
+Function: init_error
+Purpose : fail a transport init
+Input 	: device handle, closed if opened
+					string to write in printf format
+					printf other arguments
+Output	: -1
+Comments: message is kept in g_bus_error and errno is kept, caller 
+					decide if it is fatal, a fan-out worker only stop its bus
+====================================================================== */
+int init_error(int fd, const char *format, ...)
+{
+	int err = errno;
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(g_bus_error, sizeof(g_bus_error), format, args);
+	va_end(args);
+
+	if ( fd >= 0 )
+		close(fd);
+
+	// a value check failed without a system error
+	errno = err ? err : EIO;
+	return -1;
+}
+
 
 /* ======================================================================
 Function: isr_handler
@@ -213,42 +992,59 @@ void isr_handler (int signum)
 		
 		log_syslog(NULL, "Received SIGINT/SIGTERM");
 	}
-	// Our receive buffer is full
-	else if (signum == SIGIO)
+}
+
+/* ======================================================================
+Function: serial_speed
+Purpose : termios speed of a baud rate
+Input 	: baud rate
+Output	: termios speed, 0 if not supported
+Comments: -
+====================================================================== */
+speed_t serial_speed(int baud)
+{
+	static const struct { int baud; speed_t speed; } speeds[] =
 	{
-		log_syslog(NULL, "Received SIGIO");
-	
-	}
-	
+		{ 9600, B9600 }, { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+		{ 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 }, 
+		{ 500000, B500000 }, { 1000000, B1000000 }
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+		if ( speeds[i].baud == baud )
+			return speeds[i].speed;
+
+	return 0;
 }
 
 /* ======================================================================
 Function: i2c_init
 Purpose : initialize i2c port for communication
 Input 	: -
-Output	: i2c Port Handle
+Output	: i2c Port Handle, -1 if error (see init_error())
 Comments: -
 ====================================================================== */
 int i2c_init(void)
 {
 	int fd ;
 
-  // Open i2c bus
-  if ( (fd = open(opts.port, O_RDWR)) < 0 ) 
-  	fatal( "i2c_init device %s: %s", opts.port, strerror(errno));
+	// Open i2c bus
+	if ( (fd = open(opts.port, O_RDWR)) < 0 )
+		return init_error(fd, "i2c_init device %s: %s", opts.port, strerror(errno));
 
 	// set slave address
 	if ( ioctl(fd, I2C_SLAVE, opts.address) < 0)
-		fatal( "i2c_init error setting slave address 0x%02X : %s", opts.address, strerror(errno));
+		return init_error(fd, "i2c_init error setting slave address 0x%02X : %s", opts.address, strerror(errno));
 
- 	return fd ;
+	return fd ;
 }
 
 /* ======================================================================
 Function: spi_init
 Purpose : initialize spi port for communication
 Input 	: -
-Output	: spi Port Handle
+Output	: spi Port Handle, -1 if error (see init_error())
 Comments: -
 ====================================================================== */
 int spi_init(void)
@@ -258,268 +1054,1259 @@ int spi_init(void)
 	uint8_t mode;			// spi mode
 	uint8_t bits;			// spi bits per word
 
-  // Open spi bus
-  if ( (fd = open(opts.port, O_RDWR)) < 0 ) 
-  	fatal( "spi_init %s: %s", opts.port, strerror(errno));
+	// Open spi bus
+	if ( (fd = open(opts.port, O_RDWR)) < 0 )
+		return init_error(fd, "spi_init %s: %s", opts.port, strerror(errno));
 
 	// set spi mode
 	ret = ioctl(fd, SPI_IOC_WR_MODE, &opts.spi_mode);
 	if (ret == -1)
-		fatal( "spi_init %s : error writing mode %02X : %s",  opts.port, opts.spi_mode, strerror(errno));
+		return init_error(fd, "spi_init %s : error writing mode %02X : %s",  opts.port, opts.spi_mode, strerror(errno));
 
 	// read the value we set and check it is the same
 	ret = ioctl(fd, SPI_IOC_RD_MODE, &mode);
 	if (ret == -1 || mode !=opts.spi_mode )
-		fatal( "spi_init %s : error checking mode %02X, found %02X : %s",  opts.port, opts.spi_mode, mode, strerror(errno));
+		return init_error(fd, "spi_init %s : error checking mode %02X, found %02X : %s",  opts.port, opts.spi_mode, mode, strerror(errno));
 
 	// set spi bits per word
 	ret = ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &opts.spi_bits);
 	if (ret == -1)
-		fatal( "spi_init %s : error setting write bits per word %d : %s",  opts.port, opts.spi_bits, strerror(errno));
+		return init_error(fd, "spi_init %s : error setting write bits per word %d : %s",  opts.port, opts.spi_bits, strerror(errno));
 
 	// read the value we set and check it is the same
 	ret = ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits);
 	if (ret == -1 || bits != opts.spi_bits )
-		fatal( "spi_init %s : error checking bits per word %d, found %d : %s",  opts.port, opts.spi_bits, bits, strerror(errno));
+		return init_error(fd, "spi_init %s : error checking bits per word %d, found %d : %s",  opts.port, opts.spi_bits, bits, strerror(errno));
 
 	// set spi max speed hz
 	ret = ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &opts.spi_speed);
 	if (ret == -1)
-		fatal( "spi_init %s : error setting write max speed %d Hz: %s",  opts.port, opts.spi_speed, strerror(errno));
+		return init_error(fd, "spi_init %s : error setting write max speed %d Hz: %s",  opts.port, opts.spi_speed, strerror(errno));
 
 	// read the value we set and check it is the same
 	ret = ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &opts.spi_speed);
 	if (ret == -1 )
-		fatal( "spi_init %s : error setting read max speed %d KHz, %s",  opts.port, opts.spi_speed, strerror(errno));
+		return init_error(fd, "spi_init %s : error setting read max speed %d KHz, %s",  opts.port, opts.spi_speed, strerror(errno));
 
- 	return fd ;
+	return fd ;
 }
 
 /* ======================================================================
-Function: charToHexDigit
-Purpose : convert char to hex value
-Input 	: char
-Output	: byte value
-Comments: 
+Function: serial_init
+Purpose : initialize serial port for communication
+Input 	: -
+Output	: serial Port Handle, -1 if error (see init_error())
+Comments: raw mode 8N1, no flow control, reads never block, then an 
+					end of frame so firmware drop what it received before us
 ====================================================================== */
-unsigned char charToHexDigit(char c) 
+int serial_init(void)
 {
-	unsigned char ret ;
-	
-	// parse to lower case
-	if (c >= 'A' && c <= 'F')
-		c= c - 'A' + 'a';
- 
-  if (c >= 'a') 
-    ret = c - 'a' + 10; 
-  else 
-    ret = c - '0'; 
+	struct termios tio;
+	unsigned char eof = 0x00;
+	int fd;
 
-	return (ret);
-} 
+	// Open serial port
+	if ( (fd = open(opts.port, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0 )
+		return init_error(fd, "serial_init %s: %s", opts.port, strerror(errno));
+
+	if ( tcgetattr(fd, &tio) < 0 )
+		return init_error(fd, "serial_init %s : error getting attributes : %s", opts.port, strerror(errno));
+
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+
+	if ( cfsetspeed(&tio, serial_speed(opts.baud)) < 0 || tcsetattr(fd, TCSANOW, &tio) < 0 )
+		return init_error(fd, "serial_init %s : error setting %d baud : %s", opts.port, opts.baud, strerror(errno));
+
+	tcflush(fd, TCIOFLUSH);
+
+	if ( write(fd, &eof, 1) != 1 )
+		return init_error(fd, "serial_init %s : %s", opts.port, strerror(errno));
+
+	g_ser_rx_len = 0;
+
+	return fd ;
+}
 
 /* ======================================================================
-Function: get_pi_version
-Purpose : Get Raspberry Pi Revision Board Version
+Function: i2c_speed_get
+Purpose : get i2c bus speed
 Input 	: -
-Output	: Raspberry Pi revision (1 or 2)
-Comments: 
+Output	: speed in KHz, 0 if unknown
+Comments: i2c_bcm2708 driver parameter, or device tree bus clock
 ====================================================================== */
-// Get raspberry PI model version
-int get_pi_version( void ) 
-{ 
-	int rev = 0;
-	char buff[512];
-	char * p;
-	char * pend;
-	
-	FILE * fd ;
+int i2c_speed_get(void)
+{
+	char path[128];
+	unsigned char be[4];
+	unsigned int hz = 0;
+	char * bus = strrchr(opts.port, '/');
+	FILE * fp;
 
-	// do some clean up
-	memset(buff,0,sizeof(buff));
+	if ( (fp = fopen(I2C_BAUDRATE_PARAM, "r")) != NULL )
+	{
+		if ( fscanf(fp, "%u", &hz) != 1 )
+			hz = 0;
 
-	fd = fopen("/proc/cpuinfo","r");
+		fclose(fp);
+	}
 
-	// Opened successfully
-	if( fd )
+	if ( !hz && bus )
 	{
-		//printf("File opened successfully through fopen()\n");
-		
-		// parse each line until we the end or we find the good one
-		while( fgets(buff, sizeof(buff), fd) != NULL && rev ==0 ) 
-		{
-			// search 
-			if( (strstr(buff, "Revision" )) != NULL )  
-			{
-				// point to the separator ":" format is has follow
-				// Revision        : 000f
-				if ( (p = strtok( buff, ":")) != NULL )
-				{
-					// Ok get value
-					if ( (p = strtok( NULL, ":")) != NULL )
-					{
-						// Revision Version is in hex format so put 0x before the number
-						*p   = 'x';
-						*--p = '0';
-						
-						// convert to number
-						rev = strtol(p, &pend, 16);
-						
-						//printf("rev=%d 0x%04x\n", rev, rev);
-						
-						// not Okay ?
-						if ( !*pend )
-						{
-							rev= 0;
-						}
-						else
-						{
-							// Revision 1 or 2 ?
-							rev = (rev < 4 ) ? 1 : 2 ;
-						}
-					}
-				}
-			}
-		}
+		snprintf(path, sizeof(path), I2C_DT_CLOCK, bus + 1);
 
-		// Close the file.
-		if(fd) 
+		if ( (fp = fopen(path, "rb")) != NULL )
 		{
-			fclose(fd);
+			if ( fread(be, 1, sizeof(be), fp) == sizeof(be) )
+				hz = (be[0] << 24) | (be[1] << 16) | (be[2] << 8) | be[3];
+
+			fclose(fp);
 		}
 	}
 
-	return rev;
-} 
+	return hz / 1000;
+}
+
+/* ======================================================================
+Function: i2c_speed_set
+Purpose : set i2c bus speed
+Input 	: speed in KHz
+Output	: -1 if error
+Comments: need a driver taking its baudrate parameter at each transfer,
+					else speed is set at boot (dtparam=i2c_arm_baudrate)
+====================================================================== */
+int i2c_speed_set(int khz)
+{
+	FILE * fp;
+	int r;
+
+	if ( i2c_speed_get() == khz )
+		return 0;
 
+	if ( (fp = fopen(I2C_BAUDRATE_PARAM, "w")) == NULL )
+		return -1;
+
+	r = fprintf(fp, "%d", khz * 1000);
+
+	if ( fclose(fp) < 0 || r < 0 )
+		return -1;
+
+	// parameter only read at boot
+	if ( i2c_speed_get() != khz )
+	{
+		errno = EOPNOTSUPP;
+		return -1;
+	}
 
+	return 0;
+}
 
 /* ======================================================================
-Function: usage
-Purpose : display usage
-Input 	: program name
-Output	: -
-Comments: 
+Function: i2c_probe
+Purpose : check firmware answers correctly at current i2c speed
+Input 	: -
+Output	: number of errors
+Comments: ping must always read the same and speed register must 
+					come with its complement, all are get commands done in one
+					combined transaction each
 ====================================================================== */
-void usage( char * name)
+int i2c_probe(void)
 {
+	unsigned char data[1];
+	int ping, r, i;
+	int errors = 0;
 
-	printf("%s\n", PRG_NAME );
-	printf("Usage is: %s [options] [protocol] [mode] [-d device] [-a address] [-t data]\n", PRG_NAME);
-	printf("  --<D>evice   : device name, i2c or spi\n");
-	printf("  --<a>ddress  : i2c device address (default 0x2A)\n");
-	printf("  --<d>data    : data to send\n");
-	printf("protocol is:\n");
-	printf("  --<I>2c      : set protocol to i2c (default)\n");
-	printf("  --<S>pi      : set protocol to spi\n");
-	printf("mode is:\n");
-	printf("  --<s>et value: set value (byte or word type determined by data size)\n");
-	printf("  --<g>etbyte  : get byte value\n");
-	printf("  --<G>getword : get word value\n");
-	printf("  --<q>uick    : i2c quick check device\n");
-	printf("  --ac<k>      : i2c check if device sent ack\n");
-	printf("Options are:\n");
-	printf("  --ma<x>speed : max spi speed (in KHz)\n");
-	printf("  --dela<y>    : spi delay (usec)\n");
-	printf("  --<b>its     : spi bits per word\n");
-	printf("  --<l>oop     : spi loopback\n");
-	printf("  --cp<H>a     : spi clock phase\n");
-	printf("  --cp<O>l     : spi clock polarity\n");
-	printf("  --<L>sb      : spi least significant bit first\n");
-	printf("  --<C>s-high  : spi chip select active high\n");
-	printf("  --<3>wire    : spi SI/SO signals shared\n");
-	printf("  --<N>o-cs    : spi no chip select\n");
-	printf("  --<R>eady    : spi Ready\n");
-	printf("  --<v>erbose  : speak more to user\n");
-	printf("  --he<X>      : show return values in hexadecimal format\n");
-	printf("  --<V>ersion  : show program version and Raspberry Pi revision\n");
-	printf("  --<h>elp\n");
-	printf("<?> indicates the equivalent short option.\n");
-	printf("    long options always in lowercase\n");
-	printf("Short options are prefixed by \"-\" instead of by \"--\".\n");
-	printf("Example :\n");
-	printf( "%s --i2c --getbyte --hex --data 0xe0\nSend a ping command and return ping value in hex format\n", PRG_NAME);
-//	printf( "%s -m r -v\nstart %s to wait for a value, then display it and exit\n", PRG_NAME, PRG_NAME);
-}
+	data[0] = ARDUIPI_CMD_PING;
+	if ( (ping = g_bus->transaction(MODE_GET, data, 1)) < 0 )
+		return I2C_PROBE_COUNT;
+
+	for (i = 0; i < I2C_PROBE_COUNT; i++)
+	{
+		data[0] = ARDUIPI_CMD_PING;
+		if ( g_bus->transaction(MODE_GET, data, 1) != ping )
+			errors++;
 
+		data[0] = ARDUIPI_CMD_I2C_SPEED;
+		r = g_bus->transaction(MODE_GET_WORD, data, 1);
+
+		if ( r < 0 || (r & 0xFF) != (~r >> 8 & 0xFF) )
+			errors++;
+	}
+
+	return errors;
+}
 
 /* ======================================================================
-Function: parse_args
-Purpose : parse argument passed to the program
+Function: i2c_speed_negotiate
+Purpose : set i2c speed asked, falling back to 100 KHz
 Input 	: -
 Output	: -
-Comments: 
+Comments: 400 KHz is kept only if probe had no error, firmware get
+					the same speed for its own master transactions on this bus
 ====================================================================== */
-void parse_args(int argc, char *argv[])
+void i2c_speed_negotiate(void)
 {
+	unsigned char data[2] = { ARDUIPI_CMD_I2C_SPEED, ARDUIPI_TWBR_400KHZ };
+	int errors;
 
-	static struct option longOptions[] =
+	if ( opts.i2c_speed == 400 )
 	{
-		{"device" 	,required_argument, 0, 'D' },
-		{"data"   	,required_argument, 0, 'd' },
-		{"verbose"	,no_argument			,	0, 'v' },
-		{"version"	,no_argument			,	0, 'V' },
-		{"address"	,required_argument, 0, 'a' },
-		{"i2c"    	,no_argument			,	0, 'I' },
-		{"spi"    	,no_argument			,	0, 'S' },
-		{"set"    	,no_argument			,	0, 's' },
-		{"getbyte"	,no_argument			,	0, 'g' },
-		{"getword"	,no_argument			, 0, 'G' },
-		{"quick"  	,no_argument			,	0, 'q' },
-		{"ack"    	,no_argument			, 0, 'k' },
-		{"help"			,no_argument			,	0, 'h' },
-		{"maxspeed"	,required_argument, 0, 'x' },
-		{"delay"  	,required_argument, 0, 'y' },
-		{"bits"   	,required_argument, 0, 'b' },
-		{"loop"		  ,no_argument			, 0, 'l' },
-		{"cpha"		  ,no_argument			, 0, 'H' },
-		{"cpol"		  ,no_argument			, 0, 'O' },
-		{"lsb"			,no_argument			, 0, 'L' },
-		{"cs-high"	,no_argument			, 0, 'C' },
-		{"3wire"		,no_argument			, 0, '3' },
-		{"no-cs"		,no_argument			, 0, 'N' },
-		{"ready"		,no_argument			, 0, 'R' },
-		{"hex"			,no_argument			, 0, 'X' },
-		
-		{0, 0, 0, 0}
-	};
+		if ( i2c_speed_set(400) < 0 )
+		{
+			log_msg(LOG_WARNING, stderr, "i2c can't set bus to 400 KHz : %s\n", strerror(errno));
+		}
+		else if ( (errors = i2c_probe()) )
+		{
+			log_msg(LOG_WARNING, stderr, "i2c 400 KHz %d/%d errors, back to 100 KHz\n", errors, 2 * I2C_PROBE_COUNT);
+		}
+		else if ( g_bus->transaction(MODE_SET, data, 2) >= 0 )
+		{
+			return;
+		}
+	}
 
-	int optionIndex = 0;
-	int c;
-	char * pEnd;
-	
-	// By default set the correct I2C device function of Pi version
+	data[1] = ARDUIPI_TWBR_100KHZ;
 
-	while (1) 
-	{
-		/* no default error messages printed. */
-		opterr = 0;
+	if ( i2c_speed_set(100) < 0 )
+		log_msg(LOG_WARNING, stderr, "i2c can't set bus to 100 KHz : %s\n", strerror(errno));
 
-		c = getopt_long(argc, argv, "D:d:vVa:x:y:b:ISsgGqkhlHOLC3NRX", longOptions, &optionIndex);
+	g_bus->transaction(MODE_SET, data, 2);
+}
 
-		if (c < 0)
-			break;
+/* ======================================================================
+Function: bus_init
+Purpose : open the device of the selected protocol
+Input 	: -
+Output	: -
+Comments: -
+====================================================================== */
+void bus_init(void)
+{
+	double start = time_now();
 
-		switch (c) 
-		{
-			case 'v':	opts.verbose = true;	break;
+	if ( !g_bus->init )
+		fatal( "protocol %s not supported", opts.proto_str);
 
-			
-			case 's': opts.mode = MODE_SET				; 	opts.mode_str = "set"				; break;
-			case 'k': opts.mode = MODE_READ_ACK	; 	opts.mode_str = "read ack"	; break;
-			case 'q': opts.mode = MODE_QUICK_ACK	; 	opts.mode_str = "quick ack"	; break;
-			case 'g': opts.mode = MODE_GET				; 	opts.mode_str = "get byte"	; break;
-			case 'G': opts.mode = MODE_GET_WORD	; 	opts.mode_str = "get word"	; break;
-			case 'I': opts.proto= PROTO_I2C    	; 	opts.proto_str= "i2c"     	; break;
-			case 'l': opts.spi_mode |= SPI_LOOP			; break;
-			case 'H': opts.spi_mode |= SPI_CPHA			; break;
-			case 'O': opts.spi_mode |= SPI_CPOL			; break;
-			case 'L': opts.spi_mode |= SPI_LSB_FIRST	;	break;
-			case 'C': opts.spi_mode |= SPI_CS_HIGH		;	break;
-			case '3': opts.spi_mode |= SPI_3WIRE			;	break;
-			case 'N': opts.spi_mode |= SPI_NO_CS			;	break;
-			case 'R': opts.spi_mode |= SPI_READY			;	break;
+	if ( (g_fd_device = g_bus->init()) < 0 )
+		fatal( "%s", g_bus_error);
+
+	if ( opts.proto == PROTO_I2C && opts.i2c_speed )
+		i2c_speed_negotiate();
+
+	stats_add(STAT_INIT, start, 0);
+
+	if (opts.verbose)
+	{
+		 	log_syslog(stdout, "%s Init succeded\n", opts.proto_str);
+
+		if ( opts.proto == PROTO_I2C )
+			log_syslog(stdout, "i2c speed     : %d KHz\n", i2c_speed_get());
+	}
+}
+
+/* ======================================================================
+Function: crc8
+Purpose : CRC-8 of a buffer
+Input 	: CRC of previous bytes (0 to start)
+					buffer
+					size of buffer
+Output	: CRC-8 (SMBus PEC, x^8+x^2+x+1), same as firmware
+Comments: -
+====================================================================== */
+uint8_t crc8(uint8_t crc, const unsigned char * p, int len)
+{
+	int i;
+
+	while (len--)
+	{
+		crc ^= *p++;
+
+		for (i = 0; i < 8; i++)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+
+	return crc;
+}
+
+/* ======================================================================
+Function: crc_wrap
+Purpose : build a CRC protected command frame
+Input 	: frame buffer to fill (size + 2)
+					command (command byte and parameters)
+					size of command
+Output	: size of frame
+Comments: CMD_CRC, command, parameters, CRC-8 of all previous bytes
+====================================================================== */
+int crc_wrap(unsigned char * frame, const unsigned char * cmd, int len)
+{
+	frame[0] = ARDUIPI_CMD_CRC;
+	memcpy(frame + 1, cmd, len);
+	frame[len + 1] = crc8(0, frame, len + 1);
+
+	return len + 2;
+}
+
+/* ======================================================================
+Function: crc_check
+Purpose : check CRC of a protected get response
+Input 	: command byte
+					response, followed by its CRC
+					size of response without CRC
+Output	: -1 if bad CRC (errno set)
+Comments: firmware CRC start with the command byte so a response to
+					another command is also seen
+====================================================================== */
+int crc_check(unsigned char cmd, const unsigned char * rsp, int len)
+{
+	if ( crc8(crc8(0, &cmd, 1), rsp, len) != rsp[len] )
+	{
+		errno = EBADMSG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* ======================================================================
+Function: bus_crc_gets
+Purpose : do a list of CRC protected get commands
+Input 	: list of get commands
+					number of commands
+Output	: -1 if error
+Comments: responses are only copied back when their CRC is good
+====================================================================== */
+int bus_crc_gets(struct bus_get * gets, int n)
+{
+	unsigned char cmd[BUS_CRC_CHUNK][ARDUIPI_CMD_MAX_SIZE];
+	unsigned char rsp[BUS_CRC_CHUNK][ARDUIPI_RSP_MAX_SIZE];
+	struct bus_get wrapped[BUS_CRC_CHUNK];
+	struct bus_get * get;
+	int i, j, m;
+
+	for (i = 0; i < n; i += m)
+	{
+		m = n - i < BUS_CRC_CHUNK ? n - i : BUS_CRC_CHUNK;
+
+		for (j = 0; j < m; j++)
+		{
+			get = &gets[i + j];
+
+			// firmware can't receive or send more
+			if ( get->cmdlen + 2 > ARDUIPI_CMD_MAX_SIZE - 1 || get->len + 1 > ARDUIPI_RSP_MAX_SIZE )
+			{
+				errno = EMSGSIZE;
+				return -1;
+			}
+
+			wrapped[j].cmd = cmd[j];
+			wrapped[j].cmdlen = crc_wrap(cmd[j], get->cmd, get->cmdlen);
+			wrapped[j].rsp = rsp[j];
+			wrapped[j].len = get->len + 1;
+		}
+
+		if ( g_bus->gets(wrapped, m) < 0 )
+			return -1;
+
+		for (j = 0; j < m; j++)
+		{
+			get = &gets[i + j];
+
+			if ( crc_check(get->cmd[0], rsp[j], get->len) < 0 )
+				return -1;
+
+			memcpy(get->rsp, rsp[j], get->len);
+		}
+	}
+
+	return 0;
+}
+
+/* ======================================================================
+Function: bus_crc_transaction
+Purpose : do one CRC protected get or set transaction
+Input 	: program mode (MODE_GET, MODE_GET_WORD or MODE_SET)
+					data buffer (command + data)
+					size of data
+Output	: value read from device (or 0 for write) or -1 if error
+Comments: a set is read back its acknowledge, a NAK (firmware got a bad
+					CRC) or a bad acknowledge CRC fail with EBADMSG so the set
+					is retried, serial frames already carry their own status
+====================================================================== */
+int bus_crc_transaction(int mode, unsigned char * data, int datasize)
+{
+	unsigned char frame[ARDUIPI_CMD_MAX_SIZE];
+	unsigned char rsp[2];
+	struct bus_get get = { data, 1, rsp, mode == MODE_GET ? 1 : 2 };
+
+	if ( mode == MODE_GET || mode == MODE_GET_WORD )
+	{
+		if ( bus_crc_gets(&get, 1) < 0 )
+			return -1;
+
+		return mode == MODE_GET ? rsp[0] : rsp[0] | (rsp[1] << 8 );
+	}
+
+	// a lone command byte is a get for firmware, it can't be acknowledged
+	if ( datasize < 2 || datasize + 2 > ARDUIPI_CMD_MAX_SIZE - 1 )
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if ( !strcmp(g_bus->name, "serial") )
+		return g_bus->transaction(mode, frame, crc_wrap(frame, data, datasize));
+
+	get.cmd = frame;
+	get.cmdlen = crc_wrap(frame, data, datasize);
+	get.len = 2;
+
+	if ( g_bus->gets(&get, 1) < 0 )
+		return -1;
+
+	if ( crc_check(ARDUIPI_CMD_CRC, rsp, 1) < 0 )
+		return -1;
+
+	if ( rsp[0] != ARDUIPI_CRC_ACK )
+	{
+		errno = EBADMSG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* ======================================================================
+Function: bus_retry
+Purpose : wait before retrying a failed operation
+Input 	: operation (STAT_xxx)
+					retries already done
+Output	: false if no more retry
+Comments: delay double at each retry, plus up to the same random delay
+					so retries of several clients don't collide again
+====================================================================== */
+int bus_retry(int op, int attempt)
+{
+	int err = errno;
+	long us;
+
+	// a too big command will never pass
+	if ( attempt >= opts.retries || g_exit_pgm || err == EMSGSIZE )
+		return false;
+
+	us = (long) BUS_RETRY_US << attempt;
+	if ( us > BUS_RETRY_MAX_US )
+		us = BUS_RETRY_MAX_US;
+
+	us += random() % us;
+
+	g_stats.op[op].retries++;
+	log_msg(LOG_DEBUG, NULL, "%s retry %d in %ld us : %s", g_stat_names[op], attempt + 1, us, strerror(err));
+
+	usleep(us);
+	errno = err;
+
+	return true;
+}
+
+/* ======================================================================
+Function: bus_transaction
+Purpose : do one transaction on the opened device whatever protocol is
+Input 	: program mode (MODE_xxx)
+					data buffer (command + data)
+					size of data
+Output	: value read from device (or 0 for write) or -1 if error
+Comments: timed in statistics by mode, CRC protected with --crc, 
+					retried on error except device checks (ack modes)
+====================================================================== */
+int bus_transaction(int mode, unsigned char * data, int datasize)
+{
+	unsigned char buf[BUFFER_SIZE];
+	double start = time_now();
+	int r, op, attempt = 0;
+
+	if ( mode == MODE_GET )
+		op = STAT_GET;
+	else if ( mode == MODE_GET_WORD )
+		op = STAT_GET_WORD;
+	else if ( mode == MODE_SET )
+		op = STAT_SET;
+	else
+		op = STAT_ACK;
+
+	if ( datasize > BUFFER_SIZE )
+	{
+		errno = EMSGSIZE;
+		r = -1;
+	}
+	else
+	{
+		do
+		{
+			// transaction may overwrite data
+			memcpy(buf, data, datasize);
+
+			if ( opts.crc && op != STAT_ACK )
+				r = bus_crc_transaction(mode, buf, datasize);
+			else
+				r = g_bus->transaction(mode, buf, datasize);
+		}
+		while ( r < 0 && op != STAT_ACK && bus_retry(op, attempt++) );
+	}
+
+	stats_add(op, start, r);
+
+	return r;
+}
+
+/* ======================================================================
+Function: bus_bulk
+Purpose : do a list of get byte commands whatever protocol is
+Input 	: list of commands
+					buffer for values read
+					number of commands
+Output	: -1 if error
+Comments: CRC protected with --crc, whole list retried on error
+====================================================================== */
+int bus_bulk(unsigned char * cmds, unsigned char * values, int n)
+{
+	struct bus_get gets[BUS_CRC_CHUNK];
+	double start = time_now();
+	int i, j, m, r, attempt = 0;
+
+	do
+	{
+		if ( !opts.crc )
+		{
+			r = g_bus->bulk(cmds, values, n);
+			continue;
+		}
+
+		// protected gets of one byte
+		for (i = 0, r = 0; i < n && r >= 0; i += m)
+		{
+			m = n - i < BUS_CRC_CHUNK ? n - i : BUS_CRC_CHUNK;
+
+			for (j = 0; j < m; j++)
+			{
+				gets[j].cmd = &cmds[i + j];
+				gets[j].cmdlen = 1;
+				gets[j].rsp = &values[i + j];
+				gets[j].len = 1;
+			}
+
+			r = bus_crc_gets(gets, m);
+		}
+	}
+	while ( r < 0 && bus_retry(STAT_BULK, attempt++) );
+
+	stats_add(STAT_BULK, start, r);
+
+	return r;
+}
+
+/* ======================================================================
+Function: bus_gets
+Purpose : do a list of get commands of any size whatever protocol is
+Input 	: list of get commands
+					number of commands
+Output	: -1 if error
+Comments: CRC protected with --crc, whole list retried on error
+====================================================================== */
+int bus_gets(struct bus_get * gets, int n)
+{
+	double start = time_now();
+	int r, attempt = 0;
+
+	do
+	{
+		r = opts.crc ? bus_crc_gets(gets, n) : g_bus->gets(gets, n);
+	}
+	while ( r < 0 && bus_retry(STAT_GETS, attempt++) );
+
+	stats_add(STAT_GETS, start, r);
+
+	return r;
+}
+
+/* ======================================================================
+Function: pin_port
+Purpose : get AVR port and bit of an arduino pin
+Input 	: arduino pin (0..18)
+					pointer to bit mask to fill
+Output	: port index (0:B 1:C 2:D)
+Comments: D0..D7 are PORTD, D8..D13 PORTB, A0..A5 (14..18) PORTC
+====================================================================== */
+int pin_port(int pin, uint8_t * mask)
+{
+	if ( pin < 8 )
+	{
+		*mask = 1 << pin;
+		return 2;
+	}
+	else if ( pin < 14 )
+	{
+		*mask = 1 << (pin - 8);
+		return 0;
+	}
+
+	*mask = 1 << (pin - 14);
+	return 1;
+}
+
+/* ======================================================================
+Function: cache_valid
+Purpose : check port cache register can be used
+Input 	: register (0:PORT 1:DDR)
+					port (0:B 1:C 2:D)
+Output	: true if read from bus not too long ago
+Comments: bits changed by us are always valid
+====================================================================== */
+int cache_valid(int r, int p)
+{
+	return g_cache.loaded[r][p] && time_now() - g_cache.loaded[r][p] < opts.cache_age / 1000.0;
+}
+
+/* ======================================================================
+Function: cache_load
+Purpose : read PORT and DDR of a port in port cache
+Input 	: port (0:B 1:C 2:D)
+Output	: -1 if error
+Comments: bits changed and not yet written are kept
+====================================================================== */
+int cache_load(int p)
+{
+	unsigned char cmd[2] = { ARDUIPI_CMD_PORTB + p, ARDUIPI_CMD_DDRB + p };
+	unsigned char val[2];
+	struct bus_get gets[2] = { { &cmd[0], 1, &val[0], 1 }, { &cmd[1], 1, &val[1], 1 } };
+	int r;
+
+	g_cache.misses++;
+
+	if ( bus_gets(gets, 2) < 0 )
+		return -1;
+
+	for (r = 0; r < 2; r++)
+	{
+		g_cache.reg[r][p] = (val[r] & ~g_cache.dirty[r][p]) | (g_cache.reg[r][p] & g_cache.dirty[r][p]);
+		g_cache.loaded[r][p] = time_now();
+	}
+
+	return 0;
+}
+
+/* ======================================================================
+Function: cache_flush
+Purpose : write registers changed in port cache
+Input 	: -
+Output	: -1 if one write failed
+Comments: PORT before DDR so a pin made output starts at its value,
+					only bits we changed are written, firmware keep the others,
+					a register we failed to write is read again before next use
+====================================================================== */
+int cache_flush(void)
+{
+	unsigned char data[4];
+	int p, r, ret = 0;
+
+	for (p = 0; p < 3; p++)
+	{
+		for (r = 0; r < 2; r++)
+		{
+			if ( !g_cache.dirty[r][p] )
+				continue;
+
+			g_cache.flushed++;
+
+			data[0] = (r ? ARDUIPI_CMD_DDRB : ARDUIPI_CMD_PORTB) + p;
+			data[1] = r ? ARDUIPI_DDR_MASKED : ARDUIPI_PORT_MASKED;
+			data[2] = g_cache.dirty[r][p];
+			data[3] = g_cache.reg[r][p] & g_cache.dirty[r][p];
+			g_cache.dirty[r][p] = 0;
+
+			if ( bus_transaction(MODE_SET, data, 4) < 0 )
+			{
+				log_msg(LOG_ERR, stderr, "Error writing %s%c : %s\n", r ? "DDR" : "PORT", 'B' + p, strerror(errno));
+				g_cache.loaded[r][p] = 0;
+				ret = -1;
+			}
+		}
+	}
+
+	g_cache.pending = 0;
+
+	return ret;
+}
+
+/* ======================================================================
+Function: cache_timeout
+Purpose : time we can wait before pending writes must go on bus
+Input 	: max time to wait (ms)
+Output	: time to wait (ms)
+Comments: -
+====================================================================== */
+int cache_timeout(int timeout)
+{
+	int left;
+
+	if ( !g_cache.pending )
+		return timeout;
+
+	left = opts.coalesce - (int) ((time_now() - g_cache.pending) * 1000);
+
+	return left < 0 ? 0 : left < timeout ? left : timeout;
+}
+
+/* ======================================================================
+Function: cache_tick
+Purpose : write pending changes once coalesce window is over
+Input 	: -
+Output	: -
+Comments: -
+====================================================================== */
+void cache_tick(void)
+{
+	if ( g_cache.pending && !cache_timeout(opts.coalesce) )
+		cache_flush();
+}
+
+/* ======================================================================
+Function: cache_set
+Purpose : change bits of a port cache register
+Input 	: register (0:PORT 1:DDR)
+					port (0:B 1:C 2:D)
+					mask of bits to change
+					new value of these bits
+Output	: 0
+Comments: write is delayed to coalesce window end, a write that does
+					not change a known register costs nothing, firmware IRQ line
+					(PB1) is never written by cache
+====================================================================== */
+int cache_set(int r, int p, uint8_t mask, uint8_t value)
+{
+	if ( p == 0 )
+		mask &= ~ARDUIPI_FIRMWARE_PORTB;
+
+	g_cache.writes++;
+
+	// bits already at this value, pending or known on bus
+	if ( !((g_cache.reg[r][p] ^ value) & mask) && (cache_valid(r, p) || !(mask & ~g_cache.dirty[r][p])) )
+		return 0;
+
+	g_cache.reg[r][p] = (g_cache.reg[r][p] & ~mask) | (value & mask);
+	g_cache.dirty[r][p] |= mask;
+
+	if ( !g_cache.pending )
+		g_cache.pending = time_now();
+
+	return 0;
+}
+
+/* ======================================================================
+Function: cache_transaction
+Purpose : do a transaction through the port cache
+Input 	: program mode (MODE_xxx)
+					command + data
+					size of data
+Output	: value read or -1 if error
+Comments: pin, PORT and DDR sets are merged, their gets answered from
+					cache, pin of an input still read on bus. Any other command
+					write pending changes before so order is kept.
+====================================================================== */
+int cache_transaction(int mode, unsigned char * data, int datasize)
+{
+	unsigned char c = data[0];
+	uint8_t mask;
+	int p, r;
+
+	if ( !opts.coalesce )
+		return bus_transaction(mode, data, datasize);
+
+	if ( c <= ARDUIPI_CMD_PIN_MAX )
+	{
+		p = pin_port(c, &mask);
+
+		// firmware IRQ line, never merged
+		if ( p == 0 && (mask & ARDUIPI_FIRMWARE_PORTB) )
+			mask = 0;
+
+		// digitalWrite
+		if ( mask && mode == MODE_SET && datasize == 2 && data[1] <= 1 )
+			return cache_set(0, p, mask, data[1] ? 0xff : 0);
+
+		// pinMode, pull-up is PORT bit of an input
+		if ( mask && mode == MODE_SET && datasize == 3 && data[1] == ARDUIPI_PIN_MODE && data[2] <= 2 )
+		{
+			if ( data[2] != 1 )
+				cache_set(0, p, mask, data[2] == 2 ? 0xff : 0);
+
+			return cache_set(1, p, mask, data[2] == 1 ? 0xff : 0);
+		}
+
+		// digitalRead of an output is its PORT bit
+		if ( mask && mode == MODE_GET && cache_valid(0, p) && cache_valid(1, p) && (g_cache.reg[1][p] & mask) )
+		{
+			g_cache.hits++;
+			return g_cache.reg[0][p] & mask ? 1 : 0;
+		}
+	}
+	else if ( (c >= ARDUIPI_CMD_PORTB && c < ARDUIPI_CMD_PORTB + 3) || (c >= ARDUIPI_CMD_DDRB && c < ARDUIPI_CMD_DDRB + 3) )
+	{
+		r = c >= ARDUIPI_CMD_DDRB;
+		p = c - (r ? ARDUIPI_CMD_DDRB : ARDUIPI_CMD_PORTB);
+
+		if ( mode == MODE_SET && datasize == 2 )
+			return cache_set(r, p, 0xff, data[1]);
+
+		// one DDR bit
+		if ( mode == MODE_SET && r && datasize == 3 && data[1] <= 7 && data[2] <= 1 )
+			return cache_set(r, p, 1 << data[1], data[2] ? 0xff : 0);
+
+		if ( mode == MODE_GET )
+		{
+			if ( cache_valid(r, p) )
+				g_cache.hits++;
+			else if ( cache_load(p) < 0 )
+				return -1;
+
+			return g_cache.reg[r][p];
+		}
+	}
+
+	if ( g_cache.pending && cache_flush() < 0 )
+		return -1;
+
+	return bus_transaction(mode, data, datasize);
+}
+
+/* ======================================================================
+Function: cache_close
+Purpose : write pending changes and show port cache efficiency
+Input 	: -
+Output	: -
+Comments: -
+====================================================================== */
+void cache_close(void)
+{
+	if ( !opts.coalesce )
+		return;
+
+	if ( g_cache.pending )
+		cache_flush();
+
+	if (opts.verbose)
+		fprintf(stderr, "port cache : %ld sets in %ld bus writes, %ld gets from cache, %ld register reads\n",
+							g_cache.writes, g_cache.flushed, g_cache.hits, g_cache.misses);
+}
+
+/* ======================================================================
+Function: charToHexDigit
+Purpose : convert char to hex value
+Input 	: char
+Output	: byte value
+Comments: 
+====================================================================== */
+unsigned char charToHexDigit(char c) 
+{
+	unsigned char ret ;
+	
+	// parse to lower case
+	if (c >= 'A' && c <= 'F')
+		c= c - 'A' + 'a';
+ 
+  if (c >= 'a') 
+    ret = c - 'a' + 10; 
+  else 
+    ret = c - '0'; 
+
+	return (ret);
+} 
+
+/* ======================================================================
+Function: get_pi_version
+Purpose : Get Raspberry Pi Revision Board Version
+Input 	: -
+Output	: Raspberry Pi revision (1 or 2)
+Comments: 
+====================================================================== */
+// Get raspberry PI model version
+int get_pi_version( void ) 
+{ 
+	int rev = 0;
+	char buff[512];
+	char * p;
+	char * pend;
+	
+	FILE * fd ;
+
+	// do some clean up
+	memset(buff,0,sizeof(buff));
+
+	fd = fopen("/proc/cpuinfo","r");
+
+	// Opened successfully
+	if( fd )
+	{
+		//printf("File opened successfully through fopen()\n");
+		
+		// parse each line until we the end or we find the good one
+		while( fgets(buff, sizeof(buff), fd) != NULL && rev ==0 ) 
+		{
+			// search 
+			if( (strstr(buff, "Revision" )) != NULL )  
+			{
+				// point to the separator ":" format is has follow
+				// Revision        : 000f
+				if ( (p = strtok( buff, ":")) != NULL )
+				{
+					// Ok get value
+					if ( (p = strtok( NULL, ":")) != NULL )
+					{
+						// Revision Version is in hex format so put 0x before the number
+						*p   = 'x';
+						*--p = '0';
+						
+						// convert to number
+						rev = strtol(p, &pend, 16);
+						
+						//printf("rev=%d 0x%04x\n", rev, rev);
+						
+						// not Okay ?
+						if ( !*pend )
+						{
+							rev= 0;
+						}
+						else
+						{
+							// Revision 1 or 2 ?
+							rev = (rev < 4 ) ? 1 : 2 ;
+						}
+					}
+				}
+			}
+		}
+
+		// Close the file.
+		if(fd) 
+		{
+			fclose(fd);
+		}
+	}
+
+	return rev;
+} 
+
+
+
+/* ======================================================================
+Function: usage
+Purpose : display usage
+Input 	: program name
+Output	: -
+Comments: 
+====================================================================== */
+void usage( char * name)
+{
+
+	printf("%s\n", PRG_NAME );
+	printf("Usage is: %s [options] [protocol] [mode] [-d device] [-a address] [-t data]\n", PRG_NAME);
+	printf("  --<D>evice   : device name, i2c or spi\n");
+	printf("  --<a>ddress  : i2c device address (default 0x2A)\n");
+	printf("  --<i>2cspeed : i2c speed 100 or 400 KHz (auto), 400 fall back to 100 on errors\n");
+	printf("  --<d>data    : data to send\n");
+	printf("protocol is:\n");
+	printf("  --<I>2c      : set protocol to i2c (default)\n");
+	printf("  --<S>pi      : set protocol to spi\n");
+	printf("  --serial <A> : set protocol to serial (COBS frames, default %s)\n", SERIAL_DEVICE);
+	printf("  --si<M>      : set protocol to in process board simulator\n");
+	printf("mode is:\n");
+	printf("  --<s>et value: set value (byte or word type determined by data size)\n");
+	printf("  --<g>etbyte  : get byte value\n");
+	printf("  --<G>getword : get word value\n");
+	printf("  --<q>uick    : i2c quick check device\n");
+	printf("  --ac<k>      : i2c check if device sent ack\n");
+	printf("  --dae<Z>on   : keep device opened and serve requests on local socket\n");
+	printf("  --<B>atch f  : execute commands from file f (- for stdin)\n");
+	printf("  --bul<K>     : get byte value of each command of data in one shot\n");
+	printf("  --s<n>apshot : get all pins, DDR, vcc and analog values in one shot\n");
+	printf("  --strea<m>   : stream ADC samples until CTRL-C or count reached\n");
+	printf("  --b<e>nch    : measure latency and throughput of each transaction type\n");
+	printf("  --<p>erf     : get firmware performance counters\n");
+	printf("  --<W>atch    : wait firmware IRQ line and show changed inputs\n");
+	printf("  --rese<T>    : reset Arduino then wait firmware answer ping\n");
+	printf("  --slaves <z> l : poll slaves of list l concurrently, one thread per bus\n");
+	printf("  --temps      : get 1-Wire sensors ROM code and temperature, --data 0xff search them\n");
+	printf("  --shm <t> n  : publish board state in shared memory n (%s), see arduipi_shm.h\n", ARDUIPI_SHM_NAME);
+	printf("Options are:\n");
+	printf("  --ma<x>speed : max spi speed (in KHz)\n");
+	printf("  --dela<y>    : spi delay (usec)\n");
+	printf("  --bytedelay<w> : spi delay between bytes (usec), for high speed\n");
+	printf("  --<b>its     : spi bits per word\n");
+	printf("  --baud <Y> n : serial speed (default %d)\n", SERIAL_BAUD);
+	printf("  --<l>oop     : spi loopback\n");
+	printf("  --cp<H>a     : spi clock phase\n");
+	printf("  --cp<O>l     : spi clock polarity\n");
+	printf("  --<L>sb      : spi least significant bit first\n");
+	printf("  --<C>s-high  : spi chip select active high\n");
+	printf("  --<3>wire    : spi SI/SO signals shared\n");
+	printf("  --<N>o-cs    : spi no chip select\n");
+	printf("  --<R>eady    : spi Ready\n");
+	printf("  --<v>erbose  : speak more to user\n");
+	printf("  --he<X>      : show return values in hexadecimal format\n");
+	printf("  --crc <Q>    : CRC-8 protect commands and responses\n");
+	printf("  --<r>etries n: retries of a failed transaction (default %d)\n", BUS_RETRIES);
+	printf("  --socket <U> : daemon mode socket path (default %s)\n", DAEMON_SOCKET);
+	printf("  --<o>utput f : stream mode output file (default - for stdout)\n");
+	printf("  --log<E>vel n: syslog level, 3:error 4:warning 6:info (default) 7:debug\n");
+	printf("  --stats<P>   : dump operations latency and errors at exit\n");
+	printf("  --stats<F>ile f : rewrite statistics in file f every %d s\n", STATS_PERIOD);
+	printf("  --<c>ount n  : stream mode stop after n samples, bench mode transactions per test\n");
+	printf("  --csv <f>    : stream mode csv output (default binary records)\n");
+	printf("  --gpio <J> n : GPIO of firmware IRQ line (default %d) or reset line (default %d)\n", GPIO_IRQ, GPIO_RESET);
+	printf("  --period <j> n : fan-out and shm modes poll period (default %d ms)\n", FANOUT_PERIOD_MS);
+	printf("  --dtr <u>    : reset mode, reset when avrdude set DTR, traced on stdin\n");
+	printf("  --coalesce n : daemon and batch modes, merge pin, PORT and DDR sets of n ms in\n");
+	printf("                 one register write, answer their gets from cache (default 0, off)\n");
+	printf("  --cache-age n: registers read on bus answered from cache n ms (default %d)\n", CACHE_AGE_MS);
+	printf("  --<V>ersion  : show program version and Raspberry Pi revision\n");
+	printf("  --<h>elp\n");
+	printf("<?> indicates the equivalent short option.\n");
+	printf("    long options always in lowercase\n");
+	printf("Short options are prefixed by \"-\" instead of by \"--\".\n");
+	printf("Example :\n");
+	printf( "%s --i2c --getbyte --hex --data 0xe0\nSend a ping command and return ping value in hex format\n", PRG_NAME);
+	printf( "%s --i2c --daemon --socket /tmp/arduipi.sock\nKeep i2c device opened and serve binary requests\n", PRG_NAME);
+	printf( "  request  : <len> <op> <payload>  op 1:ping 2:get 3:getword 4:set 5:snapshot\n");
+	printf( "  response : <len> <status> <value LSB first>\n");
+	printf( "echo \"getword 0xa0\" | %s --batch -\nExecute commands (ping, snapshot, get, getword, set) one per line, results in order\n", PRG_NAME);
+	printf( "%s --spi --stream --csv --count 14000 --output adc.csv\nGet 10 seconds of A0..A5 and 1.1V samples timestamped by host\n", PRG_NAME);
+	printf( "  record   : <time_ns u64> <sweep u32> <channel u8> <0 u8> <value u16> little endian\n");
+	printf( "%s --i2c --daemon --coalesce 5\nServe requests, pin and port sets of 5 ms go on bus in one write per register\n", PRG_NAME);
+	printf( "%s --i2c --daemon --statsfile /var/lib/node_exporter/arduipi.prom\nServe requests and export latency histograms and errno counters\n", PRG_NAME);
+	printf( "%s --serial --baud 1000000 --bench\nBenchmark serial frames, 4 requests outstanding\n", PRG_NAME);
+	printf( "  frame    : COBS(<seq> <op 0:set 1:get> <command> <params> <crc8>) 0x00\n");
+	printf( "%s --sim --bench --count 10000\nBenchmark all transaction types, one JSON result line per test\n", PRG_NAME);
+	printf( "%s --i2c --watch --data 0x000f00\nShow each change of A0..A3 inputs (masks of port B, C, D)\n", PRG_NAME);
+	printf( "%s --i2c --reset\nReset Arduino and wait it answers ping, exit code is 0 when ready\n", PRG_NAME);
+	printf( "strace -o \"|%s --reset --dtr\" -eioctl avrdude ...\nReset Arduino when avrdude open serial port (avrdude-autoreset)\n", PRG_NAME);
+	printf( "%s --slaves i2c:/dev/i2c-1:0x2a,i2c:/dev/i2c-1:0x2b,spi:/dev/spidev0.0 --data 0xe0a0\n", PRG_NAME);
+	printf( "  poll ping and A0 of all slaves each 100 ms, i2c and spi in parallel\n");
+	printf( "  line     : <time> <device> <address> <latency> <values or error>\n");
+	printf( "%s --i2c --shm arduipi --period 20\nPublish pins, ports, vcc and ADC in /dev/shm/arduipi each 20 ms\n", PRG_NAME);
+	printf( "  1-Wire temperatures are published too, read each period in one bus call\n");
+	printf( "  readers  : #include <arduipi_shm.h>, arduipi_shm_open() then arduipi_shm_read()\n");
+	printf( "%s --i2c --temps\nGet ROM code and temperature (C) of all 1-Wire sensors, - if not read yet\n", PRG_NAME);
+	printf( "%s --i2c --temps --data 0xff\nSearch 1-Wire sensors again, temperatures are back after a conversion round\n", PRG_NAME);
+	printf( "%s --i2c --perf\nGet firmware commands, overflows and timings, --set --data 0xe300 clear them\n", PRG_NAME);
+//	printf( "%s -m r -v\nstart %s to wait for a value, then display it and exit\n", PRG_NAME, PRG_NAME);
+}
+
+
+/* ======================================================================
+Function: parse_args
+Purpose : parse argument passed to the program
+Input 	: -
+Output	: -
+Comments: 
+====================================================================== */
+void parse_args(int argc, char *argv[])
+{
+
+	static struct option longOptions[] =
+	{
+		{"device" 	,required_argument, 0, 'D' },
+		{"data"   	,required_argument, 0, 'd' },
+		{"verbose"	,no_argument			,	0, 'v' },
+		{"version"	,no_argument			,	0, 'V' },
+		{"address"	,required_argument, 0, 'a' },
+		{"i2cspeed"	,required_argument, 0, 'i' },
+		{"i2c"    	,no_argument			,	0, 'I' },
+		{"spi"    	,no_argument			,	0, 'S' },
+		{"serial"		,no_argument			,	0, 'A' },
+		{"baud"			,required_argument, 0, 'Y' },
+		{"set"    	,no_argument			,	0, 's' },
+		{"getbyte"	,no_argument			,	0, 'g' },
+		{"getword"	,no_argument			, 0, 'G' },
+		{"quick"  	,no_argument			,	0, 'q' },
+		{"ack"    	,no_argument			, 0, 'k' },
+		{"help"			,no_argument			,	0, 'h' },
+		{"maxspeed"	,required_argument, 0, 'x' },
+		{"delay"  	,required_argument, 0, 'y' },
+		{"bytedelay",required_argument, 0, 'w' },
+		{"bits"   	,required_argument, 0, 'b' },
+		{"loop"		  ,no_argument			, 0, 'l' },
+		{"cpha"		  ,no_argument			, 0, 'H' },
+		{"cpol"		  ,no_argument			, 0, 'O' },
+		{"lsb"			,no_argument			, 0, 'L' },
+		{"cs-high"	,no_argument			, 0, 'C' },
+		{"3wire"		,no_argument			, 0, '3' },
+		{"no-cs"		,no_argument			, 0, 'N' },
+		{"ready"		,no_argument			, 0, 'R' },
+		{"hex"			,no_argument			, 0, 'X' },
+		{"crc"			,no_argument			, 0, 'Q' },
+		{"retries"	,required_argument, 0, 'r' },
+		{"watch"		,no_argument			, 0, 'W' },
+		{"gpio"			,required_argument, 0, 'J' },
+		{"reset"		,no_argument			, 0, 'T' },
+		{"dtr"			,no_argument			, 0, 'u' },
+		{"slaves"		,required_argument, 0, 'z' },
+		{"period"		,required_argument, 0, 'j' },
+		{"shm"			,required_argument, 0, 't' },
+		{"coalesce"	,required_argument, 0, OPT_COALESCE },
+		{"cache-age",required_argument, 0, OPT_CACHE_AGE },
+		{"temps"		,no_argument			, 0, OPT_TEMPS },
+		{"daemon"		,no_argument			, 0, 'Z' },
+		{"socket"		,required_argument, 0, 'U' },
+		{"batch"		,required_argument, 0, 'B' },
+		{"bulk"			,no_argument			, 0, 'K' },
+		{"snapshot"	,no_argument			, 0, 'n' },
+		{"stream"		,no_argument			, 0, 'm' },
+		{"output"		,required_argument, 0, 'o' },
+		{"count"		,required_argument, 0, 'c' },
+		{"csv"			,no_argument			, 0, 'f' },
+		{"sim"			,no_argument			, 0, 'M' },
+		{"bench"		,no_argument			, 0, 'e' },
+		{"loglevel"	,required_argument, 0, 'E' },
+		{"stats"		,no_argument			, 0, 'P' },
+		{"statsfile",required_argument, 0, 'F' },
+		{"perf"			,no_argument			, 0, 'p' },
+		
+		{0, 0, 0, 0}
+	};
+
+	int optionIndex = 0;
+	int c;
+	char * pEnd;
+	
+	// By default set the correct I2C device function of Pi version
+
+	while (1) 
+	{
+		/* no default error messages printed. */
+		opterr = 0;
+
+		c = getopt_long(argc, argv, "D:d:vVa:i:x:y:w:b:ISsgGqkhlHOLC3NRXZU:B:Knmo:c:fMeE:PF:pQr:WJ:TuAY:z:j:t:", longOptions, &optionIndex);
+
+		if (c < 0)
+			break;
+
+		switch (c) 
+		{
+			case 'v':	opts.verbose = true;	break;
+
+			
+			case 's': opts.mode = MODE_SET				; 	opts.mode_str = "set"				; break;
+			case 'k': opts.mode = MODE_READ_ACK	; 	opts.mode_str = "read ack"	; break;
+			case 'q': opts.mode = MODE_QUICK_ACK	; 	opts.mode_str = "quick ack"	; break;
+			case 'g': opts.mode = MODE_GET				; 	opts.mode_str = "get byte"	; break;
+			case 'G': opts.mode = MODE_GET_WORD	; 	opts.mode_str = "get word"	; break;
+			case 'Z': opts.mode = MODE_DAEMON		; 	opts.mode_str = "daemon"		; break;
+			case 'K': opts.mode = MODE_BULK			; 	opts.mode_str = "bulk get"	; break;
+			case 'n': opts.mode = MODE_SNAPSHOT	; 	opts.mode_str = "snapshot"	; break;
+			case 'm': opts.mode = MODE_STREAM		; 	opts.mode_str = "stream"		; break;
+			case 'e': opts.mode = MODE_BENCH		; 	opts.mode_str = "bench"			; break;
+			case 'p': opts.mode = MODE_PERF			; 	opts.mode_str = "perf"			; break;
+			case 'W': opts.mode = MODE_WATCH		; 	opts.mode_str = "watch"			; break;
+			case OPT_TEMPS: opts.mode = MODE_TEMPS; opts.mode_str = "1-wire temperatures"; break;
+			case 'T': opts.mode = MODE_RESET		; 	opts.mode_str = "reset"			; break;
+
+			// fan-out mode slaves list
+			case 'z':
+				opts.mode = MODE_FANOUT ;
+				opts.mode_str = "fanout" ;
+				strncpy(opts.slaves, optarg, sizeof(opts.slaves) - 1);
+				opts.slaves[sizeof(opts.slaves) - 1] = '\0';
+			break;
+
+			// shm mode segment name, starts with /
+			case 't':
+				opts.mode = MODE_SHM ;
+				opts.mode_str = "shm" ;
+				snprintf(opts.shm, sizeof(opts.shm), "%s%s", *optarg == '/' ? "" : "/", optarg);
+			break;
+
+			// port cache write window
+			case OPT_COALESCE:
+				opts.coalesce = strtol(optarg,&pEnd,0) ;
+				
+				if ( !pEnd || opts.coalesce < 0 || opts.coalesce > 60000 )
+				{
+						fprintf(stderr, "--coalesce %d ignored.\n", opts.coalesce);
+						fprintf(stderr, "--coalesce must be between 0 and 60000 (ms)\n");
+						opts.coalesce = 0;
+				}
+			break;
+
+			// port cache max age of registers read
+			case OPT_CACHE_AGE:
+				opts.cache_age = strtol(optarg,&pEnd,0) ;
+				
+				if ( !pEnd || opts.cache_age < 0 || opts.cache_age > 3600000 )
+				{
+						fprintf(stderr, "--cache-age %d ignored.\n", opts.cache_age);
+						fprintf(stderr, "--cache-age must be between 0 and 3600000 (ms)\n");
+						opts.cache_age = CACHE_AGE_MS;
+				}
+			break;
+
+			// fan-out mode period
+			case 'j':
+				opts.period = strtol(optarg,&pEnd,0) ;
+				
+				if ( !pEnd || opts.period < 1 || opts.period > 3600000 )
+				{
+						fprintf(stderr, "--period %d ignored.\n", opts.period);
+						fprintf(stderr, "--period must be between 1 and 3600000 (ms)\n");
+						opts.period = FANOUT_PERIOD_MS;
+				}
+			break;
+			case 'f': opts.csv = true	;	break;
+			case 'P': opts.stats = true	;	break;
+			case 'I': opts.proto= PROTO_I2C    	; 	opts.proto_str= "i2c"     	; break;
+
+			// in process board simulator, no device needed
+			case 'M': 
+				opts.proto= PROTO_SIM ; 
+				opts.proto_str= "sim";  
+				strcpy(opts.port, "sim");
+			break;
+			case 'l': opts.spi_mode |= SPI_LOOP			; break;
+			case 'H': opts.spi_mode |= SPI_CPHA			; break;
+			case 'O': opts.spi_mode |= SPI_CPOL			; break;
+			case 'L': opts.spi_mode |= SPI_LSB_FIRST	;	break;
+			case 'C': opts.spi_mode |= SPI_CS_HIGH		;	break;
+			case '3': opts.spi_mode |= SPI_3WIRE			;	break;
+			case 'N': opts.spi_mode |= SPI_NO_CS			;	break;
+			case 'R': opts.spi_mode |= SPI_READY			;	break;
 			case 'X': opts.hexout = true		;	break;
+			case 'Q': opts.crc = true				;	break;
+			case 'u': opts.dtr = true				;	break;
+
+			// GPIO of firmware IRQ line
+			case 'J':
+				opts.gpio = strtol(optarg,&pEnd,0) ;
+				
+				if ( !pEnd || opts.gpio < 0 || opts.gpio > 53 )
+				{
+						fprintf(stderr, "--gpio %d ignored.\n", opts.gpio);
+						fprintf(stderr, "--gpio must be between 0 and 53\n");
+						opts.gpio = -1;
+				}
+			break;
+
+			// retries of failed transaction
+			case 'r':
+				opts.retries = strtol(optarg,&pEnd,0) ;
+				
+				if ( !pEnd || opts.retries < 0 || opts.retries > 10 )
+				{
+						fprintf(stderr, "--retries %d ignored.\n", opts.retries);
+						fprintf(stderr, "--retries must be between 0 and 10\n");
+						opts.retries = BUS_RETRIES;
+				}
+			break;
 			
 			
 			// SPI init default bus
@@ -527,408 +2314,3739 @@ void parse_args(int argc, char *argv[])
 				opts.proto= PROTO_SPI ; 
 				opts.proto_str= "spi";  
 
-				// if bus still i2c, default to spi0
-				// /dev/i2c-x -> i is th 5th char
-				if ( opts.port[5] == 'i' )
-					strcpy(opts.port, SPI_DEVICE_0);
-					
-			break;
+				// if bus still i2c, default to spi0
+				// /dev/i2c-x -> i is th 5th char
+				if ( opts.port[5] == 'i' )
+					strcpy(opts.port, SPI_DEVICE_0);
+					
+			break;
+
+			// Serial init default port
+			case 'A': 
+				opts.proto= PROTO_SERIAL ; 
+				opts.proto_str= "serial";  
+
+				// if bus still i2c, default to Pi UART
+				if ( opts.port[5] == 'i' )
+					strcpy(opts.port, SERIAL_DEVICE);
+					
+			break;
+
+			// serial speed
+			case 'Y':
+				opts.baud = strtol(optarg,&pEnd,0) ;
+				
+				if ( !pEnd || !serial_speed(opts.baud) )
+				{
+						fprintf(stderr, "--baud %d ignored.\n", opts.baud);
+						fprintf(stderr, "--baud must be 9600, 19200, 38400, 57600, 115200, 230400, 460800, 500000 or 1000000\n");
+						opts.baud = SERIAL_BAUD;
+				}
+			break;
+
+			
+			// i2c slave address
+			case 'a':
+				opts.address = strtol(optarg,&pEnd,0);
+				
+				if ( !pEnd || opts.address < 1 || opts.address > 0x7F )
+				{
+						fprintf(stderr, "--address %d (0x%02x) ignored.\n", opts.address, opts.address);
+						fprintf(stderr, "--address must be between 1 and 255 or 0x01 and 0xff\n");
+						opts.address = I2C_SLAVE;
+						fprintf(stderr, "--setting slave to default 0x%02x\n", opts.address);
+				}
+			break;
+
+			// i2c speed, auto is the fastest with fall back
+			case 'i':
+				opts.i2c_speed = strcmp(optarg, "auto") ? strtol(optarg,&pEnd,0) : 400;
+				
+				if ( opts.i2c_speed != 100 && opts.i2c_speed != 400 )
+				{
+						fprintf(stderr, "--i2cspeed %s ignored.\n", optarg);
+						fprintf(stderr, "--i2cspeed must be 100, 400 or auto\n");
+						opts.i2c_speed = 0;
+				}
+			break;
+
+			// spi max speed
+			case 'x':
+				opts.spi_speed = strtol(optarg,&pEnd,0) ;
+				
+				if ( !pEnd || opts.spi_speed < 1 || opts.spi_speed > 10000 )
+				{
+						fprintf(stderr, "--maxspeed %d Khz ignored.\n", opts.spi_speed);
+						fprintf(stderr, "--maxspeed must be between 1 and 10000 (KHz)\n");
+						opts.spi_speed = SPI_SPEED;
+						fprintf(stderr, "--setting max speed to default %d Khz\n", opts.spi_speed/1000);
+				}
+				else
+				{
+					opts.spi_speed *= 1000;
+				}
+			break;
+
+			// spi delay 
+			case 'y':
+				opts.spi_delay = strtol(optarg,&pEnd,0) ;
+				
+				if ( !pEnd || opts.spi_delay < 0 )
+				{
+						fprintf(stderr, "--delay %dus ignored.\n", opts.spi_delay);
+						opts.spi_delay = SPI_DELAY;
+						fprintf(stderr, "--setting delay to default %d us\n", opts.spi_delay);
+				}
+			break;
+
+			// spi delay between bytes
+			case 'w':
+			{
+				long delay = strtol(optarg,&pEnd,0) ;
+				
+				if ( *pEnd || delay < 0 || delay > SPI_BYTEDELAY_MAX )
+				{
+						fprintf(stderr, "--bytedelay %s ignored, 0 to %d us.\n", optarg, SPI_BYTEDELAY_MAX);
+						delay = 0;
+				}
+				opts.spi_bytedelay = delay;
+			}
+			break;
+
+			// spi bits per word 
+			case 'b':
+				opts.spi_bits = strtol(optarg,&pEnd,0) ;
+				
+				if ( !pEnd || opts.spi_bits < 0 || opts.spi_bits > 64 )
+				{
+						fprintf(stderr, "--bits %d ignored.\n", opts.spi_bits);
+						opts.spi_delay = SPI_BITS_WORD;
+						fprintf(stderr, "--setting bits per word to default %d us\n", opts.spi_bits);
+				}
+			break;
+
+			// batch mode, read commands from file
+			case 'B':
+				opts.mode = MODE_BATCH;
+				opts.mode_str = "batch";
+				strncpy(opts.batch, optarg, sizeof(opts.batch) - 1);
+				opts.batch[sizeof(opts.batch) - 1] = '\0';
+			break;
+
+			// syslog level
+			case 'E':
+				opts.loglevel = strtol(optarg,&pEnd,0) ;
+				
+				if ( !pEnd || opts.loglevel < LOG_EMERG || opts.loglevel > LOG_DEBUG )
+				{
+						fprintf(stderr, "--loglevel %d ignored.\n", opts.loglevel);
+						opts.loglevel = LOG_DEFAULT;
+				}
+			break;
+
+			// stream output file
+			case 'o':
+				strncpy(opts.output, optarg, sizeof(opts.output) - 1);
+				opts.output[sizeof(opts.output) - 1] = '\0';
+			break;
+
+			// stream samples count
+			case 'c':
+				opts.count = strtol(optarg,&pEnd,0) ;
+				
+				if ( !pEnd || opts.count < 0 )
+				{
+						fprintf(stderr, "--count %ld ignored.\n", opts.count);
+						opts.count = 0;
+				}
+			break;
+
+			// statistics file
+			case 'F':
+				strncpy(opts.statsfile, optarg, sizeof(opts.statsfile) - 1);
+				opts.statsfile[sizeof(opts.statsfile) - 1] = '\0';
+			break;
+
+			// daemon socket path
+			case 'U':
+				// unix socket path must fit with its ending 0
+				if ( strlen(optarg) >= sizeof(((struct sockaddr_un *) 0)->sun_path) || strlen(optarg) >= sizeof(opts.socket) )
+				{
+						fprintf(stderr, "--socket %s too long, %d chars max.\n", optarg, (int) sizeof(opts.socket) - 1);
+						exit(EXIT_FAILURE);
+				}
+				strcpy(opts.socket, optarg);
+			break;
+
+			// Device name
+			case 'D':
+				strncpy(opts.port, optarg, sizeof(opts.port) - 1);
+				opts.port[sizeof(opts.port) - 1] = '\0';
+			break;
+
+			// Data
+			case 'd':
+			{
+				int ishex = false;
+				char * p = opts.data;
+
+			
+				// Check correct size
+				if ( strlen (optarg) >= 2)
+				{
+					// is it a hex string 
+					if (optarg[0] == '0' && optarg[1] == 'x' )
+						ishex = true;
+				}
+				
+				// bulk mode may give many commands, they must fit in data
+				if ( ( ishex && (strlen(optarg) - 1) / 2 > sizeof(opts.data) ) || 
+						 ( !ishex && strlen(optarg) + 2 > sizeof(opts.data) ) )
+				{
+						fprintf(stderr, "--data %s too long, %d bytes max.\n", optarg, (int) sizeof(opts.data) - (ishex ? 0 : 2));
+						exit(EXIT_FAILURE);
+				}
+
+				if (ishex)
+				{
+					// put hex value into buffer data
+					for (c = 2 ; optarg[c] != '\0' ; c += 2, p++)    
+					{
+						// even number of hex char
+						if ( !optarg[c+1] )
+						{
+							*p = charToHexDigit(optarg[c]) ; 
+							c+=2;
+							break;
+						}
+						else
+						{
+							*p = charToHexDigit(optarg[c]) * 16 + charToHexDigit(optarg[c+1]); 
+						}
+					}
+					
+					opts.datasize = (c/2)- 1;
+				}
+				else
+				{
+					// copy the string
+					opts.datasize = strlen(optarg);
+					strncpy (opts.data, optarg, opts.datasize+1);
+					strncat (opts.data, "\n", 1);
+					opts.datasize++;
+				}
+			}
+			break;
+
+			// version
+			case 'V':
+			{
+				printf("%s v%s\n", PRG_NAME, PRG_VERSION);
+				printf("Raspberry Board Revision : %04x\n", g_pi_rev );
+				exit(EXIT_SUCCESS);
+			}
+			break;
+
+			// help
+			case 'h':
+				usage(argv[0]);
+				exit(EXIT_SUCCESS);
+			break;
+			
+			case '?':
+			default:
+				fprintf(stderr, "Unrecognized option.\n");
+				fprintf(stderr, "Run with '--help'.\n");
+				exit(EXIT_FAILURE);
+			break;
+		}
+	} /* while */
+
+	
+	if (opts.verbose)
+	{
+		
+		if ( opts.proto == PROTO_I2C )
+		{
+			printf("-- i2c Stuff -- \n");
+			printf("i2c bus       : %s\n", opts.port);
+			printf("slave address : 0x%02X\n", opts.address);
+		}
+		if ( opts.proto == PROTO_SPI )
+		{
+			printf("-- spi Stuff -- \n");
+			printf("spi bus       : %s\n", opts.port);
+			printf("spi mode      : %d\n", opts.spi_mode);
+			printf("bits per word : %d\n", opts.spi_bits);
+			printf("max speed     : %d Hz (%d KHz)\n", opts.spi_speed, opts.spi_speed/1000);
+			printf("byte delay    : %d us\n", opts.spi_bytedelay);
+		}
+		if ( opts.proto == PROTO_SERIAL )
+		{
+			printf("-- serial Stuff -- \n");
+			printf("serial port   : %s\n", opts.port);
+			printf("speed         : %d baud\n", opts.baud);
+		}
+				
+		printf("mode          : %s\n", opts.mode_str);
+		printf("protocol      : %s\n", opts.proto_str);
+		printf("verbose       : %s\n", opts.verbose? "yes" : "no");
+		printf("crc           : %s\n", opts.crc ? "yes" : "no");
+		printf("retries       : %d\n", opts.retries);
+
+		if ( opts.mode == MODE_DAEMON )
+			printf("socket        : %s\n", opts.socket);
+		if ( opts.mode == MODE_BATCH )
+			printf("batch file    : %s\n", opts.batch);
+		if ( (opts.mode == MODE_DAEMON || opts.mode == MODE_BATCH) && opts.coalesce )
+			printf("port cache    : %d ms window, %d ms age\n", opts.coalesce, opts.cache_age);
+		if ( opts.mode == MODE_STREAM )
+			printf("output        : %s (%s)\n", opts.output, opts.csv ? "csv" : "binary");
+
+		printf("data (%02i)     : ", opts.datasize);
+		
+		if (opts.datasize >0 )
+		{
+			for (c = 0; c <opts.datasize ; c++)    
+				printf("0x%02X ", opts.data[c]);
+							
+			printf("\n");
+		}
+		else
+		{
+			printf("NULL\n");
+		}
+
+	}	
+}
+
+/* ======================================================================
+Function: i2c_xfer_init
+Purpose : start a new i2c combined transaction
+Input 	: i2c transaction
+Output	: -
+Comments: -
+====================================================================== */
+void i2c_xfer_init(struct i2c_xfer * xfer)
+{
+	memset(xfer, 0, sizeof(*xfer));
+}
+
+/* ======================================================================
+Function: i2c_xfer_add
+Purpose : queue a new message to an i2c combined transaction
+Input 	: i2c transaction
+					buffer to write from or read to
+					size of message
+					true if it's a read message
+Output	: -1 if transaction is full or message too big, 0 if ok
+Comments: buffer must stay valid until i2c_xfer_submit()
+====================================================================== */
+int i2c_xfer_add(struct i2c_xfer * xfer, unsigned char * buf, int len, int is_read)
+{
+	struct i2c_msg * msg;
+
+	// firmware can't receive or send more
+	if ( xfer->n >= I2C_MAX_MSGS || len > (is_read ? ARDUIPI_RSP_MAX_SIZE : ARDUIPI_CMD_MAX_SIZE - 1) )
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	msg = &xfer->msgs[xfer->n++];
+
+	msg->addr = g_slave;
+	msg->flags = is_read ? I2C_M_RD : 0;
+	msg->len = len;
+	msg->buf = (void *) buf;
+
+	return 0;
+}
+
+/* ======================================================================
+Function: i2c_xfer_add_get
+Purpose : queue a get command to an i2c combined transaction
+Input 	: i2c transaction
+					pointer to the command (command byte and parameters)
+					size of command
+					pointer to response buffer
+					size of response
+Output	: -1 if transaction is full, 0 if ok
+Comments: write command then read response after a repeated start
+====================================================================== */
+int i2c_xfer_add_get(struct i2c_xfer * xfer, unsigned char * cmd, int cmdlen, unsigned char * rsp, int len)
+{
+	if ( xfer->n + 2 > I2C_MAX_MSGS )
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if ( i2c_xfer_add(xfer, cmd, cmdlen, false) < 0 )
+		return -1;
+
+	return i2c_xfer_add(xfer, rsp, len, true);
+}
+
+/* ======================================================================
+Function: i2c_xfer_submit
+Purpose : send all messages of an i2c combined transaction in one shot
+Input 	: i2c Port Handle
+					i2c transaction
+Output	: -1 if error
+Comments: all messages are done by one I2C_RDWR ioctl, one START, 
+					repeated START between messages and one STOP, so no other 
+					master can interleave
+====================================================================== */
+int i2c_xfer_submit(int fd, struct i2c_xfer * xfer)
+{
+	struct i2c_rdwr_ioctl_data data;
+
+	data.msgs = xfer->msgs;
+	data.nmsgs = xfer->n;
+
+	double start = time_now();
+	int r;
+
+	r = ioctl(fd, I2C_RDWR, &data);
+	stats_add(STAT_I2C_RDWR, start, r);
+
+	return r;
+}
+
+/* ======================================================================
+Function: i2c_transaction
+Purpose : do one i2c transaction on the opened device
+Input 	: program mode (MODE_xxx)
+					data buffer (command + data)
+					size of data
+Output	: value read from device (or 0 for write) or -1 if error
+Comments: documentation on i2c API can be found at
+					http://www.mjmwired.net/kernel/Documentation/i2c/smbus-protocol
+					http://www.mjmwired.net/kernel/Documentation/i2c/dev-interface
+====================================================================== */
+int i2c_transaction(int mode, unsigned char * data, int datasize)
+{
+	struct i2c_xfer xfer;
+	unsigned char rsp[2];
+	double start;
+	int r = -1;
+
+	// Mode : Check device
+	if (mode == MODE_QUICK_ACK)	
+	{
+		start = time_now();
+		r = i2c_smbus_write_quick(g_fd_device, I2C_SMBUS_WRITE);
+		stats_add(STAT_SMBUS, start, r);
+	}
+	else if (mode == MODE_READ_ACK)	
+	{
+		start = time_now();
+		r = i2c_smbus_read_byte(g_fd_device);
+		stats_add(STAT_SMBUS, start, r);
+	}
+
+	// Get Byte or word command, command then response in one transaction
+	else if (mode == MODE_GET || mode == MODE_GET_WORD )
+	{
+		i2c_xfer_init(&xfer);
+		i2c_xfer_add_get(&xfer, data, 1, rsp, mode == MODE_GET ? 1 : 2);
+
+		r = i2c_xfer_submit(g_fd_device, &xfer);
+
+		// If OK Read the return value
+		if ( r >= 0 )
+			r = mode == MODE_GET ? rsp[0] : rsp[0] | (rsp[1] << 8 );
+	}
+	// Set command, any size the firmware can take
+	else if (mode == MODE_SET )
+	{
+		i2c_xfer_init(&xfer);
+
+		if ( i2c_xfer_add(&xfer, data, datasize, false) == 0 )
+			r = i2c_xfer_submit(g_fd_device, &xfer);
+
+		// we don't return anything on write
+		if ( r >= 0 )
+			r = 0;
+	}
+
+	return r;
+}
+
+/* ======================================================================
+Function: i2c_bulk
+Purpose : do a list of i2c get byte commands
+Input 	: list of commands
+					buffer for values read
+					number of commands
+Output	: -1 if error
+Comments: as many get as possible are sent in each i2c transaction
+====================================================================== */
+int i2c_bulk(unsigned char * cmds, unsigned char * values, int n)
+{
+	struct i2c_xfer xfer;
+	int i;
+
+	i2c_xfer_init(&xfer);
+
+	for (i = 0; i < n; i++)
+	{
+		// transaction full, send it and start a new one
+		if ( xfer.n + 2 > I2C_MAX_MSGS )
+		{
+			if ( i2c_xfer_submit(g_fd_device, &xfer) < 0 )
+				return -1;
+
+			i2c_xfer_init(&xfer);
+		}
+
+		i2c_xfer_add_get(&xfer, &cmds[i], 1, &values[i], 1);
+	}
+
+	return i2c_xfer_submit(g_fd_device, &xfer);
+}
+
+/* ======================================================================
+Function: i2c_gets
+Purpose : do a list of i2c get commands of any size
+Input 	: list of get commands
+					number of commands
+Output	: -1 if error
+Comments: as many get as possible are sent in each i2c transaction
+====================================================================== */
+int i2c_gets(struct bus_get * gets, int n)
+{
+	struct i2c_xfer xfer;
+	int i;
+
+	i2c_xfer_init(&xfer);
+
+	for (i = 0; i < n; i++)
+	{
+		// transaction full, send it and start a new one
+		if ( xfer.n + 2 > I2C_MAX_MSGS )
+		{
+			if ( i2c_xfer_submit(g_fd_device, &xfer) < 0 )
+				return -1;
+
+			i2c_xfer_init(&xfer);
+		}
+
+		if ( i2c_xfer_add_get(&xfer, gets[i].cmd, gets[i].cmdlen, gets[i].rsp, gets[i].len) < 0 )
+			return -1;
+	}
+
+	return i2c_xfer_submit(g_fd_device, &xfer);
+}
+
+/* ======================================================================
+Function: do_i2c
+Purpose : do i2c stuff
+Input 	: -
+Output	: -
+Comments: -
+====================================================================== */
+void do_i2c(void)
+{
+  int r=0;
+
+	bus_init();
+
+	r = bus_transaction(opts.mode, (unsigned char *) opts.data, opts.datasize);
+
+	// Mode : Check device
+	if ( opts.mode == MODE_QUICK_ACK || opts.mode == MODE_READ_ACK )
+	{
+		// If not found 
+		if ( r < 0  )
+			log_syslog(stdout, "i2c device 0x%02x was not found\n", opts.address);
+		else
+			log_syslog(stdout, "i2c device 0x%02x is detected\n", opts.address);
+
+		clean_exit( EXIT_SUCCESS );
+	}
+
+	// had a error ?
+	if (r<0)
+	{
+		log_msg(LOG_ERR, stdout, "Error from device 0x%02x : %d %s\n", opts.address, r, strerror(errno));
+		clean_exit( EXIT_FAILURE );
+	}
+	else
+	{
+		if (opts.hexout)
+			log_syslog(stdout, opts.mode == MODE_GET_WORD ? "0x%04X\n":"0x%02X\n", r);
+		else
+			log_syslog(stdout, "%d\n", r);
+
+		clean_exit( EXIT_SUCCESS );
+	}
+}
+
+
+/* ======================================================================
+Function: spi_msg_init
+Purpose : start a new multi segments spi message
+Input 	: spi message
+Output	: -
+Comments: -
+====================================================================== */
+void spi_msg_init(struct spi_msg * msg)
+{
+	memset(msg, 0, sizeof(*msg));
+}
+
+/* ======================================================================
+Function: spi_msg_segments
+Purpose : number of segments needed to send some bytes
+Input 	: number of bytes
+Output	: number of segments
+Comments: with byte delay each byte is a segment
+====================================================================== */
+int spi_msg_segments(int len)
+{
+	return ( opts.spi_bytedelay && len > 1 ) ? len : 1;
+}
+
+/* ======================================================================
+Function: spi_msg_add
+Purpose : queue a new segment to a spi message
+Input 	: spi message
+					pointer to send buffer (NULL to send dummy bytes)
+					pointer to receive buffer (NULL to ignore response)
+					size of segment
+					delay (usec) after this segment
+					true to deselect chip after this segment
+					segment speed (Hz), 0 for device default
+					segment bits per word, 0 for device default
+Output	: -1 if message is full or segment too big, 0 if ok
+Comments: buffers must stay valid until spi_msg_submit() 
+					with byte delay segment is split in one byte segments so
+					slave has time to load its next byte between them
+====================================================================== */
+int spi_msg_add(struct spi_msg * msg, const unsigned char * tx, unsigned char * rx, int len, 
+								uint16_t delay, uint8_t cs_change, uint32_t speed, uint8_t bits)
+{
+	static const unsigned char dummy[BUFFER_SIZE] = { [0 ... BUFFER_SIZE-1] = 0xFF };
+	struct spi_ioc_transfer * tr;
+	int i, n, step;
+
+	n = spi_msg_segments(len);
+	step = n > 1 ? 1 : len;
+
+	if ( msg->n + n > SPI_MAX_SEGMENTS || (!tx && len > BUFFER_SIZE) )
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if ( !tx )
+		tx = dummy;
+
+	for (i = 0; i < n; i++)
+	{
+		tr = &msg->tr[msg->n++];
+
+		tr->tx_buf = (unsigned long) (tx + i * step);
+		tr->rx_buf = (unsigned long) (rx ? rx + i * step : NULL);
+		tr->len = step;
+		tr->delay_usecs = i == n - 1 ? delay : opts.spi_bytedelay;
+		tr->cs_change = i == n - 1 ? cs_change : false;
+		tr->speed_hz = speed;
+		tr->bits_per_word = bits;
+	}
+
+	return 0;
+}
+
+/* ======================================================================
+Function: spi_msg_add_get
+Purpose : queue a get command to a spi message
+Input 	: spi message
+					pointer to the command (command byte and parameters)
+					size of command
+					pointer to response buffer
+					size of response
+Output	: -1 if message is full, 0 if ok
+Comments: command frame then response frame, leaving time to the
+					slave to prepare response between them
+====================================================================== */
+int spi_msg_add_get(struct spi_msg * msg, const unsigned char * cmd, int cmdlen, unsigned char * rsp, int len)
+{
+	if ( msg->n + spi_msg_segments(cmdlen) + spi_msg_segments(len) > SPI_MAX_SEGMENTS )
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	spi_msg_add(msg, cmd, NULL, cmdlen, SPI_CMD_DELAY + opts.spi_delay, true, 0, 0);
+	return spi_msg_add(msg, NULL, rsp, len, opts.spi_delay, true, 0, 0);
+}
+
+/* ======================================================================
+Function: spi_frame_segments
+Purpose : number of segments needed by a pipelined frame
+Input 	: size of command
+					size of previous command response
+Output	: number of segments
+Comments: see spi_msg_add_frame()
+====================================================================== */
+int spi_frame_segments(int cmdlen, int len)
+{
+	int pad = len > cmdlen ? len - cmdlen : 0;
+	int r = len - pad;
+
+	if ( !cmdlen )
+		return spi_msg_segments(len);
+
+	if ( r && r < cmdlen )
+		return spi_msg_segments(r) + spi_msg_segments(cmdlen - r);
+
+	return (pad ? spi_msg_segments(pad) : 0) + spi_msg_segments(cmdlen);
+}
+
+/* ======================================================================
+Function: spi_msg_add_frame
+Purpose : queue a pipelined frame to a spi message
+Input 	: spi message
+					pointer to the command (NULL if none)
+					size of command
+					pointer to previous command response buffer (NULL if none)
+					size of previous command response (0 if none)
+Output	: -1 if message is full, 0 if ok
+Comments: command is sent while previous command response is read,
+					frame is padded with 0xFF before command if response is 
+					longer
+====================================================================== */
+int spi_msg_add_frame(struct spi_msg * msg, const unsigned char * cmd, int cmdlen, unsigned char * rsp, int len)
+{
+	uint16_t delay = SPI_CMD_DELAY + opts.spi_delay;
+	int pad = len > cmdlen ? len - cmdlen : 0;
+	int r = len - pad;		// response bytes read while command is sent
+
+	if ( msg->n + spi_frame_segments(cmdlen, len) > SPI_MAX_SEGMENTS )
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	// frame only read response
+	if ( !cmdlen )
+		return spi_msg_add(msg, NULL, rsp, len, delay, true, 0, 0);
+
+	if ( pad )
+		spi_msg_add(msg, NULL, rsp, pad, 0, false, 0, 0);
+
+	// response shorter than command, don't write past it
+	if ( r && r < cmdlen )
+	{
+		spi_msg_add(msg, cmd, rsp, r, 0, false, 0, 0);
+		return spi_msg_add(msg, cmd + r, NULL, cmdlen - r, delay, true, 0, 0);
+	}
+
+	return spi_msg_add(msg, cmd, r ? rsp + pad : NULL, cmdlen, delay, true, 0, 0);
+}
+
+/* ======================================================================
+Function: spi_msg_submit
+Purpose : send all segments of a spi message in one shot
+Input 	: spi Port Handle
+					spi message
+Output	: -1 if error
+Comments: all segments are done by one SPI_IOC_MESSAGE(N) ioctl
+====================================================================== */
+int spi_msg_submit(int fd, struct spi_msg * msg)
+{
+	// last segment, leave chip select as the driver want
+	if ( msg->n )
+		msg->tr[msg->n - 1].cs_change = 0;
+
+	double start = time_now();
+	int r;
+
+	r = ioctl(fd, SPI_IOC_MESSAGE(msg->n), msg->tr);
+	stats_add(STAT_SPI_MSG, start, r);
+
+	return r;
+}
+
+/* ======================================================================
+Function: spi_transfer
+Purpose : send spi data and get response at the same time
+Input 	: spi Port Handle
+					pointer to send buffer (buffer will be erased by device response
+					size of buffer
+Output	: -1 if error
+Comments: 
+====================================================================== */
+int spi_transfer(int fd, unsigned char * buf, int n)
+{
+	struct spi_msg msg;
+
+	spi_msg_init(&msg);
+	spi_msg_add(&msg, buf, buf, n, opts.spi_delay, false, 0, 0);
+		
+	return (spi_msg_submit(fd, &msg));
+}
+
+/* ======================================================================
+Function: spi_transaction
+Purpose : do one spi transaction on the opened device
+Input 	: program mode (MODE_xxx)
+					data buffer (command + data), overwritten by device response
+					size of data
+Output	: value read from device (or 0 for write) or -1 if error
+Comments: get commands are done with one SPI_IOC_MESSAGE(2) ioctl
+====================================================================== */
+int spi_transaction(int mode, unsigned char * data, int datasize)
+{
+	struct spi_msg msg;
+	unsigned char rsp[2];
+	int r = -1;
+
+	// Mode : Check device, 
+	// arbitray, just check device response there is no such mode in SPI
+	if ( mode == MODE_QUICK_ACK || mode == MODE_READ_ACK )
+	{
+		// transfert one byte with the ping command
+		// test firmware always response 2a 
+		data[0] = ARDUIPI_CMD_PING ;
+		r = spi_transfer( g_fd_device, data, 1);
+
+		// If OK get real response
+		if ( r >= 0 )
+			r = data[0];
+	}
+	// Get Byte or word command, command then response in one message
+	else if (mode == MODE_GET || mode == MODE_GET_WORD )
+	{
+		spi_msg_init(&msg);
+		spi_msg_add_get(&msg, data, 1, rsp, mode == MODE_GET ? 1 : 2);
+
+		r = spi_msg_submit( g_fd_device, &msg);
+
+		// If OK Read the return value
+		if ( r >= 0 )
+			r = mode == MODE_GET ? rsp[0] : rsp[0] | (rsp[1] << 8 );
+	}
+	else if (mode == MODE_SET )
+	{
+		// send bulk data data
+		r = spi_transfer( g_fd_device, data, datasize);
+
+		// we don't return anything on write
+		if ( r >= 0 )
+			r = 0;
+	}
+
+	return r;
+}
+
+/* ======================================================================
+Function: spi_bulk
+Purpose : do a list of spi get byte commands in pipelined frames
+Input 	: list of commands
+					buffer for values read
+					number of commands
+Output	: -1 if error
+Comments: each frame send a command and get previous one response, so
+					n commands take n+1 frames, as many as possible by message
+====================================================================== */
+int spi_bulk(unsigned char * cmds, unsigned char * values, int n)
+{
+	struct spi_msg msg;
+	int i, first;
+
+	for (i = 0; i < n; )
+	{
+		spi_msg_init(&msg);
+		first = i;
+
+		// keep room for last frame getting last response
+		while ( i < n && msg.n + 2 * spi_msg_segments(1) <= SPI_MAX_SEGMENTS )
+		{
+			spi_msg_add_frame(&msg, &cmds[i], 1, i > first ? &values[i - 1] : NULL, i > first ? 1 : 0);
+			i++;
+		}
+
+		spi_msg_add_frame(&msg, NULL, 0, &values[i - 1], 1);
+
+		if ( spi_msg_submit( g_fd_device, &msg) < 0 )
+			return -1;
+	}
+
+	return 0;
+}
+
+/* ======================================================================
+Function: spi_gets
+Purpose : do a list of spi get commands of any size in pipelined frames
+Input 	: list of get commands
+					number of commands
+Output	: -1 if error
+Comments: each frame send a command and get previous one response, so
+					n commands take n+1 frames, as many as possible by message
+====================================================================== */
+int spi_gets(struct bus_get * gets, int n)
+{
+	struct spi_msg msg;
+	int i, first, prev;
+
+	for (i = 0; i < n; )
+	{
+		spi_msg_init(&msg);
+		first = i;
+
+		// keep room for last frame getting last response
+		while ( i < n )
+		{
+			prev = i > first ? gets[i - 1].len : 0;
+
+			if ( msg.n + spi_frame_segments(gets[i].cmdlen, prev) + spi_frame_segments(0, gets[i].len) > SPI_MAX_SEGMENTS )
+				break;
+
+			spi_msg_add_frame(&msg, gets[i].cmd, gets[i].cmdlen, prev ? gets[i - 1].rsp : NULL, prev);
+			i++;
+		}
+
+		if ( i == first )
+		{
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		spi_msg_add_frame(&msg, NULL, 0, gets[i - 1].rsp, gets[i - 1].len);
+
+		if ( spi_msg_submit( g_fd_device, &msg) < 0 )
+			return -1;
+	}
+
+	return 0;
+}
+
+/* ======================================================================
+Function: cobs_encode
+Purpose : COBS encode a frame, so it has no 0x00
+Input 	: frame
+					size of frame (254 max)
+					encoded buffer (size + 1)
+Output	: size of encoded frame
+Comments: each 0x00 is replaced by the offset of the next one, first 
+					byte is offset of the first one
+====================================================================== */
+int cobs_encode(const unsigned char * src, int len, unsigned char * dst)
+{
+	int code = 0, i, n = 1;
+
+	for (i = 0; i < len; i++)
+	{
+		if ( src[i] )
+		{
+			dst[n++] = src[i];
+			continue;
+		}
+
+		dst[code] = n - code;
+		code = n++;
+	}
+
+	dst[code] = n - code;
+
+	return n;
+}
+
+/* ======================================================================
+Function: cobs_decode
+Purpose : decode a COBS frame
+Input 	: encoded frame, without trailing 0x00
+					size of encoded frame
+					frame buffer (size - 1)
+Output	: size of frame, -1 if not a valid encoding
+Comments: -
+====================================================================== */
+int cobs_decode(const unsigned char * src, int len, unsigned char * dst)
+{
+	int i = 0, n = 0, code, j;
+
+	while ( i < len )
+	{
+		code = src[i++];
+
+		if ( !code || i + code - 1 > len )
+			return -1;
+
+		for (j = 1; j < code; j++)
+			dst[n++] = src[i++];
+
+		// offset of a 0x00, not the end of frame
+		if ( i < len )
+			dst[n++] = 0x00;
+	}
+
+	return n;
+}
+
+/* ======================================================================
+Function: serial_send
+Purpose : send one request frame
+Input 	: sequence number
+					get command or set command (response NULL)
+Output	: -1 if error
+Comments: -
+====================================================================== */
+int serial_send(uint8_t seq, struct bus_get * req)
+{
+	unsigned char frame[SERIAL_REQ_MAX];
+	unsigned char enc[SERIAL_REQ_MAX + 2];
+	struct pollfd pfd = { g_fd_device, POLLOUT, 0 };
+	int n, r, sent = 0;
+
+	if ( req->cmdlen < 1 || req->cmdlen > ARDUIPI_CMD_MAX_SIZE || req->len > ARDUIPI_RSP_MAX_SIZE )
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	frame[0] = seq;
+	frame[1] = req->rsp ? SERIAL_OP_GET : SERIAL_OP_SET;
+	memcpy(frame + 2, req->cmd, req->cmdlen);
+	frame[req->cmdlen + 2] = crc8(0, frame, req->cmdlen + 2);
+
+	n = cobs_encode(frame, req->cmdlen + 3, enc);
+	enc[n++] = 0x00;
+
+	while ( sent < n )
+	{
+		if ( (r = write(g_fd_device, enc + sent, n - sent)) > 0 )
+			sent += r;
+		else if ( r < 0 && errno != EAGAIN )
+			return -1;
+		else if ( poll(&pfd, 1, SERIAL_TIMEOUT_MS) <= 0 )
+		{
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* ======================================================================
+Function: serial_recv
+Purpose : receive one response frame
+Input 	: frame buffer (SERIAL_RSP_MAX)
+					time to give up (time_now())
+Output	: size of frame, -1 if error
+Comments: bytes after the frame are kept for the next call, frames 
+					too big, badly encoded or with a bad CRC are dropped
+====================================================================== */
+int serial_recv(unsigned char * frame, double deadline)
+{
+	struct pollfd pfd = { g_fd_device, POLLIN, 0 };
+	unsigned char * eof;
+	int n, r, timeout;
+
+	for (;;)
+	{
+		while ( (eof = memchr(g_ser_rx, 0x00, g_ser_rx_len)) != NULL )
+		{
+			n = eof - g_ser_rx;
+
+			r = n && n <= SERIAL_RSP_MAX + 1 ? cobs_decode(g_ser_rx, n, frame) : -1;
+
+			g_ser_rx_len -= n + 1;
+			memmove(g_ser_rx, eof + 1, g_ser_rx_len);
+
+			if ( r >= 3 && crc8(0, frame, r - 1) == frame[r - 1] )
+				return r;
+		}
+
+		// no end of frame in a full buffer, it's garbage
+		if ( g_ser_rx_len == SERIAL_RX_SIZE )
+			g_ser_rx_len = 0;
+
+		if ( (timeout = (deadline - time_now()) * 1000) <= 0 )
+		{
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		if ( (r = poll(&pfd, 1, timeout)) < 0 )
+			return -1;
+
+		if ( r && (r = read(g_fd_device, g_ser_rx + g_ser_rx_len, SERIAL_RX_SIZE - g_ser_rx_len)) < 0 && errno != EAGAIN )
+			return -1;
+
+		if ( r > 0 )
+			g_ser_rx_len += r;
+	}
+}
+
+/* ======================================================================
+Function: serial_xfer
+Purpose : do a list of serial requests, several outstanding
+Input 	: list of get commands, set commands have no response buffer
+					number of requests
+Output	: -1 if error
+Comments: firmware answers in order, a response to a newer request 
+					means the older one was lost, responses to requests of a
+					previous failed call are skipped, short responses are 
+					completed with 0xFF like a real bus
+					requests not answered yet never hold more than SERIAL_WINDOW
+					encoded bytes so they fit in firmware UART RX ring
+====================================================================== */
+int serial_xfer(struct bus_get * reqs, int n)
+{
+	unsigned char frame[SERIAL_RSP_MAX];
+	double start = time_now();
+	uint8_t base = g_ser_seq, d;
+	int sent = 0, done = 0, r = 0, len, flen;
+	int inflight = 0;
+
+	g_ser_seq += n;
+
+	while ( done < n )
+	{
+		while ( sent < n && ( sent == done || inflight + SERIAL_REQ_ENC(&reqs[sent]) <= SERIAL_WINDOW ) )
+		{
+			if ( (r = serial_send(base + sent, &reqs[sent])) < 0 )
+				goto end;
+			inflight += SERIAL_REQ_ENC(&reqs[sent]);
+			sent++;
+		}
+
+		if ( (r = flen = serial_recv(frame, time_now() + SERIAL_TIMEOUT_MS / 1000.0)) < 0 )
+			goto end;
+
+		// not one of ours
+		d = frame[0] - (uint8_t) (base + done);
+		if ( d >= sent - done )
+			continue;
+
+		r = -1;
+
+		if ( d )
+		{
+			errno = EPROTO;
+			goto end;
+		}
+
+		if ( frame[1] )
+		{
+			errno = EIO;
+			goto end;
+		}
+
+		if ( reqs[done].rsp )
+		{
+			len = reqs[done].len;
+			memset(reqs[done].rsp, 0xFF, len);
+			memcpy(reqs[done].rsp, frame + 2, len < flen - 3 ? len : flen - 3);
+		}
+
+		r = 0;
+		inflight -= SERIAL_REQ_ENC(&reqs[done]);
+		done++;
+	}
+
+end:
+	stats_add(STAT_SERIAL, start, r);
+
+	return r;
+}
+
+/* ======================================================================
+Function: serial_transaction
+Purpose : do one serial transaction on the opened device
+Input 	: program mode (MODE_xxx)
+					data buffer (command + data)
+					size of data
+Output	: value read from device (or 0 for write) or -1 if error
+Comments: device check is a ping get, as spi
+====================================================================== */
+int serial_transaction(int mode, unsigned char * data, int datasize)
+{
+	unsigned char ping = ARDUIPI_CMD_PING;
+	unsigned char rsp[2];
+	struct bus_get req = { data, 1, rsp, mode == MODE_GET_WORD ? 2 : 1 };
+
+	if ( mode == MODE_QUICK_ACK || mode == MODE_READ_ACK )
+		req.cmd = &ping;
+	else if ( mode == MODE_SET )
+	{
+		req.cmdlen = datasize;
+		req.rsp = NULL;
+		req.len = 0;
+	}
+
+	if ( serial_xfer(&req, 1) < 0 )
+		return -1;
+
+	if ( mode == MODE_SET )
+		return 0;
+
+	return mode == MODE_GET_WORD ? rsp[0] | (rsp[1] << 8 ) : rsp[0];
+}
+
+/* ======================================================================
+Function: serial_bulk
+Purpose : do a list of serial get byte commands, several outstanding
+Input 	: list of commands
+					buffer for values read
+					number of commands
+Output	: -1 if error
+Comments: -
+====================================================================== */
+int serial_bulk(unsigned char * cmds, unsigned char * values, int n)
+{
+	struct bus_get reqs[SERIAL_CHUNK];
+	int i, j, m;
+
+	for (i = 0; i < n; i += m)
+	{
+		m = n - i < SERIAL_CHUNK ? n - i : SERIAL_CHUNK;
+
+		for (j = 0; j < m; j++)
+		{
+			reqs[j].cmd = &cmds[i + j];
+			reqs[j].cmdlen = 1;
+			reqs[j].rsp = &values[i + j];
+			reqs[j].len = 1;
+		}
+
+		if ( serial_xfer(reqs, m) < 0 )
+			return -1;
+	}
+
+	return 0;
+}
+
+/* ======================================================================
+Function: serial_gets
+Purpose : do a list of serial get commands of any size, several outstanding
+Input 	: list of get commands
+					number of commands
+Output	: -1 if error
+Comments: -
+====================================================================== */
+int serial_gets(struct bus_get * gets, int n)
+{
+	return serial_xfer(gets, n);
+}
+
+/* ======================================================================
+Function: do_transaction
+Purpose : do one transaction with the selected transport
+Input 	: -
+Output	: -
+Comments: i2c has its own with ack messages, see do_i2c()
+====================================================================== */
+void do_transaction(void)
+{
+  int r=0;
+
+	bus_init();
+
+	r = bus_transaction(opts.mode, (unsigned char *) opts.data, opts.datasize);
+
+	// had a error ?
+	if ( r < 0 )
+	{
+		log_msg(LOG_ERR, stdout, "Error from %s transaction on device %s : %d %s\n", opts.proto_str, opts.port,  r, strerror(errno));
+		clean_exit( EXIT_FAILURE );
+	}
+	else
+	{
+		if (opts.hexout)
+			log_syslog(stdout, opts.mode == MODE_GET_WORD ? "0x%04X\n":"0x%02X\n", r);
+		else
+			log_syslog(stdout, "%d\n", r);
+		
+		clean_exit( EXIT_SUCCESS );
+	}
+}
+
+/* ======================================================================
+Function: sim_adc
+Purpose : simulated ADC sample
+Input 	: channel (0..5 for A0..A5, 6 for 1.1V reference)
+					sweep number of sample
+Output	: raw ADC value
+Comments: triangle of a different period on each input
+====================================================================== */
+uint16_t sim_adc(int ch, uint32_t sweep)
+{
+	uint32_t v;
+
+	// 1.1V with 5V reference
+	if ( ch == ARDUIPI_ADC_CHANNELS )
+		return 225;
+
+	v = (sweep * (ch + 1) * 8) & 2047;
+
+	return v < 1024 ? v : 2047 - v;
+}
+
+/* ======================================================================
+Function: sim_init
+Purpose : power up simulated board
+Input 	: -
+Output	: device handle (none)
+Comments: -
+====================================================================== */
+int sim_init(void)
+{
+	memset(&g_sim, 0, sizeof(g_sim));
+	g_sim.ping = ARDUIPI_PING_DEFAULT;
+	g_sim.twbr = ARDUIPI_TWBR_100KHZ;
+	g_sim.start = time_now();
+
+	return 0;
+}
+
+/* ======================================================================
+Function: sim_is_get
+Purpose : check if a command need a response, as firmware cmd_is_get()
+Input 	: command buffer (command + data)
+					size of command
+Output	: true if it's a get command
+Comments: a single byte, ADC drain or 1-Wire is a get command
+====================================================================== */
+int sim_is_get(const unsigned char * cmd, int len)
+{
+	return len == 1 || cmd[0] == ARDUIPI_CMD_ADC_DRAIN || cmd[0] == ARDUIPI_CMD_1WIRE || cmd[0] == ARDUIPI_CMD_1WIRE_ROM;
+}
+
+/* ======================================================================
+Function: sim_cmd
+Purpose : do a command on simulated board, as firmware parse_cmd()
+Input 	: command buffer (command + data)
+					size of command
+					response buffer (ARDUIPI_RSP_MAX_SIZE)
+Output	: size of response, 0 if none
+Comments: -
+====================================================================== */
+int sim_cmd(const unsigned char * cmd, int len, unsigned char * rsp)
+{
+	int is_get = sim_is_get(cmd, len);
+	unsigned char c = cmd[0];
+	uint32_t sweep, first;
+	uint8_t mask, old[3];
+	int i, n, ch, p;
+
+	// CRC protected frame, NAK if bad, get response get a CRC
+	// set is acknowledged
+	if ( c == ARDUIPI_CMD_CRC )
+	{
+		if ( len >= 3 && crc8(0, cmd, len - 1) == cmd[len - 1] )
+		{
+			is_get = sim_is_get(cmd + 1, len - 2);
+			n = sim_cmd(cmd + 1, len - 2, rsp);
+
+			if ( is_get )
+			{
+				rsp[n] = crc8(crc8(0, cmd + 1, 1), rsp, n);
+				return n + 1;
+			}
+		}
+
+		rsp[0] = len >= 3 && crc8(0, cmd, len - 1) == cmd[len - 1] ? ARDUIPI_CRC_ACK : ARDUIPI_CRC_NAK;
+		rsp[1] = crc8(crc8(0, &c, 1), rsp, 1);
+		return 2;
+	}
+
+	g_sim.cmds++;
+	memcpy(old, g_sim.port, sizeof(old));
+
+	// ping
+	if ( c == ARDUIPI_CMD_PING )
+	{
+		if ( is_get )
+		{
+			rsp[0] = g_sim.ping;
+			return 1;
+		}
+		g_sim.ping = cmd[1];
+	}
+	// arduino pin
+	else if ( c <= 0x12 )
+	{
+		p = pin_port(c, &mask);
+
+		if ( is_get )
+		{
+			rsp[0] = g_sim.port[p] & mask ? 1 : 0;
+			return 1;
+		}
+		// digitalWrite
+		else if ( len == 2 )
+		{
+			g_sim.port[p] = cmd[1] ? g_sim.port[p] | mask : g_sim.port[p] & ~mask;
+		}
+		// pinMode (INPUT, OUTPUT, INPUT_PULLUP)
+		else if ( len == 3 && cmd[1] == 0xdd )
+		{
+			g_sim.ddr[p] = cmd[2] == 1 ? g_sim.ddr[p] | mask : g_sim.ddr[p] & ~mask;
+
+			if ( cmd[2] != 1 )
+				g_sim.port[p] = cmd[2] == 2 ? g_sim.port[p] | mask : g_sim.port[p] & ~mask;
+		}
+	}
+	// AVR port
+	else if ( c >= 0x1b && c <= 0x1d )
+	{
+		p = c - 0x1b;
+
+		if ( is_get )
+		{
+			rsp[0] = g_sim.port[p];
+			return 1;
+		}
+		else if ( len == 4 && cmd[1] == ARDUIPI_PORT_MASKED )
+			g_sim.port[p] = (g_sim.port[p] & ~cmd[2]) | (cmd[3] & cmd[2]);
+		// firmware keep its IRQ line
+		else if ( p == 0 )
+			g_sim.port[p] = (g_sim.port[p] & ARDUIPI_FIRMWARE_PORTB) | (cmd[1] & ~ARDUIPI_FIRMWARE_PORTB);
+		else
+			g_sim.port[p] = cmd[1];
+	}
+	// AVR DDR
+	else if ( c >= 0x2b && c <= 0x2d )
+	{
+		p = c - 0x2b;
+
+		if ( is_get )
+		{
+			rsp[0] = g_sim.ddr[p];
+			return 1;
+		}
+		else if ( len == 2 )
+		{
+			g_sim.ddr[p] = cmd[1];
+		}
+		else if ( len == 3 && cmd[1] <= 7 )
+		{
+			mask = 1 << cmd[1];
+			g_sim.ddr[p] = cmd[2] ? g_sim.ddr[p] | mask : g_sim.ddr[p] & ~mask;
+		}
+		else if ( len == 4 && cmd[1] == ARDUIPI_DDR_MASKED )
+		{
+			g_sim.ddr[p] = (g_sim.ddr[p] & ~cmd[2]) | (cmd[3] & cmd[2]);
+		}
+	}
+	// analog, arduino or AVR, A6 is vcc in mV
+	else if ( (c >= 0xa0 && c <= 0xa6) || (c >= 0xc0 && c <= 0xc6) )
+	{
+		if ( is_get )
+		{
+			ch = c & 0x0f;
+			sweep = (time_now() - g_sim.start) * ARDUIPI_ADC_SAMPLE_HZ / ARDUIPI_ADC_SCAN_CHANNELS;
+			i = ch == ARDUIPI_ADC_CHANNELS ? 5000 : sim_adc(ch, sweep);
+
+			rsp[0] = i & 0xFF;
+			rsp[1] = (i >> 8) & 0xFF;
+			return 2;
+		}
+	}
+	// snapshot, same layout as firmware
+	else if ( c == ARDUIPI_CMD_SNAPSHOT )
+	{
+		if ( is_get )
+		{
+			sweep = (time_now() - g_sim.start) * ARDUIPI_ADC_SAMPLE_HZ / ARDUIPI_ADC_SCAN_CHANNELS;
+
+			rsp[0] = g_sim.seq++;
+			for (p = 0; p < 3; p++)
+			{
+				rsp[1 + p] = g_sim.port[p];
+				rsp[4 + p] = g_sim.ddr[p];
+			}
+			rsp[7] = 5000 & 0xFF;
+			rsp[8] = 5000 >> 8;
+
+			for (ch = 0; ch < ARDUIPI_ADC_CHANNELS; ch++)
+			{
+				i = sim_adc(ch, sweep);
+				rsp[9 + 2*ch] = i & 0xFF;
+				rsp[10 + 2*ch] = (i >> 8) & 0xFF;
+			}
+			return ARDUIPI_SNAPSHOT_SIZE;
+		}
+	}
+	// performance counters, simulator only count commands, as i2c ones
+	else if ( c == ARDUIPI_CMD_PERF )
+	{
+		if ( !is_get )
+		{
+			g_sim.cmds = 0;
+			return 0;
+		}
+
+		// one sweep of all channels
+		i = 1000000 / ARDUIPI_ADC_SAMPLE_HZ * ARDUIPI_ADC_SCAN_CHANNELS;
+
+		memset(rsp, 0, ARDUIPI_PERF_SIZE);
+		rsp[0] = g_sim.cmds & 0xFF;
+		rsp[1] = (g_sim.cmds >> 8) & 0xFF;
+		rsp[18] = rsp[20] = i & 0xFF;
+		rsp[19] = rsp[21] = (i >> 8) & 0xFF;
+		return ARDUIPI_PERF_SIZE;
+	}
+	// i2c speed, TWBR and its complement
+	else if ( c == ARDUIPI_CMD_I2C_SPEED )
+	{
+		if ( is_get )
+		{
+			rsp[0] = g_sim.twbr;
+			rsp[1] = ~g_sim.twbr;
+			return 2;
+		}
+		else if ( len == 2 && cmd[1] >= 10 )
+		{
+			g_sim.twbr = cmd[1];
+		}
+	}
+	// input changes, port writes of watched pins are seen as changes
+	else if ( c == ARDUIPI_CMD_WATCH )
+	{
+		if ( is_get )
+		{
+			rsp[0] = g_sim.changes;
+			for (p = 0; p < 3; p++)
+			{
+				rsp[1 + p] = g_sim.changed[p];
+				rsp[4 + p] = g_sim.port[p];
+				g_sim.changed[p] = 0;
+			}
+			g_sim.changes = 0;
+			return ARDUIPI_WATCH_SIZE;
+		}
+		else if ( len == 4 )
+		{
+			memcpy(g_sim.watch, cmd + 1, 3);
+		}
+	}
+	// 1-Wire temperatures, SIM_1WIRE sensors slowly warming up
+	else if ( c == ARDUIPI_CMD_1WIRE )
+	{
+		first = len == 2 && cmd[1] != ARDUIPI_1WIRE_RESCAN ? cmd[1] : 0;
+		if ( len == 2 && cmd[1] == ARDUIPI_1WIRE_RESCAN )
+			g_sim.ow_search++;
+
+		sweep = (time_now() - g_sim.start) / 0.75;
+		rsp[0] = SIM_1WIRE;
+		rsp[1] = sweep;
+		rsp[2] = g_sim.ow_search;
+		rsp[3] = first;
+
+		for (i = 0; i < ARDUIPI_1WIRE_PAGE; i++)
+		{
+			n = first + i < SIM_1WIRE ? (20 + first + i) * 16 + sweep % 16 : ARDUIPI_1WIRE_NONE;
+			rsp[4 + 2 * i] = n & 0xFF;
+			rsp[5 + 2 * i] = (n >> 8) & 0xFF;
+		}
+		return ARDUIPI_1WIRE_PAGE_SIZE;
+	}
+	else if ( c == ARDUIPI_CMD_1WIRE_ROM )
+	{
+		if ( len == 2 && cmd[1] < SIM_1WIRE )
+		{
+			// DS18B20 family, serial is sensor number
+			memset(rsp, 0, 8);
+			rsp[0] = 0x28;
+			rsp[1] = cmd[1];
+			return 8;
+		}
+	}
+	// ADC drain, samples taken since last drain, 16 kept as firmware
+	else if ( c == ARDUIPI_CMD_ADC_DRAIN )
+	{
+		if ( len == 2 && cmd[1] < ARDUIPI_ADC_SCAN_CHANNELS )
+		{
+			ch = cmd[1];
+			sweep = (time_now() - g_sim.start) * ARDUIPI_ADC_SAMPLE_HZ / ARDUIPI_ADC_SCAN_CHANNELS;
+			n = sweep - g_sim.drained[ch];
+
+			rsp[2] = 0;
+			if ( n > 16 )
+			{
+				rsp[2] = n - 16 > 0xFF ? 0xFF : n - 16;
+				g_sim.drained[ch] += n - 16;
+				n = 16;
+			}
+			if ( n > ARDUIPI_ADC_DRAIN_MAX )
+				n = ARDUIPI_ADC_DRAIN_MAX;
+
+			first = g_sim.drained[ch];
+			rsp[0] = ch;
+			rsp[1] = n;
+			rsp[3] = first & 0xFF;
+			rsp[4] = (first >> 8) & 0xFF;
+
+			for (i = 0; i < n; i++)
+			{
+				rsp[5 + 2*i] = sim_adc(ch, first + i) & 0xFF;
+				rsp[6 + 2*i] = (sim_adc(ch, first + i) >> 8) & 0xFF;
+			}
+
+			g_sim.drained[ch] += n;
+			return 5 + 2*n;
+		}
+	}
+
+	// watched pins written, as firmware pin change interrupt
+	for (p = 0; p < 3; p++)
+	{
+		if ( (mask = (old[p] ^ g_sim.port[p]) & g_sim.watch[p]) )
+		{
+			g_sim.changed[p] |= mask;
+			if ( g_sim.changes < 0xFF )
+				g_sim.changes++;
+		}
+	}
+
+	return 0;
+}
+
+/* ======================================================================
+Function: sim_get
+Purpose : do a get command on simulated board
+Input 	: command buffer (command + data)
+					size of command
+					response buffer
+					size of response
+Output	: 0
+Comments: bytes not sent by board are read as 0xFF like a real bus
+====================================================================== */
+int sim_get(unsigned char * cmd, int cmdlen, unsigned char * rsp, int len)
+{
+	unsigned char buf[ARDUIPI_RSP_MAX_SIZE];
+	int n;
+
+	if ( len > ARDUIPI_RSP_MAX_SIZE || cmdlen < 1 )
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	n = sim_cmd(cmd, cmdlen, buf);
+
+	memset(rsp, 0xFF, len);
+	memcpy(rsp, buf, n < len ? n : len);
+
+	return 0;
+}
+
+/* ======================================================================
+Function: sim_transaction
+Purpose : do one transaction on simulated board
+Input 	: program mode (MODE_xxx)
+					data buffer (command + data)
+					size of data
+Output	: value read from board (or 0 for write) or -1 if error
+Comments: -
+====================================================================== */
+int sim_transaction(int mode, unsigned char * data, int datasize)
+{
+	unsigned char ping = ARDUIPI_CMD_PING;
+	unsigned char rsp[2];
+
+	if ( mode == MODE_QUICK_ACK )
+		return 0;
+
+	if ( mode == MODE_READ_ACK )
+	{
+		sim_get(&ping, 1, rsp, 1);
+		return rsp[0];
+	}
+
+	if ( mode == MODE_GET || mode == MODE_GET_WORD )
+	{
+		sim_get(data, 1, rsp, 2);
+		return mode == MODE_GET ? rsp[0] : rsp[0] | (rsp[1] << 8 );
+	}
+
+	if ( mode == MODE_SET && datasize >= 1 && datasize <= ARDUIPI_CMD_MAX_SIZE )
+	{
+		sim_cmd(data, datasize, rsp);
+		return 0;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+/* ======================================================================
+Function: sim_bulk
+Purpose : do a list of get byte commands on simulated board
+Input 	: list of commands
+					buffer for values read
+					number of commands
+Output	: -1 if error
+Comments: -
+====================================================================== */
+int sim_bulk(unsigned char * cmds, unsigned char * values, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		sim_get(&cmds[i], 1, &values[i], 1);
+
+	return 0;
+}
+
+/* ======================================================================
+Function: sim_gets
+Purpose : do a list of get commands of any size on simulated board
+Input 	: list of get commands
+					number of commands
+Output	: -1 if error
+Comments: -
+====================================================================== */
+int sim_gets(struct bus_get * gets, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if ( sim_get(gets[i].cmd, gets[i].cmdlen, gets[i].rsp, gets[i].len) < 0 )
+			return -1;
+	}
+
+	return 0;
+}
+
+/* ======================================================================
+Function: do_bulk
+Purpose : bulk mode, read all commands given in data in one shot
+Input 	: -
+Output	: -
+Comments: one result line per command byte
+====================================================================== */
+void do_bulk(void)
+{
+	unsigned char values[BUFFER_SIZE];
+	int i;
+
+	if ( opts.datasize < 1 )
+		fatal( "bulk mode need commands in --data");
+
+	bus_init();
+
+	if ( bus_bulk((unsigned char *) opts.data, values, opts.datasize) < 0 )
+	{
+		log_msg(LOG_ERR, stdout, "Error from bulk transfer on device %s : %s\n", opts.port, strerror(errno));
+		clean_exit( EXIT_FAILURE );
+	}
+
+	for (i = 0; i < opts.datasize; i++)
+		log_syslog(stdout, opts.hexout ? "0x%02X\n":"%d\n", values[i]);
+
+	clean_exit( EXIT_SUCCESS );
+}
+
+/* ======================================================================
+Function: bus_snapshot
+Purpose : read a snapshot of all board I/O in one transaction
+Input 	: raw snapshot buffer to fill (ARDUIPI_SNAPSHOT_SIZE)
+Output	: -1 if error
+Comments: -
+====================================================================== */
+int bus_snapshot(unsigned char * raw)
+{
+	unsigned char cmd = ARDUIPI_CMD_SNAPSHOT;
+	struct bus_get get = { &cmd, 1, raw, ARDUIPI_SNAPSHOT_SIZE };
+
+	return bus_gets(&get, 1);
+}
+
+/* ======================================================================
+Function: snapshot_decode
+Purpose : decode a raw snapshot sent by the firmware
+Input 	: raw snapshot buffer
+					snapshot to fill
+Output	: -
+Comments: all words are LSB first
+====================================================================== */
+void snapshot_decode(unsigned char * raw, struct arduipi_snapshot * snap)
+{
+	int i;
+
+	snap->seq = raw[0];
+
+	for (i = 0; i < 3; i++)
+	{
+		snap->pin[i] = raw[1 + i];
+		snap->ddr[i] = raw[4 + i];
+	}
+
+	snap->vcc = raw[7] | (raw[8] << 8);
+
+	for (i = 0; i < ARDUIPI_ADC_CHANNELS; i++)
+		snap->adc[i] = raw[9 + 2*i] | (raw[10 + 2*i] << 8);
+}
+
+/* ======================================================================
+Function: do_snapshot
+Purpose : snapshot mode, read and display all board I/O
+Input 	: -
+Output	: -
+Comments: -
+====================================================================== */
+void do_snapshot(void)
+{
+	unsigned char raw[ARDUIPI_SNAPSHOT_SIZE];
+	struct arduipi_snapshot snap;
+	int i;
+
+	bus_init();
+
+	if ( bus_snapshot(raw) < 0 )
+	{
+		log_msg(LOG_ERR, stdout, "Error reading snapshot on device %s : %s\n", opts.port, strerror(errno));
+		clean_exit( EXIT_FAILURE );
+	}
+
+	snapshot_decode(raw, &snap);
+
+	log_syslog(stdout, "seq  : %d\n", snap.seq);
+
+	for (i = 0; i < 3; i++)
+		log_syslog(stdout, "pin%c : 0x%02X  ddr%c : 0x%02X\n", 'b' + i, snap.pin[i], 'b' + i, snap.ddr[i]);
+
+	log_syslog(stdout, "vcc  : %d mV\n", snap.vcc);
+
+	for (i = 0; i < ARDUIPI_ADC_CHANNELS; i++)
+		log_syslog(stdout, opts.hexout ? "a%d   : 0x%04X\n" : "a%d   : %d\n", i, snap.adc[i]);
+
+	clean_exit( EXIT_SUCCESS );
+}
+
+/* ======================================================================
+Function: ow_gets
+Purpose : prepare get commands of all 1-Wire temperatures pages
+Input 	: get commands to fill (ARDUIPI_1WIRE_PAGES)
+					commands buffer
+					responses buffer
+Output	: -
+Comments: -
+====================================================================== */
+void ow_gets(struct bus_get * gets, unsigned char cmd[][2], unsigned char raw[][ARDUIPI_1WIRE_PAGE_SIZE])
+{
+	int p;
+
+	for (p = 0; p < ARDUIPI_1WIRE_PAGES; p++)
+	{
+		cmd[p][0] = ARDUIPI_CMD_1WIRE;
+		cmd[p][1] = p * ARDUIPI_1WIRE_PAGE;
+		gets[p].cmd = cmd[p];
+		gets[p].cmdlen = 2;
+		gets[p].rsp = raw[p];
+		gets[p].len = ARDUIPI_1WIRE_PAGE_SIZE;
+	}
+}
+
+/* ======================================================================
+Function: ow_decode
+Purpose : decode all 1-Wire temperatures pages
+Input 	: pages received
+					temperatures to fill
+Output	: -
+Comments: page layout is
+					0     : sensors enumerated
+					1     : conversion round of temperatures
+					2     : searches done
+					3     : first sensor of page
+					4..29 : temperatures (1/16 C), LSB first
+====================================================================== */
+void ow_decode(unsigned char raw[][ARDUIPI_1WIRE_PAGE_SIZE], struct arduipi_1wire * ow)
+{
+	int p, i, n;
+
+	ow->count = raw[0][0] > ARDUIPI_1WIRE_MAX ? ARDUIPI_1WIRE_MAX : raw[0][0];
+	ow->seq = raw[0][1];
+	ow->search = raw[0][2];
+
+	for (p = 0; p < ARDUIPI_1WIRE_PAGES; p++)
+	{
+		for (i = 0; i < ARDUIPI_1WIRE_PAGE; i++)
+		{
+			n = p * ARDUIPI_1WIRE_PAGE + i;
+
+			if ( n < ARDUIPI_1WIRE_MAX )
+				ow->temp[n] = raw[p][4 + 2 * i] | (raw[p][5 + 2 * i] << 8);
+		}
+	}
+}
+
+/* ======================================================================
+Function: bus_1wire
+Purpose : get all 1-Wire temperatures
+Input 	: temperatures to fill
+Output	: -1 if error
+Comments: all pages in one bus call, firmware send what it read at last
+					conversion round, it never wait for sensors
+====================================================================== */
+int bus_1wire(struct arduipi_1wire * ow)
+{
+	unsigned char cmd[ARDUIPI_1WIRE_PAGES][2];
+	unsigned char raw[ARDUIPI_1WIRE_PAGES][ARDUIPI_1WIRE_PAGE_SIZE];
+	struct bus_get gets[ARDUIPI_1WIRE_PAGES];
+
+	ow_gets(gets, cmd, raw);
+
+	if ( bus_gets(gets, ARDUIPI_1WIRE_PAGES) < 0 )
+		return -1;
+
+	ow_decode(raw, ow);
+
+	return 0;
+}
+
+/* ======================================================================
+Function: bus_1wire_rom
+Purpose : get ROM codes of 1-Wire sensors
+Input 	: temperatures with sensors count
+Output	: -1 if error
+Comments: they only change when sensors are searched again
+====================================================================== */
+int bus_1wire_rom(struct arduipi_1wire * ow)
+{
+	unsigned char cmd[ARDUIPI_1WIRE_MAX][2];
+	struct bus_get gets[ARDUIPI_1WIRE_MAX];
+	int i;
+
+	for (i = 0; i < ow->count; i++)
+	{
+		cmd[i][0] = ARDUIPI_CMD_1WIRE_ROM;
+		cmd[i][1] = i;
+		gets[i].cmd = cmd[i];
+		gets[i].cmdlen = 2;
+		gets[i].rsp = ow->rom[i];
+		gets[i].len = 8;
+	}
+
+	return ow->count ? bus_gets(gets, ow->count) : 0;
+}
+
+/* ======================================================================
+Function: do_temps
+Purpose : show 1-Wire temperatures
+Input 	: -
+Output	: -
+Comments: one line per sensor : ROM code and temperature
+					--data 0xff ask firmware to search sensors again
+====================================================================== */
+void do_temps(void)
+{
+	unsigned char cmd[2] = { ARDUIPI_CMD_1WIRE, ARDUIPI_1WIRE_RESCAN };
+	unsigned char raw[ARDUIPI_1WIRE_PAGE_SIZE];
+	struct bus_get get = { cmd, 2, raw, ARDUIPI_1WIRE_PAGE_SIZE };
+	struct arduipi_1wire ow;
+	int i, j;
+
+	bus_init();
+
+	if ( opts.datasize == 1 && (unsigned char) opts.data[0] == ARDUIPI_1WIRE_RESCAN )
+	{
+		if ( bus_gets(&get, 1) < 0 )
+		{
+			log_msg(LOG_ERR, stdout, "Error starting 1-Wire search on device %s : %s\n", opts.port, strerror(errno));
+			clean_exit( EXIT_FAILURE );
+		}
+
+		clean_exit( EXIT_SUCCESS );
+	}
+
+	if ( bus_1wire(&ow) < 0 || bus_1wire_rom(&ow) < 0 )
+	{
+		log_msg(LOG_ERR, stdout, "Error reading 1-Wire temperatures on device %s : %s\n", opts.port, strerror(errno));
+		clean_exit( EXIT_FAILURE );
+	}
+
+	if (opts.verbose)
+		printf("%d sensors, conversion round %d\n", ow.count, ow.seq);
+
+	for (i = 0; i < ow.count; i++)
+	{
+		for (j = 0; j < 8; j++)
+			printf("%02X", ow.rom[i][j]);
+
+		if ( ow.temp[i] == ARDUIPI_1WIRE_NONE )
+			printf(" -\n");
+		else
+			printf(" %.4f\n", ow.temp[i] / 16.0);
+	}
+
+	clean_exit( EXIT_SUCCESS );
+}
+
+/* ======================================================================
+Function: shm_create
+Purpose : create and map board state shared memory segment
+Input 	: -
+Output	: segment
+Comments: segment is kept after exit so readers still see last state,
+					a lock on it make sure only one arduipi publish
+====================================================================== */
+struct arduipi_shm * shm_create(void)
+{
+	struct arduipi_shm * shm;
+	int fd;
+
+	if ( (fd = shm_open(opts.shm, O_CREAT | O_RDWR, 0644)) < 0 )
+		fatal( "shm %s : %s", opts.shm, strerror(errno));
+
+	// lock stay while fd is opened, until we exit
+	if ( flock(fd, LOCK_EX | LOCK_NB) < 0 )
+		fatal( "shm %s already published by another process : %s", opts.shm, strerror(errno));
+
+	if ( ftruncate(fd, sizeof(*shm)) < 0 )
+		fatal( "shm %s : %s", opts.shm, strerror(errno));
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	if ( shm == MAP_FAILED )
+		fatal( "shm %s : %s", opts.shm, strerror(errno));
+
+	// incompatible readers refuse it until header is written
+	shm->magic = 0;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memset(shm, 0, sizeof(*shm));
+	shm->version = ARDUIPI_SHM_VERSION;
+	shm->size = sizeof(*shm);
+	shm->period_ms = opts.period;
+	shm->owner = getpid();
+	__atomic_store_n(&shm->magic, ARDUIPI_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	return shm;
+}
+
+/* ======================================================================
+Function: shm_publish
+Purpose : write board state in shared memory segment
+Input 	: segment
+					new state
+Output	: -
+Comments: sequence lock, odd while state is written
+====================================================================== */
+void shm_publish(struct arduipi_shm * shm, struct arduipi_shm_state * st)
+{
+	uint32_t seq = shm->seq;
+
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(&shm->state, st, sizeof(*st));
+
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* ======================================================================
+Function: do_shm
+Purpose : shm mode, publish board state in shared memory
+Input 	: -
+Output	: -
+Comments: snapshot, PORT registers and 1-Wire temperatures in one bus 
+					call each period, readers get them without talking to the bus
+					ROM codes are read again when firmware did a new search,
+					a same count of sensors may be other probes
+====================================================================== */
+void do_shm(void)
+{
+	unsigned char raw[ARDUIPI_SNAPSHOT_SIZE];
+	unsigned char cmd[4] = { ARDUIPI_CMD_SNAPSHOT, 0x1b, 0x1c, 0x1d };
+	unsigned char port[3];
+	unsigned char ow_cmd[ARDUIPI_1WIRE_PAGES][2];
+	unsigned char ow_raw[ARDUIPI_1WIRE_PAGES][ARDUIPI_1WIRE_PAGE_SIZE];
+	struct bus_get gets[4 + ARDUIPI_1WIRE_PAGES] = 
+	{
+		{ &cmd[0], 1, raw, ARDUIPI_SNAPSHOT_SIZE },
+		{ &cmd[1], 1, &port[0], 1 }, { &cmd[2], 1, &port[1], 1 }, { &cmd[3], 1, &port[2], 1 }
+	};
+	struct arduipi_snapshot snap;
+	struct arduipi_shm_state st;
+	struct arduipi_shm * shm;
+	struct arduipi_1wire ow;
+	struct timespec next;
+	int search = -1;
+	int i;
+
+	ow_gets(gets + 4, ow_cmd, ow_raw);
+	memset(&ow, 0, sizeof(ow));
+
+	bus_init();
+	shm = shm_create();
+	memset(&st, 0, sizeof(st));
+
+	if (opts.verbose)
+		printf("shm           : %s (%d bytes)\n", opts.shm, (int) sizeof(*shm));
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while ( !g_exit_pgm )
+	{
+		stats_tick();
+
+		if ( bus_gets(gets, 4 + ARDUIPI_1WIRE_PAGES) < 0 )
+		{
+			st.errors++;
+
+			if (opts.verbose)
+				log_msg(LOG_ERR, stderr, "Error reading state on device %s : %s\n", opts.port, strerror(errno));
+		}
+		else
+		{
+			snapshot_decode(raw, &snap);
+
+			st.updates++;
+			st.seq = snap.seq;
+			st.vcc = snap.vcc;
+
+			for (i = 0; i < 3; i++)
+			{
+				st.pin[i] = snap.pin[i];
+				st.ddr[i] = snap.ddr[i];
+				st.port[i] = port[i];
+			}
+
+			for (i = 0; i < ARDUIPI_SHM_ADC; i++)
+				st.adc[i] = snap.adc[i];
+
+			// sensors searched again, get their new ROM codes, a search
+			// running while we read them change search so we read again
+			i = ow.count;
+			ow_decode(ow_raw, &ow);
+
+			if ( ow.search != search || ow.count != i )
+			{
+				if ( bus_1wire_rom(&ow) < 0 )
+				{
+					st.errors++;
+					ow.count = 0;
+					search = -1;
+				}
+				else
+					search = ow.search;
+			}
+
+			st.ow_count = ow.count > ARDUIPI_SHM_1W_MAX ? ARDUIPI_SHM_1W_MAX : ow.count;
+			st.ow_seq = ow.seq;
+			st.ow_search = ow.search;
+
+			for (i = 0; i < ARDUIPI_SHM_1W_MAX; i++)
+			{
+				st.ow_temp[i] = i < st.ow_count ? ow.temp[i] : ARDUIPI_1WIRE_NONE;
+				memcpy(st.ow_addr[i], ow.rom[i], 8);
+			}
+		}
+
+		st.time_ns = (uint64_t) (time_now() * 1e9);
+		shm_publish(shm, &st);
+
+		next.tv_nsec += opts.period % 1000 * 1000000L;
+		next.tv_sec += opts.period / 1000;
+		if ( next.tv_nsec >= 1000000000L )
+		{
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	// readers can see state is no more updated
+	shm->owner = 0;
+	munmap(shm, sizeof(*shm));
+
+	clean_exit( EXIT_SUCCESS );
+}
+
+/* ======================================================================
+Function: perf_decode
+Purpose : decode raw performance counters sent by the firmware
+Input 	: raw performance counters buffer
+					performance counters to fill
+Output	: -
+Comments: all values are LSB first
+====================================================================== */
+void perf_decode(unsigned char * raw, struct arduipi_perf * perf)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		perf->cmd[i] = raw[2*i] | (raw[1 + 2*i] << 8);
+		perf->overflow[i] = raw[6 + 2*i] | (raw[7 + 2*i] << 8);
+	}
+
+	perf->parse_max = raw[12] | (raw[13] << 8);
+	perf->loop_max = raw[14] | (raw[15] << 8) | (raw[16] << 16) | ((uint32_t) raw[17] << 24);
+	perf->sweep = raw[18] | (raw[19] << 8);
+	perf->sweep_max = raw[20] | (raw[21] << 8);
+	perf->adc_dropped = raw[22] | (raw[23] << 8);
+	perf->dispatch_max = raw[24] | (raw[25] << 8);
+	perf->crc_err = raw[26] | (raw[27] << 8);
+}
+
+/* ======================================================================
+Function: do_perf
+Purpose : perf mode, read and display firmware performance counters
+Input 	: -
+Output	: -
+Comments: counters wrap, clear them with a set command (0xe3 0x00)
+====================================================================== */
+void do_perf(void)
+{
+	unsigned char raw[ARDUIPI_PERF_SIZE];
+	unsigned char cmd = ARDUIPI_CMD_PERF;
+	struct bus_get get = { &cmd, 1, raw, ARDUIPI_PERF_SIZE };
+	struct arduipi_perf perf;
+
+	bus_init();
+
+	if ( bus_gets(&get, 1) < 0 )
+	{
+		log_msg(LOG_ERR, stdout, "Error reading performance counters on device %s : %s\n", opts.port, strerror(errno));
+		clean_exit( EXIT_FAILURE );
+	}
+
+	perf_decode(raw, &perf);
+
+	log_syslog(stdout, "commands    : i2c %u spi %u serial %u\n", perf.cmd[0], perf.cmd[1], perf.cmd[2]);
+	log_syslog(stdout, "overflows   : i2c %u spi %u serial %u\n", perf.overflow[0], perf.overflow[1], perf.overflow[2]);
+	log_syslog(stdout, "parse max   : %u us\n", perf.parse_max);
+	log_syslog(stdout, "loop max    : %u us\n", perf.loop_max);
+	log_syslog(stdout, "adc sweep   : %u us (max %u us)\n", perf.sweep, perf.sweep_max);
+	log_syslog(stdout, "adc dropped : %u\n", perf.adc_dropped);
+	log_syslog(stdout, "dispatch max: %u us\n", perf.dispatch_max);
+	log_syslog(stdout, "crc errors  : %u\n", perf.crc_err);
+
+	clean_exit( EXIT_SUCCESS );
+}
+
+/* ======================================================================
+Function: gpio_sysfs_write
+Purpose : write a value in a GPIO sysfs file
+Input 	: file name in GPIO sysfs directory
+					value to write
+Output	: -1 if error
+Comments: -
+====================================================================== */
+int gpio_sysfs_write(const char * name, const char * value)
+{
+	char path[128];
+	int fd, r;
+
+	snprintf(path, sizeof(path), GPIO_SYSFS "/%s", name);
+
+	if ( (fd = open(path, O_WRONLY)) < 0 )
+		return -1;
+
+	r = write(fd, value, strlen(value));
+	close(fd);
+
+	return r < 0 ? -1 : 0;
+}
+
+/* ======================================================================
+Function: gpio_irq_open
+Purpose : request rising edge events of a GPIO input
+Input 	: GPIO line events to fill
+					GPIO number
+Output	: -1 if error
+Comments: character device if kernel has it, else sysfs (export, 
+					direction and edge), sysfs value fd signal edges with POLLPRI
+====================================================================== */
+int gpio_irq_open(struct gpio_line * irq, int gpio)
+{
+	struct gpioevent_request req;
+	char name[64], value[8];
+	int fd;
+
+	if ( (fd = open(GPIO_CHIP, O_RDONLY)) >= 0 )
+	{
+		memset(&req, 0, sizeof(req));
+		req.lineoffset = gpio;
+		req.handleflags = GPIOHANDLE_REQUEST_INPUT;
+		req.eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+		strcpy(req.consumer_label, PRG_NAME);
+
+		if ( ioctl(fd, GPIO_GET_LINEEVENT_IOCTL, &req) < 0 )
+		{
+			close(fd);
+			return -1;
+		}
+
+		close(fd);
+		irq->fd = req.fd;
+		irq->chardev = true;
+		return 0;
+	}
+
+	// already exported is not an error
+	snprintf(value, sizeof(value), "%d", gpio);
+	gpio_sysfs_write("export", value);
+
+	snprintf(name, sizeof(name), "gpio%d/direction", gpio);
+	if ( gpio_sysfs_write(name, "in") < 0 )
+		return -1;
+
+	snprintf(name, sizeof(name), "gpio%d/edge", gpio);
+	if ( gpio_sysfs_write(name, "rising") < 0 )
+		return -1;
+
+	snprintf(name, sizeof(name), GPIO_SYSFS "/gpio%d/value", gpio);
+	if ( (irq->fd = open(name, O_RDONLY)) < 0 )
+		return -1;
+
+	irq->chardev = false;
+
+	return 0;
+}
+
+/* ======================================================================
+Function: gpio_irq_level
+Purpose : read level of a GPIO line opened for events
+Input 	: GPIO line events
+Output	: 0 or 1, -1 if error
+Comments: also rearm sysfs edge detection
+====================================================================== */
+int gpio_irq_level(struct gpio_line * irq)
+{
+	struct gpiohandle_data data;
+	char c;
+
+	if ( irq->chardev )
+	{
+		if ( ioctl(irq->fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0 )
+			return -1;
+
+		return data.values[0] ? 1 : 0;
+	}
+
+	if ( lseek(irq->fd, 0, SEEK_SET) < 0 || read(irq->fd, &c, 1) != 1 )
+		return -1;
+
+	return c == '1';
+}
+
+/* ======================================================================
+Function: gpio_irq_wait
+Purpose : wait a rising edge of a GPIO line
+Input 	: GPIO line events
+					timeout (ms)
+Output	: 1 if edge, 0 if timeout, -1 if error
+Comments: all pending edges are consumed, one read serve them all
+====================================================================== */
+int gpio_irq_wait(struct gpio_line * irq, int timeout)
+{
+	struct gpioevent_data ev;
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = irq->fd;
+	pfd.events = irq->chardev ? POLLIN : POLLPRI | POLLERR;
+
+	if ( (r = poll(&pfd, 1, timeout)) <= 0 )
+		return r;
+
+	if ( !irq->chardev )
+		return gpio_irq_level(irq) < 0 ? -1 : 1;
+
+	do
+	{
+		if ( read(irq->fd, &ev, sizeof(ev)) != sizeof(ev) )
+			return -1;
+
+		pfd.revents = 0;
+	}
+	while ( poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN) );
+
+	return 1;
+}
+
+/* ======================================================================
+Function: gpio_out_open
+Purpose : request a GPIO as output
+Input 	: GPIO line to fill
+					GPIO number
+					initial level
+Output	: -1 if error
+Comments: character device if kernel has it, else sysfs, level is set 
+					with direction so line never glitches
+====================================================================== */
+int gpio_out_open(struct gpio_line * line, int gpio, int level)
+{
+	struct gpiohandle_request req;
+	char name[64], value[8];
+	int fd;
+
+	if ( (fd = open(GPIO_CHIP, O_RDONLY)) >= 0 )
+	{
+		memset(&req, 0, sizeof(req));
+		req.lineoffsets[0] = gpio;
+		req.lines = 1;
+		req.flags = GPIOHANDLE_REQUEST_OUTPUT;
+		req.default_values[0] = level;
+		strcpy(req.consumer_label, PRG_NAME);
+
+		if ( ioctl(fd, GPIO_GET_LINEHANDLE_IOCTL, &req) < 0 )
+		{
+			close(fd);
+			return -1;
+		}
+
+		close(fd);
+		line->fd = req.fd;
+		line->chardev = true;
+		return 0;
+	}
+
+	// already exported is not an error
+	snprintf(value, sizeof(value), "%d", gpio);
+	gpio_sysfs_write("export", value);
+
+	snprintf(name, sizeof(name), "gpio%d/direction", gpio);
+	if ( gpio_sysfs_write(name, level ? "high" : "low") < 0 )
+		return -1;
+
+	snprintf(name, sizeof(name), GPIO_SYSFS "/gpio%d/value", gpio);
+	if ( (line->fd = open(name, O_WRONLY)) < 0 )
+		return -1;
+
+	line->chardev = false;
+
+	return 0;
+}
+
+/* ======================================================================
+Function: gpio_out_set
+Purpose : set level of a GPIO output
+Input 	: GPIO line
+					level
+Output	: -1 if error
+Comments: -
+====================================================================== */
+int gpio_out_set(struct gpio_line * line, int level)
+{
+	struct gpiohandle_data data;
+
+	if ( line->chardev )
+	{
+		memset(&data, 0, sizeof(data));
+		data.values[0] = level;
+
+		return ioctl(line->fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data);
+	}
+
+	return write(line->fd, level ? "1" : "0", 1) == 1 ? 0 : -1;
+}
+
+/* ======================================================================
+Function: do_watch
+Purpose : watch mode, show inputs changes notified by firmware IRQ line
+Input 	: -
+Output	: -
+Comments: inputs masks of port B, C, D are given with --data, IRQ line
+					is also checked on timeout in case an edge was lost
+====================================================================== */
+void do_watch(void)
+{
+	unsigned char cmd[4] = { ARDUIPI_CMD_WATCH, ARDUIPI_WATCH_DEFAULT };
+	unsigned char raw[ARDUIPI_WATCH_SIZE];
+	struct bus_get get = { cmd, 1, raw, ARDUIPI_WATCH_SIZE };
+	struct gpio_line irq;
+	double edge, start;
+	int i, r;
+
+	if ( opts.datasize == 3 )
+		memcpy(cmd + 1, opts.data, 3);
+	else if ( opts.datasize )
+		fatal( "do_watch : --data must be masks of port B, C and D (3 bytes)");
+
+	bus_init();
+
+	if ( opts.gpio < 0 )
+		opts.gpio = GPIO_IRQ;
+
+	if ( gpio_irq_open(&irq, opts.gpio) < 0 )
+		fatal( "do_watch GPIO %d : %s", opts.gpio, strerror(errno));
+
+	if ( bus_transaction(MODE_SET, cmd, sizeof(cmd)) < 0 )
+		fatal( "do_watch error setting masks on device %s : %s", opts.port, strerror(errno));
+
+	start = time_now();
+	edge = 0;
+
+	// first get clear changes pending before masks were set
+	while ( !g_exit_pgm )
+	{
+		stats_tick();
+
+		if ( bus_gets(&get, 1) < 0 )
+		{
+			log_msg(LOG_ERR, stderr, "Error reading changes on device %s : %s\n", opts.port, strerror(errno));
+		}
+		else if ( edge )
+		{
+			printf("%.6f changes %3d", edge - start, raw[0]);
+
+			for (i = 0; i < 3; i++)
+				if ( cmd[1 + i] )
+					printf("  pin%c 0x%02X/0x%02X", 'b' + i, raw[1 + i], raw[4 + i]);
+
+			printf("  %.0f us\n", (time_now() - edge) * 1e6);
+			fflush(stdout);
+		}
+
+		do
+		{
+			r = gpio_irq_wait(&irq, WATCH_TIMEOUT_MS);
+
+			// no edge but line is high, we missed it
+			if ( r == 0 )
+				r = gpio_irq_level(&irq);
+		}
+		while ( r == 0 && !g_exit_pgm );
+
+		if ( r < 0 && errno != EINTR )
+			fatal( "do_watch GPIO %d : %s", opts.gpio, strerror(errno));
+
+		edge = time_now();
+	}
+
+	// stop notifications
+	memset(cmd + 1, 0, 3);
+	bus_transaction(MODE_SET, cmd, sizeof(cmd));
+	close(irq.fd);
+
+	clean_exit( EXIT_SUCCESS );
+}
+
+/* ======================================================================
+Function: reset_wait_dtr
+Purpose : wait avrdude set DTR on serial port
+Input 	: -
+Output	: -1 if stdin closed before
+Comments: stdin is avrdude strace output of ioctl calls
+====================================================================== */
+int reset_wait_dtr(void)
+{
+	char line[256];
+
+	while ( !g_exit_pgm && fgets(line, sizeof(line), stdin) )
+	{
+		if ( strstr(line, "TIOCM_DTR") )
+			return 0;
+	}
+
+	return -1;
+}
+
+/* ======================================================================
+Function: do_reset
+Purpose : reset mode, reset Arduino and wait firmware is ready
+Input 	: -
+Output	: -
+Comments: low pulse on reset GPIO, pulse end is an absolute monotonic
+					time so it is not made longer by the set call, then ping 
+					until firmware answer its default value after bootloader 
+					timeout and setup(), with --dtr reset is done when avrdude
+					open the serial port and bootloader is the one talking
+====================================================================== */
+void do_reset(void)
+{
+	unsigned char data[1];
+	struct gpio_line line;
+	struct timespec end;
+	double start, pulse;
+
+	if ( opts.gpio < 0 )
+		opts.gpio = GPIO_RESET;
+
+	if ( gpio_out_open(&line, opts.gpio, 1) < 0 )
+		fatal( "do_reset GPIO %d : %s", opts.gpio, strerror(errno));
+
+	if ( opts.dtr && reset_wait_dtr() < 0 )
+		clean_exit( EXIT_FAILURE );
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_nsec += RESET_PULSE_US * 1000L;
+	if ( end.tv_nsec >= 1000000000L )
+	{
+		end.tv_nsec -= 1000000000L;
+		end.tv_sec++;
+	}
+
+	start = time_now();
+
+	if ( gpio_out_set(&line, 0) < 0 )
+		fatal( "do_reset GPIO %d : %s", opts.gpio, strerror(errno));
+
+	while ( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &end, NULL) == EINTR )
+		;
+
+	gpio_out_set(&line, 1);
+	pulse = time_now() - start;
+	close(line.fd);
+
+	if (opts.verbose)
+		printf("reset pulse   : %.0f us\n", pulse * 1e6);
+
+	// avrdude talk to bootloader now
+	if ( opts.dtr )
+		clean_exit( EXIT_SUCCESS );
+
+	bus_init();
+
+	// firmware not yet there, these errors are expected
+	while ( !g_exit_pgm && time_now() - start < RESET_READY_MS / 1000.0 )
+	{
+		data[0] = ARDUIPI_CMD_PING;
+
+		if ( g_bus->transaction(MODE_GET, data, 1) == ARDUIPI_PING_DEFAULT )
+		{
+			log_syslog(stdout, "Arduino ready in %.0f ms\n", (time_now() - start) * 1000);
+			clean_exit( EXIT_SUCCESS );
+		}
+
+		usleep(RESET_PING_MS * 1000);
+	}
+
+	log_msg(LOG_ERR, stderr, "Arduino not ready after %d ms on device %s\n", RESET_READY_MS, opts.port);
+	clean_exit( EXIT_FAILURE );
+}
+
+/* ======================================================================
+Function: bus_adc_drain
+Purpose : drain ADC samples of all channels in one transaction
+Input 	: raw drain responses to fill, one per channel
+Output	: -1 if error
+Comments: -
+====================================================================== */
+int bus_adc_drain(unsigned char raw[][ARDUIPI_DRAIN_SIZE])
+{
+	unsigned char cmd[ARDUIPI_ADC_SCAN_CHANNELS][2];
+	struct bus_get gets[ARDUIPI_ADC_SCAN_CHANNELS];
+	int ch;
+
+	for (ch = 0; ch < ARDUIPI_ADC_SCAN_CHANNELS; ch++)
+	{
+		cmd[ch][0] = ARDUIPI_CMD_ADC_DRAIN;
+		cmd[ch][1] = ch;
+
+		// so an empty response is seen as no sample
+		raw[ch][1] = 0;
+
+		gets[ch].cmd = cmd[ch];
+		gets[ch].cmdlen = 2;
+		gets[ch].rsp = raw[ch];
+		gets[ch].len = ARDUIPI_DRAIN_SIZE;
+	}
+
+	return bus_gets(gets, ARDUIPI_ADC_SCAN_CHANNELS);
+}
+
+// stream mode double buffer shared with writer thread
+struct stream_buf	g_stream_buf[2];
+int g_stream_full = -1;					// buffer waiting to be written, -1 if none
+int g_stream_end = false;				// no more buffer will come
+pthread_mutex_t g_stream_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_stream_cond = PTHREAD_COND_INITIALIZER;
+
+/* ======================================================================
+Function: stream_writer
+Purpose : stream mode writer thread, write buffers filled by bus loop
+Input 	: output file
+Output	: -
+Comments: run while bus loop fill the other buffer
+====================================================================== */
+void * stream_writer(void * arg)
+{
+	FILE * fp = (FILE *) arg;
+	struct stream_buf * buf;
+	int i;
+
+	while (true)
+	{
+		pthread_mutex_lock(&g_stream_lock);
+
+		while ( g_stream_full < 0 && !g_stream_end )
+			pthread_cond_wait(&g_stream_cond, &g_stream_lock);
+
+		if ( g_stream_full < 0 )
+		{
+			pthread_mutex_unlock(&g_stream_lock);
+			break;
+		}
+
+		buf = &g_stream_buf[g_stream_full];
+		pthread_mutex_unlock(&g_stream_lock);
+
+		if ( opts.csv )
+		{
+			for (i = 0; i < buf->n; i++)
+				fprintf(fp, "%llu,%u,%u,%u\n", (unsigned long long) buf->rec[i].time_ns, 
+								buf->rec[i].sweep, buf->rec[i].channel, buf->rec[i].value);
+		}
+		else
+		{
+			fwrite(buf->rec, sizeof(struct stream_record), buf->n, fp);
+		}
+
+		fflush(fp);
+
+		// buffer is free again
+		pthread_mutex_lock(&g_stream_lock);
+		g_stream_full = -1;
+		pthread_cond_signal(&g_stream_cond);
+		pthread_mutex_unlock(&g_stream_lock);
+	}
+
+	return NULL;
+}
+
+/* ======================================================================
+Function: stream_swap
+Purpose : give the buffer being filled to writer thread
+Input 	: index of buffer filled
+Output	: index of buffer to fill now
+Comments: wait for writer if it's still busy with the other one
+====================================================================== */
+int stream_swap(int cur)
+{
+	pthread_mutex_lock(&g_stream_lock);
+
+	while ( g_stream_full >= 0 )
+		pthread_cond_wait(&g_stream_cond, &g_stream_lock);
+
+	g_stream_full = cur;
+	pthread_cond_signal(&g_stream_cond);
+	pthread_mutex_unlock(&g_stream_lock);
+
+	cur ^= 1;
+	g_stream_buf[cur].n = 0;
+
+	return cur;
+}
+
+/* ======================================================================
+Function: do_stream
+Purpose : stream mode, drain firmware ADC samples continuously
+Input 	: -
+Output	: -
+Comments: samples are timestamped with host monotonic clock, sample 
+					time is drain time minus its age in sweeps
+====================================================================== */
+void do_stream(void)
+{
+	unsigned char raw[ARDUIPI_ADC_SCAN_CHANNELS][ARDUIPI_DRAIN_SIZE];
+	uint32_t last[ARDUIPI_ADC_SCAN_CHANNELS];	// last sweep seen per channel
+	int seen[ARDUIPI_ADC_SCAN_CHANNELS];
+	const double sweep_s = (double) ARDUIPI_ADC_SCAN_CHANNELS / ARDUIPI_ADC_SAMPLE_HZ;
+	struct stream_record * rec;
+	struct timespec next;
+	pthread_t writer;
+	FILE * fp;
+	uint32_t first, newest;
+	double now, start, flushed, report;
+	long samples = 0, dropped = 0, errors = 0, last_samples = 0;
+	int ch, i, n, cur = 0, more;
+
+	if ( !strcmp(opts.output, "-") )
+		fp = stdout;
+	else if ( (fp = fopen(opts.output, "w")) == NULL )
+		fatal( "do_stream %s : %s", opts.output, strerror(errno));
+
+	if ( opts.csv )
+		fprintf(fp, "time_ns,sweep,channel,value\n");
+
+	memset(seen, 0, sizeof(seen));
+	g_stream_buf[cur].n = 0;
+
+	bus_init();
+
+	if ( pthread_create(&writer, NULL, stream_writer, fp) )
+		fatal( "do_stream writer thread : %s", strerror(errno));
+
+	start = flushed = report = time_now();
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while ( !g_exit_pgm && (!opts.count || samples < opts.count) )
+	{
+		stats_tick();
+
+		if ( bus_adc_drain(raw) < 0 )
+		{
+			errors++;
+		
+			if (opts.verbose)
+				log_msg(LOG_ERR, stderr, "Error draining samples on device %s : %s\n", opts.port, strerror(errno));
+		}
+		else
+		{
+			now = time_now();
+			more = false;
+			newest = 0;
+
+			// unwrap 16 bits sweep numbers and find the newest sample
+			for (ch = 0; ch < ARDUIPI_ADC_SCAN_CHANNELS; ch++)
+			{
+				n = raw[ch][1];
+
+				if ( raw[ch][0] != ch || n > ARDUIPI_ADC_DRAIN_MAX )
+					raw[ch][1] = n = 0;
+
+				if ( !n )
+					continue;
 
-			
-			// i2c slave address
-			case 'a':
-				opts.address = strtol(optarg,&pEnd,0);
-				
-				if ( !pEnd || opts.address < 1 || opts.address > 0x7F )
-				{
-						fprintf(stderr, "--address %d (0x%02x) ignored.\n", opts.address, opts.address);
-						fprintf(stderr, "--address must be between 1 and 255 or 0x01 and 0xff\n");
-						opts.address = I2C_SLAVE;
-						fprintf(stderr, "--setting slave to default 0x%02x\n", opts.address);
-				}
-			break;
+				first = raw[ch][3] | (raw[ch][4] << 8);
 
-			// spi max speed
-			case 'x':
-				opts.spi_speed = strtol(optarg,&pEnd,0) ;
-				
-				if ( !pEnd || opts.spi_speed < 1 || opts.spi_speed > 10000 )
-				{
-						fprintf(stderr, "--maxspeed %d Khz ignored.\n", opts.spi_speed);
-						fprintf(stderr, "--maxspeed must be between 1 and 10000 (KHz)\n");
-						opts.spi_speed = SPI_SPEED;
-						fprintf(stderr, "--setting max speed to default %d Khz\n", opts.spi_speed/1000);
-				}
-				else
-				{
-					opts.spi_speed *= 1000;
-				}
-			break;
+				if ( seen[ch] )
+					first = last[ch] + (int16_t) (first - (uint16_t) last[ch]);
 
-			// spi delay 
-			case 'y':
-				opts.spi_delay = strtol(optarg,&pEnd,0) ;
-				
-				if ( !pEnd || opts.spi_delay < 0 )
-				{
-						fprintf(stderr, "--delay %dus ignored.\n", opts.spi_delay);
-						opts.spi_delay = SPI_DELAY;
-						fprintf(stderr, "--setting delay to default %d us\n", opts.spi_delay);
-				}
-			break;
+				last[ch] = first + n - 1;
+				seen[ch] = true;
 
-			// spi bits per word 
-			case 'b':
-				opts.spi_bits = strtol(optarg,&pEnd,0) ;
-				
-				if ( !pEnd || opts.spi_bits < 0 || opts.spi_bits > 64 )
-				{
-						fprintf(stderr, "--bits %d ignored.\n", opts.spi_bits);
-						opts.spi_delay = SPI_BITS_WORD;
-						fprintf(stderr, "--setting bits per word to default %d us\n", opts.spi_bits);
-				}
-			break;
+				if ( last[ch] > newest )
+					newest = last[ch];
 
-			// Device name
-			case 'D':
-				strncpy(opts.port, optarg, sizeof(opts.port) - 1);
-				opts.port[sizeof(opts.port) - 1] = '\0';
-			break;
+				dropped += raw[ch][2];
 
-			// Data
-			case 'd':
+				// firmware still have samples
+				if ( n == ARDUIPI_ADC_DRAIN_MAX )
+					more = true;
+			}
+
+			for (ch = 0; ch < ARDUIPI_ADC_SCAN_CHANNELS; ch++)
 			{
-				int ishex = false;
-				char * p = opts.data;
+				n = raw[ch][1];
+				first = last[ch] - n + 1;
 
-			
-				// Check correct size
-				if ( strlen (optarg) >= 2)
-				{
-					// is it a hex string 
-					if (optarg[0] == '0' && optarg[1] == 'x' )
-						ishex = true;
-				}
-				
-				if (ishex)
+				for (i = 0; i < n; i++)
 				{
-					// put hex value into buffer data
-					for (c = 2 ; optarg[c] != '\0' ; c += 2, p++)    
+					// buffer full, give it to the writer
+					if ( g_stream_buf[cur].n >= STREAM_BUF_RECORDS )
 					{
-						// even number of hex char
-						if ( !optarg[c+1] )
-						{
-							*p = charToHexDigit(optarg[c]) ; 
-							c+=2;
-							break;
-						}
-						else
-						{
-							*p = charToHexDigit(optarg[c]) * 16 + charToHexDigit(optarg[c+1]); 
-						}
+						cur = stream_swap(cur);
+						flushed = now;
 					}
-					
-					opts.datasize = (c/2)- 1;
-				}
-				else
-				{
-					// copy the string
-					opts.datasize = strlen(optarg);
-					strncpy (opts.data, optarg, opts.datasize+1);
-					strncat (opts.data, "\n", 1);
-					opts.datasize++;
+
+					rec = &g_stream_buf[cur].rec[g_stream_buf[cur].n++];
+					rec->sweep = first + i;
+					rec->channel = ch;
+					rec->reserved = 0;
+					rec->value = raw[ch][5 + 2*i] | (raw[ch][6 + 2*i] << 8);
+					rec->time_ns = (uint64_t) ((now - (newest - rec->sweep) * sweep_s) * 1e9);
+					samples++;
 				}
 			}
-			break;
 
-			// version
-			case 'V':
+			// don't keep samples too long
+			if ( g_stream_buf[cur].n && now - flushed >= STREAM_FLUSH_MS / 1000.0 )
 			{
-				printf("%s v%s\n", PRG_NAME, PRG_VERSION);
-				printf("Raspberry Board Revision : %04x\n", g_pi_rev );
-				exit(EXIT_SUCCESS);
+				cur = stream_swap(cur);
+				flushed = now;
 			}
-			break;
 
-			// help
-			case 'h':
-				usage(argv[0]);
-				exit(EXIT_SUCCESS);
-			break;
-			
-			case '?':
-			default:
-				fprintf(stderr, "Unrecognized option.\n");
-				fprintf(stderr, "Run with '--help'.\n");
-				exit(EXIT_FAILURE);
-			break;
-		}
-	} /* while */
+			if ( opts.verbose && now - report >= 1.0 )
+			{
+				fprintf(stderr, "%.1f samples/s, %ld samples, %ld dropped, %ld errors\n", 
+									(samples - last_samples) / (now - report), samples, dropped, errors);
+				last_samples = samples;
+				report = now;
+			}
 
-	
-	if (opts.verbose)
-	{
-		
-		if ( opts.proto == PROTO_I2C )
-		{
-			printf("-- i2c Stuff -- \n");
-			printf("i2c bus       : %s\n", opts.port);
-			printf("slave address : 0x%02X\n", opts.address);
-		}
-		if ( opts.proto == PROTO_SPI )
-		{
-			printf("-- spi Stuff -- \n");
-			printf("spi bus       : %s\n", opts.port);
-			printf("spi mode      : %d\n", opts.spi_mode);
-			printf("bits per word : %d\n", opts.spi_bits);
-			printf("max speed     : %d Hz (%d KHz)\n", opts.spi_speed, opts.spi_speed/1000);
+			// firmware has more, drain again now
+			if ( more )
+				continue;
 		}
-				
-		printf("mode          : %s\n", opts.mode_str);
-		printf("protocol      : %s\n", opts.proto_str);
-		printf("verbose       : %s\n", opts.verbose? "yes" : "no");
-		printf("data (%02i)     : ", opts.datasize);
-		
-		if (opts.datasize >0 )
+
+		// wait next period
+		next.tv_nsec += STREAM_PERIOD_MS * 1000000L;
+		if ( next.tv_nsec >= 1000000000L )
 		{
-			for (c = 0; c <opts.datasize ; c++)    
-				printf("0x%02X ", opts.data[c]);
-							
-			printf("\n");
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
 		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	// write last samples and stop writer
+	if ( g_stream_buf[cur].n )
+		stream_swap(cur);
+
+	pthread_mutex_lock(&g_stream_lock);
+	g_stream_end = true;
+	pthread_cond_signal(&g_stream_cond);
+	pthread_mutex_unlock(&g_stream_lock);
+	pthread_join(writer, NULL);
+
+	if ( fp != stdout )
+		fclose(fp);
+
+	now = time_now() - start;
+
+	fprintf(stderr, "%ld samples in %.3f s : %.1f samples/s, %ld dropped, %ld errors\n", 
+						samples, now, now > 0 ? samples / now : 0.0, dropped, errors);
+
+	clean_exit( errors ? EXIT_FAILURE : EXIT_SUCCESS );
+}
+
+/* ======================================================================
+Function: bench_cmp
+Purpose : compare two latencies for qsort
+Input 	: pointers on latencies
+Output	: <0, 0 or >0 
+Comments: -
+====================================================================== */
+int bench_cmp(const void * a, const void * b)
+{
+	double d = *(const double *) a - *(const double *) b;
+
+	return d < 0 ? -1 : d > 0 ? 1 : 0;
+}
+
+/* ======================================================================
+Function: bench_test
+Purpose : run one benchmark test and print result
+Input 	: test name
+					program mode (MODE_xxx) of transactions
+					data buffer (command + data)
+					size of data
+					latency buffer (opts.count entries)
+Output	: -
+Comments: result is one JSON line on stdout, latencies in us
+					percentile p is the sample at rank ceil(p * n)
+====================================================================== */
+void bench_test(const char * name, int mode, unsigned char * data, int size, double * lat)
+{
+	unsigned char buf[BUFFER_SIZE];
+	unsigned char values[BUFFER_SIZE];
+	double start, t, elapsed;
+	unsigned long retries = 0;
+	long i, n = opts.count;
+	int r, op, errors = 0;
+
+	for (op = 0; op < STAT_OPS; op++)
+		retries -= g_stats.op[op].retries;
+
+	start = time_now();
+
+	for (i = 0; i < n && !g_exit_pgm; i++)
+	{
+		// transaction may overwrite data
+		memcpy(buf, data, size);
+
+		t = time_now();
+
+		if ( mode == MODE_BULK )
+			r = bus_bulk(buf, values, size);
 		else
-		{
-			printf("NULL\n");
-		}
+			r = bus_transaction(mode, buf, size);
+
+		lat[i] = time_now() - t;
+
+		if ( r < 0 )
+			errors++;
+	}
+
+	elapsed = time_now() - start;
+	n = i;
+
+	for (op = 0; op < STAT_OPS; op++)
+		retries += g_stats.op[op].retries;
+
+	if ( !n )
+		return;
+
+	qsort(lat, n, sizeof(double), bench_cmp);
+
+	printf("{\"version\":\"%s\",\"proto\":\"%s\",\"device\":\"%s\",\"speed_hz\":%u,\"test\":\"%s\","
+				 "\"size\":%d,\"count\":%ld,\"errors\":%d,\"retries\":%lu,\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,"
+				 "\"max_us\":%.2f,\"tps\":%.1f}\n",
+				 PRG_VERSION, opts.proto_str, opts.port, opts.proto == PROTO_SPI ? opts.spi_speed : opts.proto == PROTO_SERIAL ? opts.baud : 0, name, 
+				 size, n, errors, retries,
+				 lat[(long) ((n * 0.5) + 0.999) - 1] * 1e6, 
+				 lat[(long) ((n * 0.99) + 0.999) - 1] * 1e6, 
+				 lat[(long) ((n * 0.999) + 0.999) - 1] * 1e6, 
+				 lat[n - 1] * 1e6, 
+				 elapsed > 0 ? n / elapsed : 0.0);
+	fflush(stdout);
+}
+
+/* ======================================================================
+Function: do_bench
+Purpose : benchmark mode, measure each transaction type
+Input 	: -
+Output	: -
+Comments: commands used don't change board state, set is a ping 
+					value set to its default, bigger sets are ignored by firmware
+					biggest set is the largest the transport carry
+====================================================================== */
+void do_bench(void)
+{
+	int set_sizes[] = { 2, 4, 8, ARDUIPI_CMD_MAX_SIZE };
+	static const int bulk_sizes[] = { 1, 4, 16, BUFFER_SIZE };
+	unsigned char data[BUFFER_SIZE];
+	double * lat;
+	int i;
+
+	if ( !opts.count )
+		opts.count = BENCH_COUNT;
+
+	// i2c firmware take commands shorter than its buffer, CRC frame add
+	// its command and CRC bytes to that
+	if ( opts.crc )
+		set_sizes[3] = ARDUIPI_CMD_MAX_SIZE - 3;
+	else if ( opts.proto == PROTO_I2C )
+		set_sizes[3] = ARDUIPI_CMD_MAX_SIZE - 1;
+
+	if ( (lat = malloc(opts.count * sizeof(double))) == NULL )
+		fatal( "do_bench : %s", strerror(errno));
+
+	bus_init();
+
+	data[0] = ARDUIPI_CMD_PING;
+	bench_test("ack", MODE_READ_ACK, data, 1, lat);
+	bench_test("ping", MODE_GET, data, 1, lat);
+
+	data[0] = 0x1b;
+	bench_test("getbyte", MODE_GET, data, 1, lat);
+
+	data[0] = 0xa0;
+	bench_test("getword", MODE_GET_WORD, data, 1, lat);
+
+	memset(data, 0, sizeof(data));
+	data[0] = ARDUIPI_CMD_PING;
+	data[1] = 0x2a;
+	for (i = 0; i < sizeof(set_sizes) / sizeof(int); i++)
+		bench_test("set", MODE_SET, data, set_sizes[i], lat);
+
+	memset(data, ARDUIPI_CMD_PING, sizeof(data));
+	for (i = 0; i < sizeof(bulk_sizes) / sizeof(int); i++)
+		bench_test("bulk", MODE_BULK, data, bulk_sizes[i], lat);
+
+	free(lat);
+
+	clean_exit( EXIT_SUCCESS );
+}
+
+/* ======================================================================
+Function: daemon_init
+Purpose : create the daemon mode local listening socket
+Input 	: -
+Output	: listening socket handle
+Comments: an old socket file left by a previous run is removed
+====================================================================== */
+int daemon_init(void)
+{
+	struct sockaddr_un addr;
+	int fd ;
+
+	if ( (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 )
+		fatal( "daemon_init socket : %s", strerror(errno));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", opts.socket);
+
+	unlink(opts.socket);
+
+	if ( bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 )
+		fatal( "daemon_init bind %s : %s", opts.socket, strerror(errno));
+
+	// let local users of our group talk to us
+	chmod(opts.socket, 0660);
+
+	if ( listen(fd, DAEMON_MAX_CLIENTS) < 0 )
+		fatal( "daemon_init listen %s : %s", opts.socket, strerror(errno));
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return fd;
+}
+
+/* ======================================================================
+Function: daemon_close
+Purpose : close all daemon mode sockets
+Input 	: -
+Output	: -
+Comments: -
+====================================================================== */
+void daemon_close(void)
+{
+	int i;
+
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+	{
+		if (g_clients[i].fd)
+			close(g_clients[i].fd);
+
+		g_clients[i].fd = 0;
+	}
+
+	if (g_fd_listen)
+	{
+		close(g_fd_listen);
+		unlink(opts.socket);
+		g_fd_listen = 0;
+	}
+}
+
+/* ======================================================================
+Function: daemon_request
+Purpose : execute one request frame received from a client
+Input 	: request frame (len, opcode, payload)
+					response frame to fill (len, status, value)
+Output	: size of response frame
+Comments: request  : <len> <opcode> <payload...>  len counts opcode+payload
+					response : <len> <status> <value...>    status is 0 or errno
+====================================================================== */
+int daemon_request(unsigned char * req, unsigned char * rsp)
+{
+	unsigned char data[BUFFER_SIZE];
+	int datasize = req[0] - 1;
+	int mode;
+	int size = 0;
+	int r;
+
+	// copy payload, transaction may overwrite it
+	memcpy(data, req + 2, datasize);
+
+	switch (req[1])
+	{
+		case DAEMON_OP_PING:
+			data[0] = ARDUIPI_CMD_PING;
+			datasize = 1;
+			mode = MODE_GET;
+			size = 1;
+		break;
+
+		case DAEMON_OP_GET:
+			mode = MODE_GET;
+			size = 1;
+		break;
+
+		case DAEMON_OP_GET_WORD:
+			mode = MODE_GET_WORD;
+			size = 2;
+		break;
+
+		case DAEMON_OP_SET:
+			mode = MODE_SET;
+		break;
+
+		// raw snapshot, client decode it
+		case DAEMON_OP_SNAPSHOT:
+			rsp[0] = 1 + ARDUIPI_SNAPSHOT_SIZE;
+			rsp[1] = 0;
+
+			// pins must show pending writes
+			if ( (g_cache.pending && cache_flush() < 0) || bus_snapshot(rsp + 2) < 0 )
+			{
+				rsp[0] = 1;
+				rsp[1] = errno ? errno : EIO;
+			}
+
+			return 1 + rsp[0];
 
-	}	
+		default:
+			rsp[0] = 1;
+			rsp[1] = EINVAL;
+			return 2;
+	}
+
+	// need at least the command byte
+	if ( datasize < 1 )
+	{
+		rsp[0] = 1;
+		rsp[1] = EINVAL;
+		return 2;
+	}
+
+	r = cache_transaction(mode, data, datasize);
+
+	if ( r < 0 )
+	{
+		rsp[0] = 1;
+		rsp[1] = errno ? errno : EIO;
+
+		if (opts.verbose)
+			log_msg(LOG_ERR, stderr, "Request 0x%02X failed : %s\n", req[1], strerror(errno));
+
+		return 2;
+	}
+
+	// LSB first
+	rsp[0] = 1 + size;
+	rsp[1] = 0;
+	rsp[2] = r & 0xFF;
+	rsp[3] = (r >> 8) & 0xFF;
+
+	return 2 + size;
 }
 
 /* ======================================================================
-Function: do_i2c
-Purpose : do i2c stuff
-Input 	: -
+Function: daemon_poll
+Purpose : wait for client activity and serve requests
+Input 	: max time to wait (ms)
 Output	: -
-Comments: documentation on i2c smbus API can be found at
-					http://www.mjmwired.net/kernel/Documentation/i2c/smbus-protocol
-					http://www.mjmwired.net/kernel/Documentation/i2c/dev-interface
+Comments: each client frame is served as soon as it is complete
 ====================================================================== */
-void do_i2c(void)
+void daemon_poll(int timeout)
 {
-  int r=0;
+	struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+	unsigned char rsp[DAEMON_FRAME_SIZE];
+	int i, n, fd, len;
 
-	g_fd_device = i2c_init();
-		
-	if (opts.verbose)
-		 	log_syslog(stdout, "i2c Init succeded\n");
+	// listening socket first, then clients
+	fds[0].fd = g_fd_listen;
+	fds[0].events = POLLIN;
 
-	// Mode : Check device
-	if ( opts.mode == MODE_QUICK_ACK || opts.mode == MODE_READ_ACK )
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
 	{
-		if (opts.mode == MODE_QUICK_ACK)	
-			r = i2c_smbus_write_quick(g_fd_device, I2C_SMBUS_WRITE);
-		else
-			r = i2c_smbus_read_byte(g_fd_device);
-		
-		// If not found 
-		if ( r < 0  )
-		{
-			log_syslog(stdout, "i2c device 0x%02x was not found\n", opts.address);
-			clean_exit( EXIT_SUCCESS );
-		}
-		else
-		{
-			log_syslog(stdout, "i2c device 0x%02x is detected\n", opts.address);
-			clean_exit( EXIT_SUCCESS );
-		}
-			
-		// sure, we have finished our job
-		g_exit_pgm = true;
+		fds[i+1].fd = g_clients[i].fd ? g_clients[i].fd : -1;
+		fds[i+1].events = POLLIN;
+		fds[i+1].revents = 0;
 	}
-	else
+
+	// got signal or nothing to do
+	if ( poll(fds, DAEMON_MAX_CLIENTS + 1, timeout) <= 0 )
+		return;
+
+	// new client
+	if ( fds[0].revents & POLLIN )
 	{
-		// Get Byte command
-		if (opts.mode == MODE_GET )
+		if ( (fd = accept(g_fd_listen, NULL, NULL)) >= 0 )
 		{
-			// Set the command we wand to read
-			r = i2c_smbus_write_byte(g_fd_device, opts.data[0]);
+			for (i = 0; i < DAEMON_MAX_CLIENTS && g_clients[i].fd; i++)
+				;
 
-			// If OK
-			if ( r >= 0 )
+			if ( i < DAEMON_MAX_CLIENTS )
 			{
-				// Read the return value
-				r = i2c_smbus_read_byte(g_fd_device); 
+				g_clients[i].fd = fd;
+				g_clients[i].len = 0;
 			}
 			else
 			{
-				log_syslog(stdout, "Error from device 0x%02x on i2c_smbus_write_byte : %d %s\n", opts.address, r, strerror(errno));
-				clean_exit( EXIT_FAILURE );
+				log_msg(LOG_WARNING, stderr, "Too many clients, connection refused\n");
+				close(fd);
 			}
-			
 		}
-		// Get word command
-		else if (opts.mode == MODE_GET_WORD )
+	}
+
+	for (i = 0; i < DAEMON_MAX_CLIENTS; i++)
+	{
+		if ( !(fds[i+1].revents & (POLLIN | POLLHUP | POLLERR)) )
+			continue;
+
+		fd = g_clients[i].fd;
+		n = read(fd, g_clients[i].buf + g_clients[i].len, DAEMON_FRAME_SIZE - g_clients[i].len);
+
+		// closed or error, free the slot
+		if ( n <= 0 )
 		{
-				r = i2c_smbus_read_word_data(g_fd_device, opts.data[0]);
-				//log_syslog(stderr, "Get Word 0x%02x : %d\n", opts.address, r);
+			close(fd);
+			g_clients[i].fd = 0;
+			continue;
 		}
-		else if (opts.mode == MODE_SET )
+
+		g_clients[i].len += n;
+
+		// serve all complete frames
+		while ( g_clients[i].len >= 1 && g_clients[i].len >= 1 + g_clients[i].buf[0] )
 		{
-			// Set Byte command
-			if (opts.datasize==1)
+			// bad frame len, we can't resync so drop client
+			if ( g_clients[i].buf[0] < 1 || g_clients[i].buf[0] > DAEMON_FRAME_SIZE - 1 )
 			{
-				r = i2c_smbus_write_byte(g_fd_device, opts.data[0]);
+				close(fd);
+				g_clients[i].fd = 0;
+				break;
 			}
-			// Set Word Byte command
-			else if ( opts.datasize==2)
+
+			len = daemon_request(g_clients[i].buf, rsp);
+
+			if ( send(fd, rsp, len, MSG_NOSIGNAL) != len )
 			{
-				r = i2c_smbus_write_byte_data(g_fd_device, opts.data[0], opts.data[1]);
+				close(fd);
+				g_clients[i].fd = 0;
+				break;
 			}
-		}
-
-		// had a error ?
-		if (r<0)
-		{
-			log_syslog(stdout, "Error from device 0x%02x : %d %s\n", opts.address, r, strerror(errno));
-			clean_exit( EXIT_FAILURE );
-		}
-		else
-		{
-			//log_syslog(stdout, "Successfully done action on device 0x%02x\n", opts.address);
-			if (opts.hexout)
-				log_syslog(stdout, opts.mode == MODE_GET_WORD ? "0x%04X\n":"0x%02X\n", r);
-			else
-				log_syslog(stdout, "%d\n", r);
 
-			clean_exit( EXIT_SUCCESS );
+			// remove frame from buffer
+			len = 1 + g_clients[i].buf[0];
+			g_clients[i].len -= len;
+			memmove(g_clients[i].buf, g_clients[i].buf + len, g_clients[i].len);
 		}
 	}
 }
 
 
 /* ======================================================================
-Function: spi_write
-Purpose : send spi datado spi stuff
-Input 	: spi Port Handle
-					pointer to send buffer (buffer will be erased by device response
-					size of buffer
-Output	: -1 if error
-Comments: 
+Function: do_daemon
+Purpose : daemon mode, serve requests until we are asked to stop
+Input 	: -
+Output	: -
+Comments: -
 ====================================================================== */
-int spi_transfer(int fd, unsigned char * buf, int n)
+void do_daemon(void)
 {
-	struct spi_ioc_transfer tr ;
-	
-	tr.rx_buf = (unsigned long) buf,
-	tr.tx_buf = (unsigned long) buf;	
-	tr.len = n;
-	tr.speed_hz 		= opts.spi_speed;
-	tr.delay_usecs 	= opts.spi_delay;
-	tr.bits_per_word= opts.spi_bits;
-		
-	return (ioctl(fd, SPI_IOC_MESSAGE(1), &tr) );
+	// open device once and keep it
+	bus_init();
+	g_fd_listen = daemon_init();
+
+	log_syslog(stderr, "Listening on %s\n", opts.socket);
+
+	// Do while not end 
+	while ( ! g_exit_pgm ) 
+	{
+		daemon_poll(cache_timeout(1000));
+		cache_tick();
+		stats_tick();
+	}
+
+	cache_close();
+	daemon_close();
+}
+
+/* ======================================================================
+Function: batch_parse
+Purpose : parse one batch command line
+Input 	: line to parse (will be modified)
+					data buffer to fill with command + data
+					pointer on data size to fill
+Output	: program mode (MODE_xxx), -1 if empty line, -2 if error
+Comments: syntax is <ping|snapshot|get|getword|set> [byte ...]
+					# start a comment
+====================================================================== */
+int batch_parse(char * line, unsigned char * data, int * datasize)
+{
+	char * tok;
+	char * pend;
+	long val;
+	int mode;
+
+	// strip comment
+	if ( (tok = strchr(line, '#')) != NULL )
+		*tok = '\0';
+
+	if ( (tok = strtok(line, " \t\r\n")) == NULL )
+		return -1;
+
+	if ( !strcmp(tok, "ping") )
+	{
+		data[0] = ARDUIPI_CMD_PING;
+		*datasize = 1;
+		return MODE_GET;
+	}
+	else if ( !strcmp(tok, "snapshot") )
+	{
+		data[0] = ARDUIPI_CMD_SNAPSHOT;
+		*datasize = 1;
+		return MODE_SNAPSHOT;
+	}
+	else if ( !strcmp(tok, "get") )
+		mode = MODE_GET;
+	else if ( !strcmp(tok, "getword") )
+		mode = MODE_GET_WORD;
+	else if ( !strcmp(tok, "set") )
+		mode = MODE_SET;
+	else
+		return -2;
+
+	// get all bytes
+	*datasize = 0;
+	while ( (tok = strtok(NULL, " \t\r\n")) != NULL )
+	{
+		val = strtol(tok, &pend, 0);
+
+		// more bytes than the buffer hold is an error, not a shorter command
+		if ( *pend || val < 0 || val > 0xFF || *datasize >= BUFFER_SIZE )
+			return -2;
+
+		data[(*datasize)++] = (unsigned char) val;
+	}
+
+	// need at least the command, get only need the command
+	if ( *datasize < 1 || (mode != MODE_SET && *datasize != 1) )
+		return -2;
+
+	return mode;
 }
 
 /* ======================================================================
-Function: do_spi
-Purpose : do spi stuff
+Function: do_batch
+Purpose : batch mode, execute all commands of a file on one opened device
 Input 	: -
 Output	: -
-Comments: 
+Comments: one result line per command, in order, summary on stderr
 ====================================================================== */
-void do_spi(void)
+void do_batch(void)
 {
-  int r=0;
+	FILE * fp;
+	char line[256];
+	unsigned char data[BUFFER_SIZE];
+	unsigned char raw[ARDUIPI_SNAPSHOT_SIZE];
+	struct arduipi_snapshot snap;
+	struct pollfd pfd;
+	struct stat st;
+	int datasize;
+	int mode, r;
+	int wait = false;
+	int interactive = false;
+	int lineno = 0;
+	int errors = 0;
+	long count = 0;
+	long bytes = 0;
+	double start, elapsed;
 
-	g_fd_device = spi_init();
-		
-	if (opts.verbose)
-		 	log_syslog(stdout, "spi Init succeded\n");
+	if ( !strcmp(opts.batch, "-") )
+		fp = stdin;
+	else if ( (fp = fopen(opts.batch, "r")) == NULL )
+		fatal( "do_batch %s : %s", opts.batch, strerror(errno));
 
-	// Mode : Check device, 
-	// arbitray, just check device response there is no such mode in SPI
-	if ( opts.mode == MODE_QUICK_ACK || opts.mode == MODE_READ_ACK )
+	// pipe or terminal, other side may wait each result before writing
+	// next line, so results are line buffered
+	if ( fstat(fileno(fp), &st) == 0 && !S_ISREG(st.st_mode) )
 	{
-		// send a ping command
-		opts.data[0] = ARDUIPI_CMD_PING ;
-		
-		// transfert one byte with the ping command
-		// test firmware always response 2a 
-		spi_transfer( g_fd_device, (unsigned char *) opts.data, 1);
-	
-		// If error 
-		if ( r < 0 )
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		interactive = true;
+	}
+
+	// pipe or terminal may block us with writes pending, read it
+	// unbuffered so poll tell if a line is there
+	if ( opts.coalesce && interactive )
+	{
+		setvbuf(fp, NULL, _IONBF, 0);
+		pfd.fd = fileno(fp);
+		pfd.events = POLLIN;
+		wait = true;
+	}
+
+	bus_init();
+
+	start = time_now();
+
+	while ( !g_exit_pgm )
+	{
+		if ( wait && g_cache.pending )
+			poll(&pfd, 1, cache_timeout(opts.coalesce));
+
+		cache_tick();
+
+		if ( fgets(line, sizeof(line), fp) == NULL )
+			break;
+
+		stats_tick();
+
+		lineno++;
+
+		mode = batch_parse(line, data, &datasize);
+
+		// empty or comment line
+		if ( mode == -1 )
+			continue;
+
+		if ( mode == -2 )
 		{
-			log_syslog(stdout, "Error from spi device %s : %s\n", opts.port, strerror(errno));
-			clean_exit( EXIT_FAILURE );
+			log_syslog(stdout, "ERR line %d syntax error\n", lineno);
+			errors++;
+			continue;
+		}
+
+		// snapshot on one line : seq pinb pinc pind ddrb ddrc ddrd vcc a0..a5
+		if ( mode == MODE_SNAPSHOT )
+		{
+			count++;
+			bytes += 1 + ARDUIPI_SNAPSHOT_SIZE;
+
+			// pins must show pending writes
+			if ( g_cache.pending )
+				cache_flush();
+
+			if ( (r = bus_snapshot(raw)) >= 0 )
+			{
+				snapshot_decode(raw, &snap);
+				log_syslog(stdout, "%d 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X 0x%02X %d %d %d %d %d %d %d\n", 
+										snap.seq, snap.pin[0], snap.pin[1], snap.pin[2], snap.ddr[0], snap.ddr[1], snap.ddr[2], 
+										snap.vcc, snap.adc[0], snap.adc[1], snap.adc[2], snap.adc[3], snap.adc[4], snap.adc[5]);
+				continue;
+			}
 		}
 		else
 		{
-			// get real response
-			r = (int) opts.data[0];
-			
-			// not expected response ?
-			//if ( r != ARDUIPI_CMD_PING)
-			//	log_syslog(stdout, "Warning, expected %02X response and received %02X from spi device %s\n", ARDUIPI_CMD_PING, r, opts.port);
-			//else
-				log_syslog(stdout, opts.hexout?"0x%02X\n":"%d\n", r);
+			r = cache_transaction(mode, data, datasize);
+
+			// bus bytes are command plus response
+			count++;
+			bytes += datasize + (mode == MODE_GET_WORD ? 2 : mode == MODE_GET ? 1 : 0);
 		}
-		
-		// sure, we have finished our job
-		g_exit_pgm = true;
+
+		if ( r < 0 )
+		{
+			log_syslog(stdout, "ERR %s\n", strerror(errno));
+			errors++;
+		}
+		else if (opts.hexout)
+			log_syslog(stdout, mode == MODE_GET_WORD ? "0x%04X\n":"0x%02X\n", r);
+		else
+			log_syslog(stdout, "%d\n", r);
 	}
-	else
+
+	cache_close();
+
+	elapsed = time_now() - start;
+
+	if (fp != stdin)
+		fclose(fp);
+
+	fprintf(stderr, "%ld transactions, %ld bytes in %.3f s : %.1f transactions/s, %.1f bytes/s, %d errors\n", 
+						count, bytes, elapsed, 
+						elapsed > 0 ? count / elapsed : 0.0, 
+						elapsed > 0 ? bytes / elapsed : 0.0, 
+						errors);
+
+	clean_exit( errors ? EXIT_FAILURE : EXIT_SUCCESS );
+}
+
+// transports indexed by protocol (PROTO_xxx)
+const struct bus_ops g_bus_ops[] =
+{
+	[PROTO_I2C] 	= { "i2c", i2c_init, i2c_transaction, i2c_bulk, i2c_gets },
+	[PROTO_SPI] 	= { "spi", spi_init, spi_transaction, spi_bulk, spi_gets },
+	[PROTO_SERIAL]= { "serial", serial_init, serial_transaction, serial_bulk, serial_gets },
+	[PROTO_SIM] 	= { "sim", sim_init, sim_transaction, sim_bulk, sim_gets },
+};
+
+/* ======================================================================
+Function: fanout_parse
+Purpose : parse fan-out slaves list and group slaves by bus
+Input 	: buses to fill
+Output	: number of buses
+Comments: list is proto:device[:address] separated by comma, proto is 
+					i2c, spi, serial or sim, address is for i2c (default --address)
+====================================================================== */
+int fanout_parse(struct fanout_bus * buses)
+{
+	char list[sizeof(opts.slaves)];
+	char * tok, * save, * dev, * addr;
+	struct fanout_bus * bus;
+	int i, proto, n = 0;
+
+	strcpy(list, opts.slaves);
+
+	for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
 	{
-		// Get Byte command
-		if (opts.mode == MODE_GET )
-		{
-			// Set the command we wand to read send 2 
-			// Dummy 2nd byte this is where we will have our response
-			opts.data[1] = 0xff ;
-			r = spi_transfer( g_fd_device, (unsigned char *) opts.data, 2);
+		if ( (dev = strchr(tok, ':')) == NULL )
+			fatal( "fanout slave %s : proto:device[:address] expected", tok);
 
-			// If OK Read the return value
-			if ( r >= 0 )
-				r = opts.data[1]; 
-			
-		}
-		// Get word command
-		else if (opts.mode == MODE_GET_WORD )
+		*dev++ = '\0';
+
+		if ( (addr = strchr(dev, ':')) != NULL )
+			*addr++ = '\0';
+
+		for (proto = 0; proto <= PROTO_SIM; proto++)
+			if ( !strcmp(tok, g_bus_ops[proto].name) )
+				break;
+
+		if ( proto > PROTO_SIM )
+			fatal( "fanout slave %s:%s : unknown protocol", tok, dev);
+
+		// one bus per device
+		for (i = 0, bus = buses; i < n; i++, bus++)
+			if ( bus->proto == proto && !strcmp(bus->port, dev) )
+				break;
+
+		if ( i == n )
 		{
-				// Dummy 2nd and 3rd bytes this is where we will have our word response
-				opts.data[1] = 0xff ;
-				opts.data[2] = 0xff ;
-				r = spi_transfer( g_fd_device, (unsigned char *) opts.data, 3);
+			if ( n == FANOUT_MAX_BUSES )
+				fatal( "fanout : %d buses max", FANOUT_MAX_BUSES);
 
-				// If OK // Read the return value
-				if ( r >= 0 )
-					r = opts.data[1] | (opts.data[2] << 8 );
+			memset(bus, 0, sizeof(*bus));
+			bus->proto = proto;
+			strncpy(bus->port, dev, sizeof(bus->port) - 1);
+			n++;
 		}
-		else if (opts.mode == MODE_SET )
+
+		if ( bus->n == FANOUT_MAX_SLAVES )
+			fatal( "fanout %s : %d slaves max", dev, FANOUT_MAX_SLAVES);
+
+		bus->slave[bus->n++].address = addr ? strtol(addr, NULL, 0) : opts.address;
+	}
+
+	return n;
+}
+
+/* ======================================================================
+Function: fanout_print
+Purpose : print result of one slave poll
+Input 	: bus and slave polled
+					poll start (s since fan-out start)
+					values read, NULL if error
+Output	: -
+Comments: one fprintf per line, so lines of workers never mix
+====================================================================== */
+void fanout_print(FILE * fp, struct fanout_bus * bus, struct fanout_slave * slave, double t, unsigned char * values)
+{
+	char line[64 + sizeof(bus->port) + 5 * BUFFER_SIZE];
+	int i, n;
+
+	if ( opts.csv )
+		n = sprintf(line, "%.6f,%s,0x%02x,%.1f,%d", t, bus->port, slave->address, slave->latency * 1e6, values ? 0 : errno);
+	else
+		n = sprintf(line, "%.6f %s 0x%02x %8.1f us :", t, bus->port, slave->address, slave->latency * 1e6);
+
+	if ( !values && !opts.csv )
+		n += sprintf(line + n, " %s", strerror(errno));
+
+	for (i = 0; values && i < opts.datasize; i++)
+		n += sprintf(line + n, opts.csv ? (opts.hexout ? ",0x%02X" : ",%d") : (opts.hexout ? " 0x%02X" : " %d"), values[i]);
+
+	fprintf(fp, "%s\n", line);
+}
+
+/* ======================================================================
+Function: fanout_worker
+Purpose : fan-out mode bus worker, run poll plan on each slave of a bus
+Input 	: bus
+Output	: -
+Comments: transport state is per thread, init use opts so is done one
+					worker at a time, periods are aligned on the common start
+					a bus that fail to init report it for each of its slaves
+					then its worker stop, other buses go on
+====================================================================== */
+void * fanout_worker(void * arg)
+{
+	struct fanout_bus * bus = arg;
+	struct fanout_slave * slave;
+	unsigned char values[BUFFER_SIZE];
+	struct timespec next;
+	double start;
+	long cycle;
+	int i, r;
+
+	g_bus = &g_bus_ops[bus->proto];
+	g_slave = bus->slave[0].address;
+
+	pthread_mutex_lock(&g_init_lock);
+	strcpy(opts.port, bus->port);
+	opts.address = g_slave;
+	g_fd_device = g_bus->init();
+	pthread_mutex_unlock(&g_init_lock);
+
+	if ( g_fd_device < 0 )
+	{
+		r = errno;
+		log_msg(LOG_ERR, stderr, "fanout %s : %s\n", bus->port, g_bus_error);
+
+		for (i = 0; i < bus->n; i++)
 		{
-			// send bulk data data
-			r = spi_transfer( g_fd_device, (unsigned char *) opts.data, opts.datasize);
+			errno = r;
+			fanout_print(g_fanout_fp, bus, &bus->slave[i], time_now() - g_fanout_start, NULL);
 		}
 
-		// had a error ?
-		if ( r < 0 )
+		bus->stats = g_stats;
+		return NULL;
+	}
+
+	next.tv_sec = (time_t) g_fanout_start;
+	next.tv_nsec = (g_fanout_start - next.tv_sec) * 1e9;
+
+	for (cycle = 0; !g_exit_pgm && (!opts.count || cycle < opts.count); cycle++)
+	{
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		for (i = 0; i < bus->n && !g_exit_pgm; i++)
 		{
-			log_syslog(stdout, "Error from spi_transfer on device %s : %d %s\n", opts.port,  r, strerror(errno));
-			clean_exit( EXIT_FAILURE );
+			slave = &bus->slave[i];
+
+			// several slaves on this i2c bus
+			if ( bus->proto == PROTO_I2C && slave->address != g_slave )
+			{
+				g_slave = slave->address;
+
+				if ( ioctl(g_fd_device, I2C_SLAVE, g_slave) < 0 )
+					log_msg(LOG_ERR, stderr, "fanout %s error setting slave address 0x%02X : %s\n", bus->port, g_slave, strerror(errno));
+			}
+
+			start = time_now();
+			r = bus_bulk((unsigned char *) opts.data, values, opts.datasize);
+			slave->latency = time_now() - start;
+
+			fanout_print(g_fanout_fp, bus, slave, start - g_fanout_start, r < 0 ? NULL : values);
 		}
-		else
+
+		next.tv_nsec += opts.period % 1000 * 1000000L;
+		next.tv_sec += opts.period / 1000;
+		if ( next.tv_nsec >= 1000000000L )
 		{
-			if (opts.hexout)
-				log_syslog(stdout, opts.mode == MODE_GET_WORD ? "0x%04X\n":"0x%02X\n", r);
-			else
-				log_syslog(stdout, "%d\n", r);
-			
-			clean_exit( EXIT_SUCCESS );
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
 		}
 	}
+
+	if ( g_fd_device > 0 )
+		close(g_fd_device);
+
+	bus->stats = g_stats;
+
+	return NULL;
 }
 
+/* ======================================================================
+Function: do_fanout
+Purpose : fan-out mode, poll a list of slaves, one thread per bus
+Input 	: -
+Output	: -
+Comments: poll plan is a get byte of each command of --data, done for
+					each slave every --period ms, --count times (0 until CTRL-C)
+					results of all buses are merged in one output
+====================================================================== */
+void do_fanout(void)
+{
+	struct fanout_bus buses[FANOUT_MAX_BUSES];
+	int i, n;
+
+	if ( !opts.datasize )
+	{
+		opts.data[0] = ARDUIPI_CMD_PING;
+		opts.datasize = 1;
+	}
+
+	n = fanout_parse(buses);
+
+	if ( !strcmp(opts.output, "-") )
+		g_fanout_fp = stdout;
+	else if ( (g_fanout_fp = fopen(opts.output, "w")) == NULL )
+		fatal( "do_fanout %s : %s", opts.output, strerror(errno));
+
+	// line buffered so each poll is seen at once
+	setvbuf(g_fanout_fp, NULL, _IOLBF, 0);
+
+	if ( opts.csv )
+		fprintf(g_fanout_fp, "time_s,device,address,latency_us,errno,values\n");
+
+	// first period let workers init
+	g_fanout_start = time_now() + opts.period / 1000.0;
+
+	for (i = 0; i < n; i++)
+		if ( pthread_create(&buses[i].thread, NULL, fanout_worker, &buses[i]) )
+			fatal( "do_fanout worker thread : %s", strerror(errno));
 
+	for (i = 0; i < n; i++)
+	{
+		pthread_join(buses[i].thread, NULL);
+		stats_merge(&buses[i].stats);
+	}
+
+	if ( g_fanout_fp != stdout )
+		fclose(g_fanout_fp);
+
+	clean_exit( EXIT_SUCCESS );
+}
 
 /* ======================================================================
 Function: main
@@ -940,31 +6058,33 @@ Comments:
 int main(int argc, char **argv)
 {
 	struct sigaction exit_action;
-  int n;
-	char	buff[BUFFER_SIZE];
 
 	g_fd_device = 0;
+	g_fd_listen = 0;
 	g_exit_pgm = false;
+	g_stats.start = time_now();
 
-	// clean up our buffer size
-	bzero(buff, BUFFER_SIZE);
+	// retries jitter
+	srandom(getpid() ^ time(NULL));
 
 	// Get Raspberry Board Revision
 	g_pi_rev = get_pi_version() ;
 		
-	// No Raspberry Board ?
-	if ( g_pi_rev == 0 ) 
-	{
-		printf("Error Unable to find Raspberry Board Revision\n");
-		clean_exit(EXIT_FAILURE);
-	}
-	
 	// Set i2c device default bus depending on PI version
-	strcpy(opts.port, g_pi_rev >= 2 ? I2C_DEVICE_1 : I2C_DEVICE_0 );
+	// not a Raspberry board (0) use revision 2 default, device
+	// can be set with --device or simulator used with --sim
+	strcpy(opts.port, g_pi_rev == 1 ? I2C_DEVICE_0 : I2C_DEVICE_1 );
 	
 	// get command line args
 	parse_args(argc, argv);
 
+	// syslog is written in background
+	log_init();
+
+	// transport of selected protocol
+	g_bus = &g_bus_ops[opts.proto];
+	g_slave = opts.address;
+
 	// Set up the structure to specify the exit action.
 	exit_action.sa_handler = isr_handler;
 	sigemptyset (&exit_action.sa_mask);
@@ -972,31 +6092,39 @@ int main(int argc, char **argv)
 	sigaction (SIGTERM, &exit_action, NULL);
 	sigaction (SIGINT,  &exit_action, NULL); 
 
-	// do i2c job
-	if ( opts.proto == PROTO_I2C )
-		do_i2c();
-
-	// do spi job
-	if ( opts.proto == PROTO_SPI )
-		do_spi();
-		
-	// Do while not end 
-	// this is for demo purpose, you can do whatever you like in this loop
-	while ( ! g_exit_pgm ) 
-	{
-		// example Read adc value from arduino
-		n = i2c_smbus_read_byte_data(g_fd_device, 0x01);
-
-		// We want to display results on stdout even if we are deamon ?
-		if (opts.verbose)
-		{
-			log_syslog(stdout, "Received 0x%02x from slave\n", n);
-		}
+	// long running modes
+	if ( opts.mode == MODE_DAEMON )
+		do_daemon();
+	else if ( opts.mode == MODE_BATCH )
+		do_batch();
+	else if ( opts.mode == MODE_BULK )
+		do_bulk();
+	else if ( opts.mode == MODE_SNAPSHOT )
+		do_snapshot();
+	else if ( opts.mode == MODE_STREAM )
+		do_stream();
+	else if ( opts.mode == MODE_BENCH )
+		do_bench();
+	else if ( opts.mode == MODE_PERF )
+		do_perf();
+	else if ( opts.mode == MODE_WATCH )
+		do_watch();
+	else if ( opts.mode == MODE_RESET )
+		do_reset();
+	else if ( opts.mode == MODE_FANOUT )
+		do_fanout();
+	else if ( opts.mode == MODE_SHM )
+		do_shm();
+	else if ( opts.mode == MODE_TEMPS )
+		do_temps();
 
-		// Do it again in 5 seconds
-		sleep(5);
+	// one shot i2c job
+	else if ( opts.proto == PROTO_I2C )
+		do_i2c();
 
-	}
+	// one shot spi or simulator job
+	else
+		do_transaction();
 
   log_syslog(stderr, "Program terminated\n");
 
@@ -1005,4 +6133,3 @@ int main(int argc, char **argv)
   // avoid compiler warning
   return (0);
 }
-
@@ -0,0 +1,143 @@
+/* ======================================================================
+Program : arduipi_shm.h
+Purpose : board state published by arduipi --shm, reader side
+Version : 1.0
+Author  : (c) Charles-Henri Hallard
+Comments: This program is written for the open source project ArduiPi
+					you can find documentation and all code on my github located at
+					https://github.com/hallard/arduipi
+
+					Only arduipi own the bus, any number of local processes map
+					the segment read only and copy the state without syscall
+					state is protected by a sequence lock, odd while written,
+					reader retries while it's odd or changed during its copy
+
+					  struct arduipi_shm * shm = arduipi_shm_open(ARDUIPI_SHM_NAME);
+					  struct arduipi_shm_state st;
+					  arduipi_shm_read(shm, &st);
+
+					link with -lrt for shm_open on older glibc
+====================================================================== */
+#ifndef ARDUIPI_SHM_H
+#define ARDUIPI_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define ARDUIPI_SHM_NAME			"/arduipi"
+#define ARDUIPI_SHM_MAGIC			0x41504953	// "APIS"
+#define ARDUIPI_SHM_VERSION		2
+#define ARDUIPI_SHM_CACHELINE	64
+#define ARDUIPI_SHM_ADC				6						// A0..A5
+#define ARDUIPI_SHM_1W_MAX		24					// 1-Wire sensors
+#define ARDUIPI_SHM_1W_NONE		((int16_t) 0x8000)	// temperature not read yet
+
+// board state, copied as a whole by readers
+struct arduipi_shm_state
+{
+	uint64_t time_ns;									// host monotonic time of last update
+	uint32_t updates;									// successful updates
+	uint32_t errors;									// failed updates, state is the previous one
+	uint8_t seq;											// firmware snapshot sequence
+	uint8_t pin[3];										// PINB, PINC, PIND
+	uint8_t port[3];									// PORTB, PORTC, PORTD
+	uint8_t ddr[3];										// DDRB, DDRC, DDRD
+	uint16_t vcc;											// vcc (mV)
+	uint16_t adc[ARDUIPI_SHM_ADC];		// A0..A5 raw values
+	uint8_t ow_count;									// 1-Wire sensors enumerated by firmware
+	uint8_t ow_seq;										// 1-Wire conversion round of temperatures
+	uint8_t ow_search;								// 1-Wire searches done, ow_addr changed with it
+	uint8_t reserved[1];
+	int16_t ow_temp[ARDUIPI_SHM_1W_MAX];	// 1-Wire temperatures (1/16 C) or ARDUIPI_SHM_1W_NONE
+	uint8_t ow_addr[ARDUIPI_SHM_1W_MAX][8];	// 1-Wire ROM codes
+};
+
+// shared memory segment, header, sequence lock and state each start
+// a cache line so the writer don't invalidate header lines of readers
+struct arduipi_shm
+{
+	uint32_t magic;										// ARDUIPI_SHM_MAGIC
+	uint32_t version;									// ARDUIPI_SHM_VERSION
+	uint32_t size;										// sizeof(struct arduipi_shm)
+	uint32_t period_ms;								// update period
+	int32_t owner;										// pid of arduipi, 0 when it stopped
+
+	uint32_t seq __attribute__((aligned(ARDUIPI_SHM_CACHELINE)));	// sequence lock, odd while writing
+
+	struct arduipi_shm_state state __attribute__((aligned(ARDUIPI_SHM_CACHELINE)));
+} __attribute__((aligned(ARDUIPI_SHM_CACHELINE)));
+
+/* ======================================================================
+Function: arduipi_shm_open
+Purpose : map board state segment read only
+Input 	: segment name (ARDUIPI_SHM_NAME by default)
+Output	: segment, NULL if error (errno set, EPROTO if not compatible)
+Comments: -
+====================================================================== */
+static inline struct arduipi_shm * arduipi_shm_open(const char * name)
+{
+	struct arduipi_shm * shm;
+	int fd;
+
+	if ( (fd = shm_open(name, O_RDONLY, 0)) < 0 )
+		return NULL;
+
+	shm = (struct arduipi_shm *) mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if ( shm == MAP_FAILED )
+		return NULL;
+
+	if ( shm->magic != ARDUIPI_SHM_MAGIC || shm->version != ARDUIPI_SHM_VERSION || shm->size != sizeof(*shm) )
+	{
+		munmap(shm, sizeof(*shm));
+		errno = EPROTO;
+		return NULL;
+	}
+
+	return shm;
+}
+
+/* ======================================================================
+Function: arduipi_shm_read
+Purpose : copy a consistent board state
+Input 	: segment
+					state to fill
+Output	: number of retries needed
+Comments: -
+====================================================================== */
+static inline int arduipi_shm_read(const struct arduipi_shm * shm, struct arduipi_shm_state * st)
+{
+	uint32_t s1, s2;
+	int retries = -1;
+
+	do
+	{
+		retries++;
+		s1 = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		memcpy(st, (const void *) &shm->state, sizeof(*st));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED);
+	}
+	while ( (s1 & 1) || s1 != s2 );
+
+	return retries;
+}
+
+/* ======================================================================
+Function: arduipi_shm_close
+Purpose : unmap board state segment
+Input 	: segment
+Output	: -
+Comments: -
+====================================================================== */
+static inline void arduipi_shm_close(struct arduipi_shm * shm)
+{
+	munmap(shm, sizeof(*shm));
+}
+
+#endif
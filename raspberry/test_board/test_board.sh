@@ -26,18 +26,15 @@ done
 echo " "
 echo "Reseting Arduino and waiting ready  "
 echo "------------------------------------"
-# Bring reset LOW for 100ms
-gpio -g write 18 0
-sleep 0.1
-# Put reset back in idle state
-gpio -g write 18 1
-sleep 3
+# Bring reset LOW then wait firmware answer ping
+arduipi --i2c --reset
 
 echo " "
 echo "Testing ArduiPi Serial communication"
 echo "------------------------------------"
-# configure serial port to Arduino compatible mode
-stty -F /dev/ttyAMA0 cs8 -cstopb -parenb 9600 ignbrk -brkint -icrnl -imaxbel -opost -onlcr -isig -icanon -iexten -echo -echoe -echok -echoctl -echoke noflsh -ixon -crtscts 
+# configure serial port to Arduino compatible mode, firmware run at 1 Mbaud
+# (Pi UART clock must be raised, init_uart_clock=16000000 in config.txt)
+stty -F /dev/ttyAMA0 cs8 -cstopb -parenb 1000000 ignbrk -brkint -icrnl -imaxbel -opost -onlcr -isig -icanon -iexten -echo -echoe -echok -echoctl -echoke noflsh -ixon -crtscts 
 echo -n "  Sending serial port command."
 echo "FLUSH" > /dev/ttyAMA0
 sleep 1